@@ -0,0 +1,614 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "containers.h"
+
+/* Prefixes live in one path-compressed binary trie per family, like the
+ * kernel's allowed IPs, so that there are at most two nodes per prefix no
+ * matter how long it is. Nodes refer to each other by index, 0 being none. */
+
+struct trie_node {
+	uint8_t bits[16];
+	uint8_t cidr;
+	bool terminal;
+	uint32_t child[2];
+	uint32_t group;
+};
+
+struct trie {
+	struct trie_node *nodes;
+	uint32_t len, cap;
+	uint32_t root[2];
+};
+
+enum grouping { GROUP_PREFIX, GROUP_SUPERNET, GROUP_ENDPOINT_FILE };
+
+struct group {
+	size_t peers, last_peer;
+	uint64_t rx_bytes, tx_bytes;
+	int family;
+	uint8_t bits[16];
+	uint8_t cidr;
+	const char *name;
+};
+
+struct aggregator {
+	enum grouping grouping;
+	uint8_t cidr[2];
+
+	/* For GROUP_ENDPOINT_FILE, the prefixes of the file, whose nodes' groups index the sorted tags. */
+	struct trie tags;
+	char **tag_names;
+	size_t tags_len;
+
+	struct trie trie;
+	struct group *groups;
+	size_t groups_len, groups_cap;
+	struct aggregate_group *out;
+	char (*names)[INET6_ADDRSTRLEN + 4];
+};
+
+static const uint8_t max_cidr[2] = { 32, 128 };
+static const char *const none_name = "(none)", *const unknown_name = "(unknown)";
+
+static inline unsigned int bit_at(const uint8_t *bits, uint8_t i)
+{
+	return (bits[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static bool prefix_matches(const uint8_t *a, const uint8_t *b, uint8_t cidr)
+{
+	if (memcmp(a, b, cidr / 8))
+		return false;
+	return !(cidr % 8) || !((a[cidr / 8] ^ b[cidr / 8]) & (0xff << (8 - cidr % 8)));
+}
+
+static uint8_t common_bits(const uint8_t *a, const uint8_t *b, uint8_t max)
+{
+	for (unsigned int i = 0; i * 8 < max; ++i) {
+		uint8_t difference = a[i] ^ b[i];
+
+		if (difference) {
+			unsigned int common = i * 8 + __builtin_clz(difference) - 24;
+
+			return common < max ? common : max;
+		}
+	}
+	return max;
+}
+
+static uint32_t node_new(struct trie *trie, const uint8_t *bits, uint8_t cidr)
+{
+	struct trie_node *node;
+
+	if (trie->len >= trie->cap) {
+		uint32_t new_cap = trie->cap ? trie->cap * 2 : 1024;
+		struct trie_node *new_nodes = realloc(trie->nodes, new_cap * sizeof(*new_nodes));
+
+		if (!new_nodes)
+			return 0;
+		trie->nodes = new_nodes;
+		trie->cap = new_cap;
+	}
+	node = &trie->nodes[trie->len];
+	memset(node, 0, sizeof(*node));
+	memcpy(node->bits, bits, (cidr + 7) / 8);
+	if (cidr % 8)
+		node->bits[cidr / 8] &= 0xff << (8 - cidr % 8);
+	node->cidr = cidr;
+	return trie->len++;
+}
+
+static void trie_reset(struct trie *trie)
+{
+	/* Index 0 stands for no node, so it is never handed out. */
+	trie->len = 1;
+	trie->root[0] = trie->root[1] = 0;
+}
+
+static void set_link(struct trie *trie, int family, uint32_t parent, unsigned int side, uint32_t node)
+{
+	if (parent)
+		trie->nodes[parent].child[side] = node;
+	else
+		trie->root[family] = node;
+}
+
+/* Returns the node for exactly this prefix, adding it if needed, or 0 when out of memory. */
+static uint32_t trie_insert(struct trie *trie, int family, const uint8_t *bits, uint8_t cidr)
+{
+	uint32_t node = trie->root[family], parent = 0, added, split;
+	unsigned int side = 0;
+	uint8_t common;
+
+	while (node && trie->nodes[node].cidr <= cidr && prefix_matches(trie->nodes[node].bits, bits, trie->nodes[node].cidr)) {
+		if (trie->nodes[node].cidr == cidr)
+			return node;
+		parent = node;
+		side = bit_at(bits, trie->nodes[node].cidr);
+		node = trie->nodes[node].child[side];
+	}
+	added = node_new(trie, bits, cidr);
+	if (!added)
+		return 0;
+	if (!node) {
+		set_link(trie, family, parent, side, added);
+		return added;
+	}
+	common = common_bits(trie->nodes[node].bits, bits, trie->nodes[node].cidr < cidr ? trie->nodes[node].cidr : cidr);
+	if (common == cidr) {
+		trie->nodes[added].child[bit_at(trie->nodes[node].bits, cidr)] = node;
+		set_link(trie, family, parent, side, added);
+		return added;
+	}
+	split = node_new(trie, bits, common);
+	if (!split)
+		return 0;
+	trie->nodes[split].child[bit_at(bits, common)] = added;
+	trie->nodes[split].child[bit_at(trie->nodes[node].bits, common)] = node;
+	set_link(trie, family, parent, side, split);
+	return added;
+}
+
+/* Returns the shortest or the longest prefix added as terminal that holds the given one, or 0. */
+static uint32_t trie_match(const struct trie *trie, int family, const uint8_t *bits, uint8_t cidr, bool shortest)
+{
+	uint32_t node = trie->root[family], match = 0;
+
+	while (node && trie->nodes[node].cidr <= cidr && prefix_matches(trie->nodes[node].bits, bits, trie->nodes[node].cidr)) {
+		if (trie->nodes[node].terminal) {
+			match = node;
+			if (shortest)
+				break;
+		}
+		if (trie->nodes[node].cidr == cidr)
+			break;
+		node = trie->nodes[node].child[bit_at(bits, trie->nodes[node].cidr)];
+	}
+	return match;
+}
+
+static int allowedip_family(const struct wgallowedip *allowedip, const uint8_t **bits)
+{
+	if (allowedip->family == AF_INET) {
+		*bits = (const uint8_t *)&allowedip->ip4;
+		return 0;
+	}
+	if (allowedip->family == AF_INET6) {
+		*bits = (const uint8_t *)&allowedip->ip6;
+		return 1;
+	}
+	return -1;
+}
+
+static int endpoint_family(const struct wgpeer *peer, const uint8_t **bits)
+{
+	if (peer->endpoint.addr.sa_family == AF_INET) {
+		*bits = (const uint8_t *)&peer->endpoint.addr4.sin_addr;
+		return 0;
+	}
+	if (peer->endpoint.addr.sa_family == AF_INET6) {
+		*bits = (const uint8_t *)&peer->endpoint.addr6.sin6_addr;
+		/* A dual-stack socket reports IPv4 peers this way, but the file lists them as IPv4. */
+		if (IN6_IS_ADDR_V4MAPPED(&peer->endpoint.addr6.sin6_addr)) {
+			*bits += 12;
+			return 0;
+		}
+		return 1;
+	}
+	return -1;
+}
+
+static bool parse_prefix(int *family, uint8_t bits[static 16], uint8_t *cidr, char *value)
+{
+	char *slash = strchr(value, '/'), *end;
+	unsigned long length;
+
+	if (slash)
+		*slash = '\0';
+	if (inet_pton(AF_INET, value, bits) == 1)
+		*family = 0;
+	else if (inet_pton(AF_INET6, value, bits) == 1)
+		*family = 1;
+	else
+		return false;
+	*cidr = max_cidr[*family];
+	if (!slash)
+		return true;
+	if (slash[1] < '0' || slash[1] > '9')
+		return false;
+	length = strtoul(slash + 1, &end, 10);
+	if (*end || length > max_cidr[*family])
+		return false;
+	*cidr = length;
+	return true;
+}
+
+static int tag_cmp(const void *first, const void *second)
+{
+	return strcmp(*(char *const *)first, *(char *const *)second);
+}
+
+/* Lines of `<prefix> <tag>', such as an ASN or a customer name, where the longest prefix holding an endpoint wins. */
+static bool load_endpoint_file(struct aggregator *aggregator, const char *path)
+{
+	struct entry {
+		int family;
+		uint8_t bits[16];
+		uint8_t cidr;
+		char *tag;
+		uint32_t group;
+	} *entries = NULL;
+	size_t entries_len = 0, entries_cap = 0, line_number = 0, line_len = 0, i;
+	char *line = NULL, *prefix, *tag, *saveptr;
+	bool ret = false;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror("fopen");
+		return false;
+	}
+	while (getline(&line, &line_len, f) >= 0) {
+		++line_number;
+		line[strcspn(line, "#")] = '\0';
+		prefix = strtok_r(line, " \t\r\n", &saveptr);
+		if (!prefix)
+			continue;
+		tag = strtok_r(NULL, " \t\r\n", &saveptr);
+		if (entries_len == entries_cap) {
+			size_t new_cap = entries_cap ? entries_cap * 2 : 1024;
+			struct entry *new_entries = realloc(entries, new_cap * sizeof(*new_entries));
+
+			if (!new_entries) {
+				perror("realloc");
+				goto out;
+			}
+			entries = new_entries;
+			entries_cap = new_cap;
+		}
+		if (!tag || strtok_r(NULL, " \t\r\n", &saveptr) ||
+		    !parse_prefix(&entries[entries_len].family, entries[entries_len].bits, &entries[entries_len].cidr, prefix)) {
+			fprintf(stderr, "%s:%zu: Line is not a prefix followed by a tag\n", path, line_number);
+			goto out;
+		}
+		entries[entries_len].tag = strdup(tag);
+		if (!entries[entries_len].tag) {
+			perror("strdup");
+			goto out;
+		}
+		++entries_len;
+	}
+	if (ferror(f)) {
+		perror("getline");
+		goto out;
+	}
+
+	/* Tags repeat across many prefixes, so they are interned in sorted order, which is also the order they are printed in. */
+	aggregator->tag_names = calloc(entries_len ?: 1, sizeof(*aggregator->tag_names));
+	if (!aggregator->tag_names) {
+		perror("calloc");
+		goto out;
+	}
+	for (i = 0; i < entries_len; ++i)
+		aggregator->tag_names[i] = entries[i].tag;
+	qsort(aggregator->tag_names, entries_len, sizeof(*aggregator->tag_names), tag_cmp);
+	for (i = 0; i < entries_len; ++i) {
+		if (!aggregator->tags_len || strcmp(aggregator->tag_names[aggregator->tags_len - 1], aggregator->tag_names[i]))
+			aggregator->tag_names[aggregator->tags_len++] = aggregator->tag_names[i];
+	}
+	for (i = 0; i < entries_len; ++i) {
+		char **name = bsearch(&entries[i].tag, aggregator->tag_names, aggregator->tags_len, sizeof(*aggregator->tag_names), tag_cmp);
+
+		if (*name != entries[i].tag)
+			free(entries[i].tag);
+		entries[i].tag = NULL;
+		entries[i].group = name - aggregator->tag_names;
+	}
+	trie_reset(&aggregator->tags);
+	for (i = 0; i < entries_len; ++i) {
+		uint32_t node = trie_insert(&aggregator->tags, entries[i].family, entries[i].bits, entries[i].cidr);
+
+		if (!node) {
+			perror("realloc");
+			goto out;
+		}
+		/* When a prefix is listed twice, the last line wins. */
+		aggregator->tags.nodes[node].terminal = true;
+		aggregator->tags.nodes[node].group = entries[i].group;
+	}
+	ret = true;
+
+out:
+	if (!ret) {
+		for (i = 0; i < entries_len; ++i)
+			free(entries[i].tag);
+		for (i = 0; i < aggregator->tags_len; ++i)
+			free(aggregator->tag_names[i]);
+		free(aggregator->tag_names);
+		aggregator->tag_names = NULL;
+		aggregator->tags_len = 0;
+	}
+	free(entries);
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static bool parse_prefix_lengths(struct aggregator *aggregator, const char *value)
+{
+	unsigned long length;
+	char *end;
+
+	if (*value < '0' || *value > '9')
+		return false;
+	length = strtoul(value, &end, 10);
+	if (length > 32)
+		return false;
+	aggregator->cidr[0] = length;
+	/* A length that makes sense for IPv4 rarely does for IPv6, which gets its own after a comma, or else a /64 per subnet. */
+	aggregator->cidr[1] = 64;
+	if (!*end)
+		return true;
+	if (*end != ',' || end[1] < '0' || end[1] > '9')
+		return false;
+	length = strtoul(end + 1, &end, 10);
+	if (*end || length > 128)
+		return false;
+	aggregator->cidr[1] = length;
+	return true;
+}
+
+struct aggregator *aggregator_new(int argc, char *argv[])
+{
+	struct aggregator *aggregator = calloc(1, sizeof(*aggregator));
+
+	if (!aggregator) {
+		perror("calloc");
+		return NULL;
+	}
+	if (argc < 2 || strcmp(argv[0], "--by"))
+		goto usage;
+	if (!strncmp(argv[1], "prefix/", 7) && argc == 2) {
+		aggregator->grouping = GROUP_PREFIX;
+		if (!parse_prefix_lengths(aggregator, argv[1] + 7)) {
+			fprintf(stderr, "Prefix length is not from 0 to 32, optionally followed by a comma and one from 0 to 128 for IPv6: `%s'\n", argv[1] + 7);
+			goto err;
+		}
+	} else if (!strcmp(argv[1], "allowed-ip-supernet") && argc == 2)
+		aggregator->grouping = GROUP_SUPERNET;
+	else if (!strcmp(argv[1], "endpoint-asn-file") && argc == 3) {
+		aggregator->grouping = GROUP_ENDPOINT_FILE;
+		if (!load_endpoint_file(aggregator, argv[2]))
+			goto err;
+	} else
+		goto usage;
+	return aggregator;
+
+usage:
+	fprintf(stderr, "Aggregation is by one of: --by prefix/<length>[,<IPv6 length>], --by allowed-ip-supernet, --by endpoint-asn-file <file>\n");
+err:
+	aggregator_free(aggregator);
+	return NULL;
+}
+
+static struct group *group_new(struct aggregator *aggregator)
+{
+	if (aggregator->groups_len == aggregator->groups_cap) {
+		size_t new_cap = aggregator->groups_cap ? aggregator->groups_cap * 2 : 256;
+		struct group *new_groups = realloc(aggregator->groups, new_cap * sizeof(*new_groups));
+
+		if (!new_groups)
+			return NULL;
+		aggregator->groups = new_groups;
+		aggregator->groups_cap = new_cap;
+	}
+	memset(&aggregator->groups[aggregator->groups_len], 0, sizeof(*aggregator->groups));
+	return &aggregator->groups[aggregator->groups_len++];
+}
+
+/* A peer whose allowed IPs fall into several groups counts fully toward each, but only once toward any. */
+static void group_add(struct group *group, const struct wgpeer *peer, size_t peer_number)
+{
+	if (group->last_peer == peer_number)
+		return;
+	group->last_peer = peer_number;
+	++group->peers;
+	group->rx_bytes += peer->rx_bytes;
+	group->tx_bytes += peer->tx_bytes;
+}
+
+/* Returns the group of the prefix's node in the run's trie, which is 1 more than its index, creating it if needed. */
+static size_t prefix_group(struct aggregator *aggregator, uint32_t node, int family)
+{
+	struct trie_node *trie_node = &aggregator->trie.nodes[node];
+	struct group *group;
+
+	if (trie_node->group)
+		return trie_node->group;
+	group = group_new(aggregator);
+	if (!group)
+		return 0;
+	group->family = family;
+	memcpy(group->bits, trie_node->bits, sizeof(group->bits));
+	group->cidr = trie_node->cidr;
+	trie_node->group = aggregator->groups_len;
+	return trie_node->group;
+}
+
+static int group_cmp(const void *first, const void *second)
+{
+	const struct group *a = first, *b = second;
+	int ret;
+
+	if (!a->name != !b->name)
+		return a->name ? 1 : -1;
+	if (a->family != b->family)
+		return a->family < b->family ? -1 : 1;
+	ret = memcmp(a->bits, b->bits, sizeof(a->bits));
+	if (ret)
+		return ret;
+	return a->cidr < b->cidr ? -1 : a->cidr > b->cidr;
+}
+
+static bool group_by_prefix(struct aggregator *aggregator, const struct wgdevice *device, struct group *none)
+{
+	const struct wgallowedip *allowedip;
+	const struct wgpeer *peer;
+	size_t peer_number = 0, group;
+	const uint8_t *bits;
+	uint32_t node;
+	int family;
+
+	/* Supernets are only known once every allowed IP is in the trie, so that takes a first pass of its own. */
+	if (aggregator->grouping == GROUP_SUPERNET) {
+		for_each_wgpeer(device, peer) {
+			for_each_wgallowedip(peer, allowedip) {
+				family = allowedip_family(allowedip, &bits);
+				if (family < 0)
+					continue;
+				node = trie_insert(&aggregator->trie, family, bits, allowedip->cidr);
+				if (!node)
+					return false;
+				aggregator->trie.nodes[node].terminal = true;
+			}
+		}
+	}
+	for_each_wgpeer(device, peer) {
+		bool grouped = false;
+
+		++peer_number;
+		for_each_wgallowedip(peer, allowedip) {
+			family = allowedip_family(allowedip, &bits);
+			if (family < 0)
+				continue;
+			if (aggregator->grouping == GROUP_SUPERNET)
+				node = trie_match(&aggregator->trie, family, bits, allowedip->cidr, true);
+			else
+				node = trie_insert(&aggregator->trie, family, bits, allowedip->cidr < aggregator->cidr[family] ? allowedip->cidr : aggregator->cidr[family]);
+			if (!node)
+				return false;
+			group = prefix_group(aggregator, node, family);
+			if (!group)
+				return false;
+			group_add(&aggregator->groups[group - 1], peer, peer_number);
+			grouped = true;
+		}
+		if (!grouped)
+			group_add(none, peer, peer_number);
+	}
+	return true;
+}
+
+static bool group_by_endpoint(struct aggregator *aggregator, const struct wgdevice *device, struct group *none, struct group *unknown)
+{
+	const struct wgpeer *peer;
+	size_t peer_number = 0;
+	const uint8_t *bits;
+	uint32_t node;
+	int family;
+
+	/* Every tag gets a group up front, in the order of the names, and those left empty are dropped afterwards. */
+	for (size_t i = 0; i < aggregator->tags_len; ++i) {
+		struct group *group = group_new(aggregator);
+
+		if (!group)
+			return false;
+		group->name = aggregator->tag_names[i];
+	}
+	for_each_wgpeer(device, peer) {
+		++peer_number;
+		family = endpoint_family(peer, &bits);
+		if (family < 0) {
+			group_add(none, peer, peer_number);
+			continue;
+		}
+		node = trie_match(&aggregator->tags, family, bits, max_cidr[family], false);
+		if (node)
+			group_add(&aggregator->groups[aggregator->tags.nodes[node].group], peer, peer_number);
+		else
+			group_add(unknown, peer, peer_number);
+	}
+	return true;
+}
+
+const struct aggregate_group *aggregator_run(struct aggregator *aggregator, const struct wgdevice *device, size_t *len)
+{
+	struct group none = { .name = none_name }, unknown = { .name = unknown_name };
+	size_t out_len = 0;
+
+	trie_reset(&aggregator->trie);
+	aggregator->groups_len = 0;
+	if (aggregator->grouping == GROUP_ENDPOINT_FILE) {
+		if (!group_by_endpoint(aggregator, device, &none, &unknown))
+			goto err;
+	} else {
+		if (!group_by_prefix(aggregator, device, &none))
+			goto err;
+		qsort(aggregator->groups, aggregator->groups_len, sizeof(*aggregator->groups), group_cmp);
+	}
+
+	free(aggregator->out);
+	free(aggregator->names);
+	aggregator->out = calloc(aggregator->groups_len + 2, sizeof(*aggregator->out));
+	aggregator->names = calloc(aggregator->groups_len ?: 1, sizeof(*aggregator->names));
+	if (!aggregator->out || !aggregator->names)
+		goto err;
+	for (size_t i = 0; i < aggregator->groups_len + 2; ++i) {
+		const struct group *group = i < aggregator->groups_len ? &aggregator->groups[i] : i == aggregator->groups_len ? &unknown : &none;
+
+		if (!group->peers)
+			continue;
+		if (group->name)
+			aggregator->out[out_len].name = group->name;
+		else {
+			char *name = aggregator->names[i];
+
+			inet_ntop(group->family ? AF_INET6 : AF_INET, group->bits, name, INET6_ADDRSTRLEN);
+			sprintf(name + strlen(name), "/%u", group->cidr);
+			aggregator->out[out_len].name = name;
+		}
+		aggregator->out[out_len].peers = group->peers;
+		aggregator->out[out_len].rx_bytes = group->rx_bytes;
+		aggregator->out[out_len].tx_bytes = group->tx_bytes;
+		++out_len;
+	}
+	*len = out_len;
+	return aggregator->out;
+
+err:
+	errno = ENOMEM;
+	return NULL;
+}
+
+bool aggregator_by_endpoint(const struct aggregator *aggregator)
+{
+	return aggregator->grouping == GROUP_ENDPOINT_FILE;
+}
+
+void aggregator_free(struct aggregator *aggregator)
+{
+	if (!aggregator)
+		return;
+	for (size_t i = 0; i < aggregator->tags_len; ++i)
+		free(aggregator->tag_names[i]);
+	free(aggregator->tag_names);
+	free(aggregator->tags.nodes);
+	free(aggregator->trie.nodes);
+	free(aggregator->groups);
+	free(aggregator->out);
+	free(aggregator->names);
+	free(aggregator);
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct wgdevice;
+struct aggregator;
+
+struct aggregate_group {
+	const char *name;
+	size_t peers;
+	uint64_t rx_bytes, tx_bytes;
+};
+
+/* Takes the arguments following `aggregate', which are `--by' and a grouping, and complains about them itself. */
+struct aggregator *aggregator_new(int argc, char *argv[]);
+/* The groups are sorted by address, or by name for a file of endpoint prefixes, with peers that fall in
+ * none last, and are valid until the next call. Returns NULL with errno set on failure. */
+const struct aggregate_group *aggregator_run(struct aggregator *aggregator, const struct wgdevice *device, size_t *len);
+/* Whether peers are grouped by their endpoints, rather than by their allowed IPs. */
+bool aggregator_by_endpoint(const struct aggregator *aggregator);
+void aggregator_free(struct aggregator *aggregator);
+
+#endif
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef ALLOWEDIPS_H
+#define ALLOWEDIPS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "containers.h"
+
+/* Clears the bits of an address past its prefix, as the kernel does when storing it. */
+static inline void allowedip_mask_bits(uint8_t *bits, uint16_t family, uint8_t cidr)
+{
+	unsigned int len = family == AF_INET ? 4 : 16;
+
+	if (cidr >= len * 8)
+		return;
+	bits[cidr / 8] &= ~(0xff >> (cidr % 8));
+	memset(bits + cidr / 8 + 1, 0, len - cidr / 8 - 1);
+}
+
+static inline void allowedip_mask(struct wgallowedip *allowedip)
+{
+	allowedip_mask_bits((uint8_t *)&allowedip->ip6, allowedip->family, allowedip->cidr);
+}
+
+/* Orders by family, then prefix length, then address, so that equal prefixes sort together. */
+static inline int allowedip_cmp(const struct wgallowedip *a, const struct wgallowedip *b)
+{
+	if (a->family != b->family)
+		return a->family < b->family ? -1 : 1;
+	if (a->cidr != b->cidr)
+		return a->cidr < b->cidr ? -1 : 1;
+	return memcmp(&a->ip6, &b->ip6, a->family == AF_INET ? sizeof(a->ip4) : sizeof(a->ip6));
+}
+
+#endif
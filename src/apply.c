@@ -0,0 +1,576 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "allowedips.h"
+#include "apply.h"
+#include "containers.h"
+#include "ipc.h"
+
+#define APPLY_MIN_CHUNK_SIZE 1024
+
+static unsigned long apply_env(const char *name)
+{
+	const char *var = getenv(name);
+	unsigned long ret;
+	char *end;
+
+	if (!var || !*var)
+		return 0;
+	ret = strtoul(var, &end, 10);
+	return *end ? 0 : ret;
+}
+
+void apply_schedule_init(struct apply_schedule *schedule, const struct wgdevice *dev)
+{
+	const char *timing = getenv("WG_APPLY_TIMING");
+
+	memset(schedule, 0, sizeof(*schedule));
+	schedule->timing = timing && !strcmp(timing, "1");
+	if (dev->flags & WGDEVICE_REPLACE_PEERS)
+		return;
+	schedule->chunk_size = apply_env("WG_APPLY_CHUNK_SIZE");
+	if (schedule->chunk_size && schedule->chunk_size < APPLY_MIN_CHUNK_SIZE)
+		schedule->chunk_size = APPLY_MIN_CHUNK_SIZE;
+	schedule->pacing_ms = apply_env("WG_APPLY_PACING");
+}
+
+static uint64_t apply_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void apply_chunk_start(struct apply_schedule *schedule)
+{
+	if (schedule->timing)
+		schedule->started_ns = apply_now_ns();
+}
+
+void apply_chunk_done(struct apply_schedule *schedule, const char *interface, size_t peers, size_t bytes, bool more)
+{
+	++schedule->chunks;
+	if (schedule->timing)
+		fprintf(stderr, "%s: chunk %u: %zu peers, %zu bytes, applied in %.3f ms\n", interface, schedule->chunks, peers, bytes,
+			(apply_now_ns() - schedule->started_ns) / 1000000.0);
+	if (more && schedule->pacing_ms) {
+		struct timespec pause = { .tv_sec = schedule->pacing_ms / 1000, .tv_nsec = (schedule->pacing_ms % 1000) * 1000000L };
+
+		while (nanosleep(&pause, &pause) < 0 && errno == EINTR);
+	}
+}
+
+/* With WG_ALLOWED_IPS_ORDER=sorted, the allowed IPs of a set are handed over
+ * by family and address, each prefix before those it holds, so that the
+ * trie on the other end only ever grows at its edge rather than splitting
+ * and reparenting nodes it has already placed. Within a peer the order makes
+ * no difference to the result. Across peers it does when two name the same
+ * prefix or are the same peer, since the last one wins, so peers are only
+ * reordered, by their first prefix, when that cannot happen. */
+struct ordered_ip {
+	uint8_t bits[16];
+	uint8_t family, cidr;
+	uint32_t peer;
+	struct wgallowedip *allowedip;
+};
+
+static inline uint8_t ordered_ip_digit(const struct ordered_ip *ip, unsigned int digit, unsigned int len)
+{
+	return digit == len ? ip->cidr : ip->bits[digit];
+}
+
+/* A comparison sort of a million prefixes takes longer than the trie saves,
+ * so this is a stable byte-wise radix sort, least significant first: the
+ * length, then the address from its last byte, within each family. Ties
+ * keep the order of the peers, which they are filled in by. Every digit is
+ * counted in one pass beforehand, so each later pass only moves entries.
+ * The result is left in tmp. */
+static void ordered_ip_sort(struct ordered_ip *ips, struct ordered_ip *tmp, size_t len)
+{
+	static __thread size_t counts[17][256];
+	size_t v4_len = 0, i;
+
+	for (i = 0; i < len; ++i)
+		v4_len += !ips[i].family;
+	for (size_t v4 = 0, v6 = v4_len, j = 0; j < len; ++j)
+		tmp[ips[j].family ? v6++ : v4++] = ips[j];
+
+	for (unsigned int family = 0; family < 2; ++family) {
+		struct ordered_ip *from = tmp + (family ? v4_len : 0), *to = ips + (family ? v4_len : 0), *swap;
+		size_t family_len = family ? len - v4_len : v4_len;
+		unsigned int bytes = family ? 16 : 4;
+
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < family_len; ++i) {
+			for (unsigned int digit = 0; digit <= bytes; ++digit)
+				++counts[digit][ordered_ip_digit(&from[i], digit, bytes)];
+		}
+		for (int digit = bytes; digit >= 0; --digit) {
+			size_t offset = 0;
+
+			if (family_len && counts[digit][ordered_ip_digit(&from[0], digit, bytes)] == family_len)
+				continue;
+			for (i = 0; i < 256; ++i) {
+				size_t count = counts[digit][i];
+
+				counts[digit][i] = offset;
+				offset += count;
+			}
+			for (i = 0; i < family_len; ++i)
+				to[counts[digit][ordered_ip_digit(&from[i], digit, bytes)]++] = from[i];
+			swap = from;
+			from = to;
+			to = swap;
+		}
+		/* Both families must end up in the same array. */
+		if (from != tmp + (family ? v4_len : 0))
+			memcpy(tmp + (family ? v4_len : 0), from, family_len * sizeof(*from));
+	}
+}
+
+static bool add_ordered_ip(struct ordered_ip **ips, size_t *len, size_t *cap, struct wgallowedip *allowedip, uint32_t peer)
+{
+	uint8_t bytes = allowedip->family == AF_INET ? 4 : 16;
+	struct ordered_ip *ip;
+
+	if (*len == *cap) {
+		struct ordered_ip *new_ips;
+
+		*cap = *cap ? *cap * 2 : 4096;
+		new_ips = realloc(*ips, *cap * sizeof(**ips));
+		if (!new_ips)
+			return false;
+		*ips = new_ips;
+	}
+	ip = &(*ips)[(*len)++];
+
+	memset(ip->bits, 0, sizeof(ip->bits));
+	memcpy(ip->bits, &allowedip->ip6, bytes);
+	allowedip_mask_bits(ip->bits, allowedip->family, allowedip->cidr);
+	ip->family = allowedip->family == AF_INET ? 0 : 1;
+	ip->cidr = allowedip->cidr;
+	ip->peer = peer;
+	ip->allowedip = allowedip;
+	return true;
+}
+
+static bool ordered_ip_same(const struct ordered_ip *a, const struct ordered_ip *b)
+{
+	return a->family == b->family && a->cidr == b->cidr && !memcmp(a->bits, b->bits, sizeof(a->bits));
+}
+
+static int peer_key_cmp(const void *first, const void *second)
+{
+	return memcmp((*(struct wgpeer *const *)first)->public_key, (*(struct wgpeer *const *)second)->public_key, WG_KEY_LEN);
+}
+
+struct peer_rank {
+	size_t rank, index;
+	struct wgpeer *peer;
+};
+
+static int peer_rank_cmp(const void *first, const void *second)
+{
+	const struct peer_rank *a = first, *b = second;
+
+	if (a->rank != b->rank)
+		return a->rank < b->rank ? -1 : 1;
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static bool allowedips_sorted(void)
+{
+	const char *var = getenv("WG_ALLOWED_IPS_ORDER");
+
+	return var && !strcmp(var, "sorted");
+}
+
+/* Being only an optimization, this leaves the order alone when out of memory. */
+static void order_allowedips(struct wgdevice *dev)
+{
+	struct ordered_ip *ips = NULL, *sorted = NULL;
+	struct peer_rank *ranks = NULL;
+	struct wgpeer **peers = NULL, *peer;
+	struct wgallowedip *allowedip;
+	size_t peers_len = 0, ips_len = 0, ips_cap = 0, i;
+	bool reorder_peers = true;
+
+	for_each_wgpeer(dev, peer)
+		++peers_len;
+	if (!peers_len || peers_len > UINT32_MAX)
+		return;
+	peers = malloc(peers_len * sizeof(*peers));
+	ranks = calloc(peers_len, sizeof(*ranks));
+	if (!peers || !ranks)
+		goto out;
+
+	/* The allowed IPs are scattered over the heap, so they are walked only once, growing the array as needed. */
+	peers_len = 0;
+	for_each_wgpeer(dev, peer) {
+		for_each_wgallowedip(peer, allowedip) {
+			if (!add_ordered_ip(&ips, &ips_len, &ips_cap, allowedip, peers_len))
+				goto out;
+		}
+		peers[peers_len++] = peer;
+	}
+	if (!ips_len)
+		goto out;
+	sorted = malloc(ips_len * sizeof(*sorted));
+	if (!sorted)
+		goto out;
+	for_each_wgpeer(dev, peer)
+		peer->first_allowedip = peer->last_allowedip = NULL;
+	ordered_ip_sort(ips, sorted, ips_len);
+	for (i = 0; i < ips_len; ++i) {
+		peer = peers[sorted[i].peer];
+		sorted[i].allowedip->next_allowedip = NULL;
+		if (peer->last_allowedip)
+			peer->last_allowedip->next_allowedip = sorted[i].allowedip;
+		else
+			peer->first_allowedip = sorted[i].allowedip;
+		peer->last_allowedip = sorted[i].allowedip;
+		if (!ranks[sorted[i].peer].rank)
+			ranks[sorted[i].peer].rank = i + 1;
+		if (i && sorted[i].peer != sorted[i - 1].peer && ordered_ip_same(&sorted[i], &sorted[i - 1]))
+			reorder_peers = false;
+	}
+	if (!reorder_peers)
+		goto out;
+	qsort(peers, peers_len, sizeof(*peers), peer_key_cmp);
+	for (i = 1; i < peers_len; ++i) {
+		if (!memcmp(peers[i]->public_key, peers[i - 1]->public_key, WG_KEY_LEN))
+			goto out;
+	}
+
+	/* Peers without allowed IPs, such as those being removed, keep their order ahead of the rest. */
+	i = 0;
+	for_each_wgpeer(dev, peer) {
+		ranks[i].index = i;
+		ranks[i++].peer = peer;
+	}
+	qsort(ranks, peers_len, sizeof(*ranks), peer_rank_cmp);
+	for (i = 0; i < peers_len; ++i)
+		ranks[i].peer->next_peer = i + 1 < peers_len ? ranks[i + 1].peer : NULL;
+	dev->first_peer = ranks[0].peer;
+	dev->last_peer = ranks[peers_len - 1].peer;
+
+out:
+	free(ips);
+	free(sorted);
+	free(peers);
+	free(ranks);
+}
+
+static bool peers_by_handshake(void)
+{
+	const char *var = getenv("WG_APPLY_ORDER");
+
+	return var && !strcmp(var, "handshake");
+}
+
+/* With WG_APPLY_ORDER=handshake, peers go out in order of how recently they
+ * last completed a handshake on the interface, so that when a large set is
+ * applied in paced chunks, the peers most likely in use are back first. Peers
+ * being removed go ahead of the rest, and those never seen last. As with
+ * sorting, peers are only reordered when the order cannot change the result. */
+static void order_peers_by_handshake(struct wgdevice *dev)
+{
+	struct wgdevice *current = NULL;
+	struct ordered_ip *ips = NULL, *sorted = NULL;
+	struct peer_rank *ranks = NULL;
+	struct wgpeer **peers = NULL, **known = NULL, *peer;
+	struct wgallowedip *allowedip;
+	size_t peers_len = 0, known_len = 0, ips_len = 0, ips_cap = 0, i;
+	time_t now = time(NULL);
+	unsigned int fields;
+	int ret;
+
+	for_each_wgpeer(dev, peer)
+		++peers_len;
+	if (peers_len < 2 || peers_len > UINT32_MAX)
+		return;
+	peers = malloc(peers_len * sizeof(*peers));
+	ranks = calloc(peers_len, sizeof(*ranks));
+	if (!peers || !ranks)
+		goto out;
+	i = 0;
+	for_each_wgpeer(dev, peer) {
+		for_each_wgallowedip(peer, allowedip) {
+			if (!add_ordered_ip(&ips, &ips_len, &ips_cap, allowedip, i))
+				goto out;
+		}
+		ranks[i].index = i;
+		ranks[i].peer = peer;
+		peers[i++] = peer;
+	}
+	if (ips_len) {
+		sorted = malloc(ips_len * sizeof(*sorted));
+		if (!sorted)
+			goto out;
+		ordered_ip_sort(ips, sorted, ips_len);
+		for (i = 1; i < ips_len; ++i) {
+			if (sorted[i].peer != sorted[i - 1].peer && ordered_ip_same(&sorted[i], &sorted[i - 1]))
+				goto out;
+		}
+	}
+	qsort(peers, peers_len, sizeof(*peers), peer_key_cmp);
+	for (i = 1; i < peers_len; ++i) {
+		if (!memcmp(peers[i]->public_key, peers[i - 1]->public_key, WG_KEY_LEN))
+			goto out;
+	}
+
+	fields = ipc_device_fields(IPC_FIELD_HANDSHAKES);
+	ret = ipc_get_device(&current, dev->name);
+	ipc_device_fields(fields);
+	if (ret < 0)
+		goto out;
+	for_each_wgpeer(current, peer)
+		++known_len;
+	if (!known_len)
+		goto out;
+	known = malloc(known_len * sizeof(*known));
+	if (!known)
+		goto out;
+	i = 0;
+	for_each_wgpeer(current, peer)
+		known[i++] = peer;
+	qsort(known, known_len, sizeof(*known), peer_key_cmp);
+
+	for (i = 0; i < peers_len; ++i) {
+		struct wgpeer **found;
+
+		if (ranks[i].peer->flags & WGPEER_REMOVE_ME)
+			continue;
+		found = bsearch(&ranks[i].peer, known, known_len, sizeof(*known), peer_key_cmp);
+		if (found && (*found)->last_handshake_time.tv_sec)
+			ranks[i].rank = 1 + (now > (*found)->last_handshake_time.tv_sec ? now - (*found)->last_handshake_time.tv_sec : 0);
+		else
+			ranks[i].rank = SIZE_MAX;
+	}
+	qsort(ranks, peers_len, sizeof(*ranks), peer_rank_cmp);
+	for (i = 0; i < peers_len; ++i)
+		ranks[i].peer->next_peer = i + 1 < peers_len ? ranks[i + 1].peer : NULL;
+	dev->first_peer = ranks[0].peer;
+	dev->last_peer = ranks[peers_len - 1].peer;
+
+out:
+	free_wgdevice(current);
+	free(known);
+	free(ips);
+	free(sorted);
+	free(peers);
+	free(ranks);
+}
+
+/* Neither kernels before Linux 6.16 nor the userspace protocol can remove a
+ * single allowed IP, so a peer given some to remove instead has its current
+ * ones, along with any that earlier entries for it in the same set add,
+ * replaced by the result of applying its edits in order. Peers only given
+ * some to add just add them, leaving the rest alone. */
+struct allowedip_edit {
+	struct wgallowedip allowedip;
+	size_t seq;
+};
+
+static int allowedip_edit_cmp(const void *first, const void *second)
+{
+	const struct allowedip_edit *a = first, *b = second;
+	int ret = allowedip_cmp(&a->allowedip, &b->allowedip);
+
+	if (ret)
+		return ret;
+	return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static bool add_edits(struct allowedip_edit **edits, size_t *len, size_t *cap, const struct wgpeer *peer, size_t seq)
+{
+	struct wgallowedip *allowedip;
+
+	for_each_wgallowedip(peer, allowedip) {
+		struct allowedip_edit *edit;
+
+		if (allowedip->family != AF_INET && allowedip->family != AF_INET6)
+			continue;
+		if (*len == *cap) {
+			struct allowedip_edit *new_edits;
+
+			*cap = *cap ? *cap * 2 : 64;
+			new_edits = realloc(*edits, *cap * sizeof(**edits));
+			if (!new_edits)
+				return false;
+			*edits = new_edits;
+		}
+		edit = &(*edits)[(*len)++];
+		memset(edit, 0, sizeof(*edit));
+		edit->allowedip.family = allowedip->family;
+		edit->allowedip.cidr = allowedip->cidr;
+		edit->allowedip.flags = allowedip->flags;
+		memcpy(&edit->allowedip.ip6, &allowedip->ip6, allowedip->family == AF_INET ? sizeof(allowedip->ip4) : sizeof(allowedip->ip6));
+		allowedip_mask(&edit->allowedip);
+		edit->seq = seq ? seq++ : 0;
+	}
+	return true;
+}
+
+static bool has_removals(const struct wgpeer *peer)
+{
+	struct wgallowedip *allowedip;
+
+	for_each_wgallowedip(peer, allowedip) {
+		if (allowedip->flags & WGALLOWEDIP_REMOVE_ME)
+			return true;
+	}
+	return false;
+}
+
+static int resolve_removals(struct wgdevice *dev, struct wgpeer *peer, struct wgpeer **current, size_t current_len)
+{
+	struct allowedip_edit *edits = NULL;
+	struct wgallowedip *allowedip, *next;
+	struct wgpeer *base, *start, *earlier;
+	size_t len = 0, cap = 0, kept = 0;
+
+	/* Earlier entries for the peer have already been resolved, so only the last that replaced
+	 * its allowed IPs, or removed it, matters, along with what those after it add. */
+	if (!(peer->flags & WGPEER_REPLACE_ALLOWEDIPS)) {
+		struct wgpeer **found = bsearch(&peer, current, current_len, sizeof(*current), peer_key_cmp);
+
+		base = found ? *found : NULL;
+		start = dev->first_peer;
+		for (earlier = dev->first_peer; earlier != peer; earlier = earlier->next_peer) {
+			if (memcmp(earlier->public_key, peer->public_key, WG_KEY_LEN) || !(earlier->flags & (WGPEER_REMOVE_ME | WGPEER_REPLACE_ALLOWEDIPS)))
+				continue;
+			base = earlier->flags & WGPEER_REMOVE_ME ? NULL : earlier;
+			start = earlier->next_peer;
+		}
+		if (base && !add_edits(&edits, &len, &cap, base, 0))
+			goto err;
+		for (earlier = start; earlier != peer; earlier = earlier->next_peer) {
+			if (!memcmp(earlier->public_key, peer->public_key, WG_KEY_LEN) && !add_edits(&edits, &len, &cap, earlier, 0))
+				goto err;
+		}
+	}
+	if (!add_edits(&edits, &len, &cap, peer, 1))
+		goto err;
+	qsort(edits, len, sizeof(*edits), allowedip_edit_cmp);
+	for (size_t i = 0; i < len; ++i) {
+		/* The last edit of a prefix wins. */
+		if (i + 1 < len && !allowedip_cmp(&edits[i].allowedip, &edits[i + 1].allowedip))
+			continue;
+		if (!(edits[i].allowedip.flags & WGALLOWEDIP_REMOVE_ME))
+			edits[kept++] = edits[i];
+	}
+
+	for (allowedip = peer->first_allowedip; allowedip; allowedip = next) {
+		next = allowedip->next_allowedip;
+		free(allowedip);
+	}
+	peer->first_allowedip = peer->last_allowedip = NULL;
+	peer->flags |= WGPEER_REPLACE_ALLOWEDIPS;
+	for (size_t i = 0; i < kept; ++i) {
+		allowedip = malloc(sizeof(*allowedip));
+		if (!allowedip)
+			goto err;
+		*allowedip = edits[i].allowedip;
+		allowedip->flags = 0;
+		allowedip->next_allowedip = NULL;
+		if (peer->last_allowedip)
+			peer->last_allowedip->next_allowedip = allowedip;
+		else
+			peer->first_allowedip = allowedip;
+		peer->last_allowedip = allowedip;
+	}
+	free(edits);
+	return 0;
+
+err:
+	free(edits);
+	return -ENOMEM;
+}
+
+/* Only the peers with removals and without their allowed IPs replaced need
+ * what the interface has now, so only theirs are fetched. */
+int apply_resolve_removals(struct wgdevice *dev)
+{
+	struct wgdevice *current = NULL;
+	struct wgpeer **wanted = NULL, **index = NULL, *peer, *current_peer;
+	size_t wanted_len = 0, index_len = 0;
+	int ret = 0;
+
+	for_each_wgpeer(dev, peer) {
+		if (has_removals(peer) && !(peer->flags & WGPEER_REPLACE_ALLOWEDIPS))
+			++wanted_len;
+	}
+	if (wanted_len) {
+		bool forwarding;
+		unsigned int fields;
+
+		wanted = malloc(wanted_len * sizeof(*wanted));
+		if (!wanted)
+			return -ENOMEM;
+		wanted_len = 0;
+		for_each_wgpeer(dev, peer) {
+			if (has_removals(peer) && !(peer->flags & WGPEER_REPLACE_ALLOWEDIPS))
+				wanted[wanted_len++] = peer;
+		}
+		qsort(wanted, wanted_len, sizeof(*wanted), peer_key_cmp);
+
+		/* A daemon's copy may be out of date, and what it lacks would be added back. */
+		forwarding = ipc_daemon_forwarding(false);
+		fields = ipc_device_fields(IPC_FIELD_ALLOWEDIPS);
+		ipc_device_allowedips_peers(wanted, wanted_len);
+		ret = ipc_get_device(&current, dev->name);
+		ipc_device_allowedips_peers(NULL, 0);
+		ipc_device_fields(fields);
+		ipc_daemon_forwarding(forwarding);
+		if (ret < 0)
+			goto out;
+		for_each_wgpeer(current, current_peer) {
+			if (current_peer->first_allowedip)
+				++index_len;
+		}
+		index = calloc(index_len ?: 1, sizeof(*index));
+		if (!index) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		index_len = 0;
+		for_each_wgpeer(current, current_peer) {
+			if (current_peer->first_allowedip)
+				index[index_len++] = current_peer;
+		}
+		qsort(index, index_len, sizeof(*index), peer_key_cmp);
+	}
+	for_each_wgpeer(dev, peer) {
+		if (!has_removals(peer))
+			continue;
+		ret = resolve_removals(dev, peer, index, index_len);
+		if (ret < 0)
+			goto out;
+	}
+
+out:
+	free(wanted);
+	free(index);
+	free_wgdevice(current);
+	return ret;
+}
+
+void apply_order(struct wgdevice *dev)
+{
+	if (allowedips_sorted())
+		order_allowedips(dev);
+	if (peers_by_handshake())
+		order_peers_by_handshake(dev);
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef APPLY_H
+#define APPLY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct wgdevice;
+
+/* While a set is being applied, the other end holds the device's configuration
+ * lock, stalling the handshakes of live peers. WG_APPLY_CHUNK_SIZE bounds how
+ * much is applied at once, in bytes of netlink message or of UAPI transaction,
+ * WG_APPLY_PACING leaves that many milliseconds between chunks, and with
+ * WG_APPLY_TIMING=1, each chunk is reported on stderr with how long it took.
+ * A set replacing all peers removes them in its first chunk, so it is neither
+ * chunked nor paced, lest that lengthen the time the peers are missing. */
+struct apply_schedule {
+	size_t chunk_size;
+	unsigned int pacing_ms, chunks;
+	bool timing;
+	uint64_t started_ns;
+};
+
+void apply_schedule_init(struct apply_schedule *schedule, const struct wgdevice *dev);
+void apply_chunk_start(struct apply_schedule *schedule);
+/* Called once a chunk has been acknowledged, before the next is started. */
+void apply_chunk_done(struct apply_schedule *schedule, const char *interface, size_t peers, size_t bytes, bool more);
+
+/* Turns the allowed IPs a set removes into replacements of what each peer is left with, for an end that cannot remove them one by one. */
+int apply_resolve_removals(struct wgdevice *dev);
+/* Reorders a set as WG_ALLOWED_IPS_ORDER and WG_APPLY_ORDER ask, wherever that cannot change its result. */
+void apply_order(struct wgdevice *dev);
+
+#endif
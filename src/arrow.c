@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrow.h"
+#include "containers.h"
+#include "format.h"
+
+/* An Arrow IPC stream is a schema message, then record batch messages, then
+ * an end-of-stream marker. Each message is a FlatBuffers-encoded header
+ * followed by a body holding the column buffers back to back, so columns are
+ * built straight into buffers laid out as Arrow wants them and written from
+ * there, leaving nothing for a reader to convert. The handful of FlatBuffers
+ * tables the headers need are built by hand below, as the reference builder
+ * does: back to front, children before the tables referring to them.
+ *
+ * See https://arrow.apache.org/docs/format/Columnar.html#serialization-and-interprocess-communication-ipc */
+
+#define ARROW_BATCH_ROWS 65536
+#define ARROW_ALIGN 8
+
+/* Enough for the largest header, a record batch's, which grows only with the fixed number of columns. */
+#define FB_SIZE 4096
+#define FB_MAX_FIELDS 6
+
+enum {
+	METADATA_V5 = 4,
+	HEADER_SCHEMA = 1,
+	HEADER_RECORD_BATCH = 3,
+	TYPE_INT = 2,
+	TYPE_UTF8 = 5,
+	TYPE_TIMESTAMP = 10,
+	TYPE_LIST = 12,
+	TYPE_FIXED_SIZE_BINARY = 15,
+	TIME_UNIT_NANOSECOND = 3,
+	ENDIANNESS_LITTLE = 0,
+	ENDIANNESS_BIG = 1
+};
+
+enum column_type { COLUMN_UTF8, COLUMN_KEY, COLUMN_TIMESTAMP, COLUMN_UINT64, COLUMN_LIST };
+
+/* Depth first, as record batches list them, so the items of a list follow it. */
+enum {
+	COLUMN_NETNS,
+	COLUMN_INTERFACE,
+	COLUMN_PUBLIC_KEY,
+	COLUMN_ENDPOINT,
+	COLUMN_LATEST_HANDSHAKE,
+	COLUMN_RX_BYTES,
+	COLUMN_TX_BYTES,
+	COLUMN_ALLOWED_IPS,
+	COLUMN_ALLOWED_IP,
+	COLUMNS
+};
+
+static const struct {
+	const char *name;
+	enum column_type type;
+	bool nullable;
+} columns[COLUMNS] = {
+	[COLUMN_NETNS] = { "netns", COLUMN_UTF8, false },
+	[COLUMN_INTERFACE] = { "interface", COLUMN_UTF8, false },
+	[COLUMN_PUBLIC_KEY] = { "public_key", COLUMN_KEY, false },
+	[COLUMN_ENDPOINT] = { "endpoint", COLUMN_UTF8, true },
+	[COLUMN_LATEST_HANDSHAKE] = { "latest_handshake", COLUMN_TIMESTAMP, true },
+	[COLUMN_RX_BYTES] = { "rx_bytes", COLUMN_UINT64, false },
+	[COLUMN_TX_BYTES] = { "tx_bytes", COLUMN_UINT64, false },
+	[COLUMN_ALLOWED_IPS] = { "allowed_ips", COLUMN_LIST, false },
+	[COLUMN_ALLOWED_IP] = { "item", COLUMN_UTF8, false }
+};
+
+struct buffer {
+	uint8_t *data;
+	size_t len, cap;
+};
+
+struct column {
+	struct buffer validity, offsets, values;
+	size_t len, nulls;
+};
+
+struct arrow_writer {
+	FILE *f;
+	size_t first_column, rows;
+	/* Set once anything has gone wrong, after which the columns may be half way through a row. */
+	bool failed;
+	struct column columns[COLUMNS];
+};
+
+struct fb {
+	uint8_t buf[FB_SIZE];
+	size_t used, object_start;
+	size_t slots[FB_MAX_FIELDS];
+	unsigned int fields;
+};
+
+/* What has been built so far is the last fb->used bytes of the buffer, and an object is known by fb->used once built. */
+static uint8_t *fb_push(struct fb *fb, size_t len)
+{
+	fb->used += len;
+	return fb->buf + FB_SIZE - fb->used;
+}
+
+/* Pads so that the buffer is aligned once len more bytes go in front. */
+static void fb_prep(struct fb *fb, size_t align, size_t len)
+{
+	size_t pad = (~(fb->used + len) + 1) & (align - 1);
+
+	memset(fb_push(fb, pad), 0, pad);
+}
+
+static void fb_scalar(struct fb *fb, uint64_t value, size_t size)
+{
+	uint8_t *p;
+
+	fb_prep(fb, size, 0);
+	p = fb_push(fb, size);
+	for (size_t i = 0; i < size; ++i)
+		p[i] = value >> (8 * i);
+}
+
+static void fb_uoffset(struct fb *fb, size_t object)
+{
+	fb_prep(fb, 4, 0);
+	fb_scalar(fb, fb->used + 4 - object, 4);
+}
+
+static size_t fb_string(struct fb *fb, const char *str)
+{
+	size_t len = strlen(str);
+
+	fb_prep(fb, 4, len + 1);
+	*fb_push(fb, 1) = '\0';
+	memcpy(fb_push(fb, len), str, len);
+	fb_scalar(fb, len, 4);
+	return fb->used;
+}
+
+static size_t fb_offsets(struct fb *fb, const size_t *objects, size_t len)
+{
+	fb_prep(fb, 4, 4 * len);
+	for (size_t i = len; i-- > 0;)
+		fb_uoffset(fb, objects[i]);
+	fb_scalar(fb, len, 4);
+	return fb->used;
+}
+
+/* The FieldNode and Buffer structs are both a pair of longs. */
+static size_t fb_pairs(struct fb *fb, const uint64_t (*pairs)[2], size_t len)
+{
+	fb_prep(fb, 8, 16 * len);
+	for (size_t i = len; i-- > 0;) {
+		fb_scalar(fb, pairs[i][1], 8);
+		fb_scalar(fb, pairs[i][0], 8);
+	}
+	fb_scalar(fb, len, 4);
+	return fb->used;
+}
+
+static void fb_start(struct fb *fb, unsigned int fields)
+{
+	memset(fb->slots, 0, sizeof(fb->slots));
+	fb->fields = fields;
+	fb->object_start = fb->used;
+}
+
+static void fb_add_scalar(struct fb *fb, unsigned int field, uint64_t value, size_t size)
+{
+	fb_scalar(fb, value, size);
+	fb->slots[field] = fb->used;
+}
+
+static void fb_add_offset(struct fb *fb, unsigned int field, size_t object)
+{
+	fb_uoffset(fb, object);
+	fb->slots[field] = fb->used;
+}
+
+/* The vtable goes right in front of its table, which starts with the distance back to it. */
+static size_t fb_end(struct fb *fb)
+{
+	size_t object, vtable;
+	uint8_t *p;
+
+	fb_scalar(fb, 0, 4);
+	object = fb->used;
+	for (unsigned int i = fb->fields; i-- > 0;)
+		fb_scalar(fb, fb->slots[i] ? object - fb->slots[i] : 0, 2);
+	fb_scalar(fb, object - fb->object_start, 2);
+	fb_scalar(fb, 4 + 2 * fb->fields, 2);
+	vtable = fb->used;
+	p = fb->buf + FB_SIZE - object;
+	for (size_t i = 0; i < 4; ++i)
+		p[i] = (vtable - object) >> (8 * i);
+	return object;
+}
+
+static size_t fb_message(struct fb *fb, uint8_t header_type, size_t header, uint64_t body_len)
+{
+	fb_start(fb, 4);
+	fb_add_scalar(fb, 3, body_len, 8);
+	fb_add_offset(fb, 2, header);
+	fb_add_scalar(fb, 0, METADATA_V5, 2);
+	fb_add_scalar(fb, 1, header_type, 1);
+	return fb_end(fb);
+}
+
+/* Messages are framed by a continuation marker and their header's length, padded so that the body that follows is aligned. */
+static bool write_header(FILE *f, struct fb *fb, size_t message)
+{
+	uint8_t prefix[8] = { 0xff, 0xff, 0xff, 0xff };
+
+	fb_prep(fb, ARROW_ALIGN, 4);
+	fb_uoffset(fb, message);
+	for (size_t i = 0; i < 4; ++i)
+		prefix[4 + i] = fb->used >> (8 * i);
+	return fwrite(prefix, sizeof(prefix), 1, f) == 1 &&
+	       fwrite(fb->buf + FB_SIZE - fb->used, fb->used, 1, f) == 1;
+}
+
+static size_t fb_column_field(struct fb *fb, size_t column)
+{
+	size_t name, type, timezone, children, child;
+	uint8_t type_type;
+
+	if (columns[column].type == COLUMN_LIST) {
+		child = fb_column_field(fb, column + 1);
+		children = fb_offsets(fb, &child, 1);
+	} else
+		children = fb_offsets(fb, NULL, 0);
+	switch (columns[column].type) {
+	case COLUMN_KEY:
+		fb_start(fb, 1);
+		fb_add_scalar(fb, 0, WG_KEY_LEN, 4);
+		type_type = TYPE_FIXED_SIZE_BINARY;
+		break;
+	case COLUMN_TIMESTAMP:
+		timezone = fb_string(fb, "UTC");
+		fb_start(fb, 2);
+		fb_add_offset(fb, 1, timezone);
+		fb_add_scalar(fb, 0, TIME_UNIT_NANOSECOND, 2);
+		type_type = TYPE_TIMESTAMP;
+		break;
+	case COLUMN_UINT64:
+		fb_start(fb, 2);
+		fb_add_scalar(fb, 0, 64, 4);
+		fb_add_scalar(fb, 1, false, 1);
+		type_type = TYPE_INT;
+		break;
+	case COLUMN_LIST:
+		fb_start(fb, 0);
+		type_type = TYPE_LIST;
+		break;
+	default:
+		fb_start(fb, 0);
+		type_type = TYPE_UTF8;
+		break;
+	}
+	type = fb_end(fb);
+	name = fb_string(fb, columns[column].name);
+	fb_start(fb, 6);
+	fb_add_offset(fb, 5, children);
+	fb_add_offset(fb, 3, type);
+	fb_add_offset(fb, 0, name);
+	fb_add_scalar(fb, 2, type_type, 1);
+	fb_add_scalar(fb, 1, columns[column].nullable, 1);
+	return fb_end(fb);
+}
+
+static bool write_schema(struct arrow_writer *writer)
+{
+	struct fb fb = { .used = 0 };
+	size_t fields[COLUMNS], len = 0, schema;
+
+	for (size_t i = writer->first_column; i < COLUMN_ALLOWED_IP; ++i)
+		fields[len++] = fb_column_field(&fb, i);
+	schema = fb_offsets(&fb, fields, len);
+	fb_start(&fb, 2);
+	fb_add_offset(&fb, 1, schema);
+	fb_add_scalar(&fb, 0, __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? ENDIANNESS_BIG : ENDIANNESS_LITTLE, 2);
+	schema = fb_end(&fb);
+	return write_header(writer->f, &fb, fb_message(&fb, HEADER_SCHEMA, schema, 0));
+}
+
+static bool buffer_append(struct buffer *buffer, const void *data, size_t len)
+{
+	if (buffer->len + len > buffer->cap) {
+		size_t cap = buffer->cap ? buffer->cap : 4096;
+		uint8_t *grown;
+
+		while (cap < buffer->len + len)
+			cap *= 2;
+		grown = realloc(buffer->data, cap);
+		if (!grown)
+			return false;
+		buffer->data = grown;
+		buffer->cap = cap;
+	}
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+	return true;
+}
+
+/* Validity is kept for every column, and only written out for those that turn out to have nulls. */
+static bool column_next(struct column *column, bool valid)
+{
+	uint8_t zero = 0;
+
+	if (!(column->len % 8) && !buffer_append(&column->validity, &zero, 1))
+		return false;
+	if (valid)
+		column->validity.data[column->len / 8] |= 1U << (column->len % 8);
+	else
+		++column->nulls;
+	++column->len;
+	return true;
+}
+
+/* Offsets are in native byte order, like every other value, with the schema saying which that is. */
+static bool column_offset(struct column *column, size_t offset)
+{
+	int32_t value = offset;
+
+	if (offset > INT32_MAX) {
+		errno = EOVERFLOW;
+		return false;
+	}
+	return buffer_append(&column->offsets, &value, sizeof(value));
+}
+
+static bool column_string(struct column *column, const char *str)
+{
+	return column_next(column, str) && (!str || buffer_append(&column->values, str, strlen(str))) &&
+	       column_offset(column, column->values.len);
+}
+
+static bool column_uint64(struct column *column, uint64_t value, bool valid)
+{
+	return column_next(column, valid) && buffer_append(&column->values, &value, sizeof(value));
+}
+
+static void columns_reset(struct arrow_writer *writer)
+{
+	for (size_t i = 0; i < COLUMNS; ++i) {
+		struct column *column = &writer->columns[i];
+
+		column->validity.len = column->offsets.len = column->values.len = 0;
+		column->len = column->nulls = 0;
+		/* Room for the leading offset was there before, or else this is the first reset. */
+		if (columns[i].type == COLUMN_UTF8 || columns[i].type == COLUMN_LIST)
+			column_offset(column, 0);
+	}
+	writer->rows = 0;
+}
+
+static bool write_batch(struct arrow_writer *writer)
+{
+	static const uint8_t padding[ARROW_ALIGN];
+	const struct buffer *buffers[COLUMNS * 3];
+	uint64_t nodes[COLUMNS][2], descriptors[COLUMNS * 3][2], body_len = 0;
+	size_t len = 0, node_vector, buffer_vector, batch;
+	struct fb fb = { .used = 0 };
+
+	for (size_t i = writer->first_column; i < COLUMNS; ++i) {
+		const struct column *column = &writer->columns[i];
+
+		nodes[i - writer->first_column][0] = column->len;
+		nodes[i - writer->first_column][1] = column->nulls;
+		buffers[len++] = column->nulls ? &column->validity : NULL;
+		if (columns[i].type == COLUMN_UTF8 || columns[i].type == COLUMN_LIST)
+			buffers[len++] = &column->offsets;
+		if (columns[i].type != COLUMN_LIST)
+			buffers[len++] = &column->values;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		descriptors[i][0] = body_len;
+		descriptors[i][1] = buffers[i] ? buffers[i]->len : 0;
+		body_len += (descriptors[i][1] + ARROW_ALIGN - 1) & ~(uint64_t)(ARROW_ALIGN - 1);
+	}
+
+	buffer_vector = fb_pairs(&fb, descriptors, len);
+	node_vector = fb_pairs(&fb, nodes, COLUMNS - writer->first_column);
+	fb_start(&fb, 3);
+	fb_add_scalar(&fb, 0, writer->rows, 8);
+	fb_add_offset(&fb, 2, buffer_vector);
+	fb_add_offset(&fb, 1, node_vector);
+	batch = fb_end(&fb);
+	if (!write_header(writer->f, &fb, fb_message(&fb, HEADER_RECORD_BATCH, batch, body_len)))
+		return false;
+	for (size_t i = 0; i < len; ++i) {
+		size_t pad = (ARROW_ALIGN - descriptors[i][1] % ARROW_ALIGN) % ARROW_ALIGN;
+
+		if (descriptors[i][1] && fwrite(buffers[i]->data, descriptors[i][1], 1, writer->f) != 1)
+			return false;
+		if (pad && fwrite(padding, pad, 1, writer->f) != 1)
+			return false;
+	}
+	columns_reset(writer);
+	return true;
+}
+
+static bool add_peer(struct arrow_writer *writer, const char *netns, const char *interface, const struct wgpeer *peer)
+{
+	struct column *columns = writer->columns;
+	char endpoint[FORMAT_ENDPOINT_LEN], ip[INET6_ADDRSTRLEN + 4];
+	const struct wgallowedip *allowedip;
+	bool handshake = peer->last_handshake_time.tv_sec || peer->last_handshake_time.tv_nsec;
+
+	if (netns && !column_string(&columns[COLUMN_NETNS], netns))
+		return false;
+	if (!peer->endpoint.addr.sa_family || !format_endpoint(endpoint, &peer->endpoint.addr))
+		endpoint[0] = '\0';
+	if (!column_string(&columns[COLUMN_INTERFACE], interface) ||
+	    !column_next(&columns[COLUMN_PUBLIC_KEY], true) ||
+	    !buffer_append(&columns[COLUMN_PUBLIC_KEY].values, peer->public_key, WG_KEY_LEN) ||
+	    !column_string(&columns[COLUMN_ENDPOINT], endpoint[0] ? endpoint : NULL) ||
+	    !column_uint64(&columns[COLUMN_LATEST_HANDSHAKE],
+			   (uint64_t)peer->last_handshake_time.tv_sec * 1000000000ULL + peer->last_handshake_time.tv_nsec, handshake) ||
+	    !column_uint64(&columns[COLUMN_RX_BYTES], peer->rx_bytes, true) ||
+	    !column_uint64(&columns[COLUMN_TX_BYTES], peer->tx_bytes, true))
+		return false;
+	for_each_wgallowedip(peer, allowedip) {
+		snprintf(ip + strlen(format_ip(ip, allowedip)), 5, "/%u", allowedip->cidr);
+		if (!column_string(&columns[COLUMN_ALLOWED_IP], ip))
+			return false;
+	}
+	return column_next(&columns[COLUMN_ALLOWED_IPS], true) &&
+	       column_offset(&columns[COLUMN_ALLOWED_IPS], columns[COLUMN_ALLOWED_IP].len);
+}
+
+struct arrow_writer *arrow_writer_new(FILE *f, bool with_netns)
+{
+	struct arrow_writer *writer = calloc(1, sizeof(*writer));
+
+	if (!writer)
+		return NULL;
+	writer->f = f;
+	writer->first_column = with_netns ? COLUMN_NETNS : COLUMN_INTERFACE;
+	columns_reset(writer);
+	for (size_t i = 0; i < COLUMNS; ++i) {
+		if (columns[i].type != COLUMN_UTF8 && columns[i].type != COLUMN_LIST)
+			continue;
+		if (!writer->columns[i].offsets.len) {
+			errno = ENOMEM;
+			goto err;
+		}
+	}
+	if (!write_schema(writer))
+		goto err;
+	return writer;
+err:
+	for (size_t i = 0; i < COLUMNS; ++i)
+		free(writer->columns[i].offsets.data);
+	free(writer);
+	return NULL;
+}
+
+bool arrow_write_device(struct arrow_writer *writer, const char *netns, const struct wgdevice *device)
+{
+	const struct wgpeer *peer;
+
+	if (writer->failed)
+		return false;
+	for_each_wgpeer(device, peer) {
+		if (!add_peer(writer, writer->first_column == COLUMN_NETNS ? netns ?: "" : NULL, device->name, peer) ||
+		    (++writer->rows == ARROW_BATCH_ROWS && !write_batch(writer))) {
+			writer->failed = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool arrow_writer_finish(struct arrow_writer *writer)
+{
+	static const uint8_t end[8] = { 0xff, 0xff, 0xff, 0xff };
+	bool ret;
+
+	ret = !writer->failed && (!writer->rows || write_batch(writer)) && fwrite(end, sizeof(end), 1, writer->f) == 1 && !fflush(writer->f);
+	for (size_t i = 0; i < COLUMNS; ++i) {
+		free(writer->columns[i].validity.data);
+		free(writer->columns[i].offsets.data);
+		free(writer->columns[i].values.data);
+	}
+	free(writer);
+	return ret;
+}
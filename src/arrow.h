@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef ARROW_H
+#define ARROW_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+struct wgdevice;
+struct arrow_writer;
+
+/* Starts an Apache Arrow IPC stream on f by writing its schema, which leads with a netns column if with_netns.
+ * Returns NULL with errno set on failure. */
+struct arrow_writer *arrow_writer_new(FILE *f, bool with_netns);
+/* Adds a row per peer, writing out a record batch whenever one fills up, so a batch may span several devices. */
+bool arrow_write_device(struct arrow_writer *writer, const char *netns, const struct wgdevice *device);
+/* Writes out the last record batch and the end of the stream, unless writing has already failed, and frees the writer. */
+bool arrow_writer_finish(struct arrow_writer *writer);
+
+#endif
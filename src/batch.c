@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "containers.h"
+#include "ipc.h"
+#include "resolve.h"
+#include "subcommands.h"
+
+/* Consecutive sets of the same interface, merged into one device, so that
+ * they go out as a few packed messages rather than one message per line. */
+struct pending {
+	struct wgdevice *device;
+	struct wgpeer *last_peer;
+	size_t first_line, last_line;
+};
+
+static const char *source_name;
+static bool keep_going, flush_failed;
+
+static void merge_device(struct pending *pending, struct wgdevice *device, size_t line)
+{
+	struct wgdevice *into = pending->device;
+
+	if (!into) {
+		pending->device = device;
+		pending->first_line = line;
+		into = device;
+	} else {
+		if (device->flags & WGDEVICE_HAS_PRIVATE_KEY)
+			memcpy(into->private_key, device->private_key, sizeof(into->private_key));
+		if (device->flags & WGDEVICE_HAS_LISTEN_PORT)
+			into->listen_port = device->listen_port;
+		if (device->flags & WGDEVICE_HAS_FWMARK)
+			into->fwmark = device->fwmark;
+		into->flags |= device->flags;
+		/* Peers keep their order, so a later line still wins over an earlier one for the same peer. */
+		if (pending->last_peer)
+			pending->last_peer->next_peer = device->first_peer;
+		else
+			into->first_peer = device->first_peer;
+		device->first_peer = NULL;
+		free_wgdevice(device);
+	}
+	pending->last_line = line;
+	if (!pending->last_peer)
+		pending->last_peer = into->first_peer;
+	while (pending->last_peer && pending->last_peer->next_peer)
+		pending->last_peer = pending->last_peer->next_peer;
+}
+
+static bool flush(struct pending *pending)
+{
+	bool ok = true;
+
+	if (!pending->device)
+		return true;
+	if (resolve_set_device(pending->device) != 0) {
+		if (pending->first_line == pending->last_line)
+			fprintf(stderr, "%s:%zu: Unable to modify interface: %s\n", source_name, pending->first_line, strerror(errno));
+		else
+			fprintf(stderr, "%s:%zu-%zu: Unable to modify interface: %s\n", source_name, pending->first_line, pending->last_line, strerror(errno));
+		flush_failed = true;
+		ok = false;
+	}
+	free_wgdevice(pending->device);
+	memset(pending, 0, sizeof(*pending));
+	return ok;
+}
+
+/* Splits on whitespace, honoring single and double quotes, and stopping at a #. */
+static int split_line(char *line, char ***argv, size_t *argv_cap)
+{
+	int argc = 0;
+	char *in = line, *out;
+
+	for (;;) {
+		char quote = 0;
+
+		while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+			++in;
+		if (!*in || *in == '#')
+			break;
+		if ((size_t)argc + 2 > *argv_cap) {
+			size_t new_cap = *argv_cap ? *argv_cap * 2 : 16;
+			char **new_argv = realloc(*argv, new_cap * sizeof(*new_argv));
+
+			if (!new_argv)
+				return -1;
+			*argv = new_argv;
+			*argv_cap = new_cap;
+		}
+		(*argv)[argc++] = out = in;
+		for (; *in; ++in) {
+			if (quote) {
+				if (*in == quote) {
+					quote = 0;
+					continue;
+				}
+			} else if (*in == '"' || *in == '\'') {
+				quote = *in;
+				continue;
+			} else if (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+				break;
+			*out++ = *in;
+		}
+		if (quote) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (*in)
+			++in;
+		*out = '\0';
+	}
+	if (*argv)
+		(*argv)[argc] = NULL;
+	return argc;
+}
+
+static bool run_line(struct pending *pending, int argc, char *argv[], size_t line)
+{
+	struct wgdevice *device;
+
+	if (!strcmp(argv[0], "set")) {
+		if (argc < 3) {
+			fprintf(stderr, "%s:%zu: Usage: set <interface> [<key> <value>]...\n", source_name, line);
+			return false;
+		}
+		if (pending->device && strcmp(pending->device->name, argv[1])) {
+			if (!flush(pending) && !keep_going)
+				return false;
+		}
+		device = config_read_cmd(argv + 2, argc - 2);
+		if (!device) {
+			fprintf(stderr, "%s:%zu: Invalid set command\n", source_name, line);
+			return false;
+		}
+		strncpy(device->name, argv[1], IFNAMSIZ - 1);
+		device->name[IFNAMSIZ - 1] = '\0';
+		merge_device(pending, device, line);
+		return true;
+	}
+
+	/* Everything else must observe the sets before it. */
+	if (!flush(pending) && !keep_going)
+		return false;
+	if (!strcmp(argv[0], "setconf") || !strcmp(argv[0], "addconf") || !strcmp(argv[0], "syncconf")) {
+		if (!setconf_main(argc, argv))
+			return true;
+	} else if (!strcmp(argv[0], "show")) {
+		if (!show_main(argc, argv))
+			return true;
+	} else if (!strcmp(argv[0], "showconf")) {
+		if (!showconf_main(argc, argv))
+			return true;
+	} else {
+		fprintf(stderr, "%s:%zu: Invalid command: `%s'\n", source_name, line, argv[0]);
+		return false;
+	}
+	fprintf(stderr, "%s:%zu: Command failed\n", source_name, line);
+	return false;
+}
+
+int batch_main(int argc, char *argv[])
+{
+	struct pending pending = { 0 };
+	FILE *input = stdin;
+	char *line_buffer = NULL, **line_argv = NULL;
+	size_t line_buffer_len = 0, line_argv_cap = 0, line = 0;
+	bool ok = true;
+	int i;
+
+	source_name = "-";
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-f") && i + 1 < argc)
+			source_name = argv[++i];
+		else if (!strcmp(argv[i], "--continue"))
+			keep_going = true;
+		else {
+			fprintf(stderr, "Usage: %s %s [-f <file>] [--continue]\n", PROG_NAME, argv[0]);
+			return 1;
+		}
+	}
+	if (!strcmp(source_name, "-"))
+		source_name = "<stdin>";
+	else {
+		input = fopen(source_name, "r");
+		if (!input) {
+			perror("fopen");
+			return 1;
+		}
+	}
+
+	ipc_session_begin();
+	while (getline(&line_buffer, &line_buffer_len, input) >= 0) {
+		int line_argc;
+
+		++line;
+		line_argc = split_line(line_buffer, &line_argv, &line_argv_cap);
+		if (line_argc < 0) {
+			fprintf(stderr, "%s:%zu: Unable to parse line: %s\n", source_name, line, strerror(errno));
+			ok = false;
+		} else if (line_argc && !run_line(&pending, line_argc, line_argv, line))
+			ok = false;
+		if (!ok && !keep_going)
+			break;
+		/* Output of shows must be in order with respect to the errors of the lines around them. */
+		fflush(stdout);
+	}
+	/* Lines before a failing one are applied, just as if they had been run one by one. */
+	flush(&pending);
+	ipc_session_end();
+
+	if (input != stdin)
+		fclose(input);
+	free(line_buffer);
+	free(line_argv);
+	return ok && !flush_failed ? 0 : 1;
+}
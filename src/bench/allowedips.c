@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * Set time for allowed IPs handed over in random order against the order
+ * WG_ALLOWED_IPS_ORDER=sorted produces. Given an interface, the sets go to
+ * it, which with the kernel module measures its allowed IPs trie. Otherwise
+ * the prefixes go into the path-compressed trie of aggregate.c, which is built
+ * the same way, as a model of the work done on the other end.
+ */
+
+#define RUNSTATEDIR "/var/run"
+#include "../curve25519.c"
+#include "../encoding.c"
+#include "../ipc.c"
+#include "../apply.c"
+#include "../aggregate.c"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct prefix {
+	uint16_t family;
+	uint8_t cidr;
+	uint32_t peer;
+	uint8_t bits[16];
+};
+
+static uint64_t prng_state;
+
+static uint64_t prng_next(void)
+{
+	/* xorshift64*, so that a run can be reproduced from its seed. */
+	prng_state ^= prng_state >> 12;
+	prng_state ^= prng_state << 25;
+	prng_state ^= prng_state >> 27;
+	return prng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static int prefix_cmp(const void *first, const void *second)
+{
+	const struct prefix *a = first, *b = second;
+
+	int ret;
+
+	if (a->family != b->family)
+		return a->family < b->family ? -1 : 1;
+	ret = memcmp(a->bits, b->bits, sizeof(a->bits));
+	if (ret)
+		return ret;
+	return a->cidr < b->cidr ? -1 : a->cidr > b->cidr;
+}
+
+static void shuffle(struct prefix *prefixes, size_t len)
+{
+	for (size_t i = len; i > 1; --i) {
+		size_t j = prng_next() % i;
+		struct prefix tmp = prefixes[i - 1];
+
+		prefixes[i - 1] = prefixes[j];
+		prefixes[j] = tmp;
+	}
+}
+
+/* Prefixes cluster under 10.0.0.0/8 and fd00::/8, and each peer gets a block
+ * of neighbouring ones, as customer subnets would be. They are unique, so
+ * that peers may be reordered, and come in random order. */
+static struct prefix *generate(size_t len, uint32_t peers)
+{
+	size_t generated = len + len / 2 + 16, unique = 0;
+	struct prefix *prefixes = calloc(generated, sizeof(*prefixes));
+
+	if (!prefixes) {
+		perror("calloc");
+		exit(2);
+	}
+	for (size_t i = 0; i < generated; ++i) {
+		struct prefix *prefix = &prefixes[i];
+		uint64_t r = prng_next(), s = prng_next();
+		uint8_t bytes;
+
+		if (r % 4) {
+			prefix->family = AF_INET;
+			prefix->cidr = 20 + (r >> 8) % 13;
+			bytes = 4;
+			memcpy(prefix->bits, &s, 4);
+			prefix->bits[0] = 10;
+		} else {
+			prefix->family = AF_INET6;
+			prefix->cidr = 48 + (r >> 8) % 81;
+			bytes = 16;
+			memcpy(prefix->bits, &s, 8);
+			s = prng_next();
+			memcpy(prefix->bits + 8, &s, 8);
+			prefix->bits[0] = 0xfd;
+		}
+		if (prefix->cidr < bytes * 8) {
+			prefix->bits[prefix->cidr / 8] &= ~(0xff >> (prefix->cidr % 8));
+			memset(prefix->bits + prefix->cidr / 8 + 1, 0, bytes - prefix->cidr / 8 - 1);
+		}
+	}
+	qsort(prefixes, generated, sizeof(*prefixes), prefix_cmp);
+	for (size_t i = 0; i < generated; ++i) {
+		if (!unique || prefix_cmp(&prefixes[unique - 1], &prefixes[i]))
+			prefixes[unique++] = prefixes[i];
+	}
+	if (unique < len) {
+		fprintf(stderr, "Only %zu unique prefixes could be generated\n", unique);
+		exit(2);
+	}
+	shuffle(prefixes, unique);
+	qsort(prefixes, len, sizeof(*prefixes), prefix_cmp);
+	for (size_t i = 0; i < len; ++i)
+		prefixes[i].peer = (uint64_t)i * peers / len;
+	shuffle(prefixes, len);
+	return prefixes;
+}
+
+static struct wgdevice *build(const char *interface, const struct prefix *prefixes, size_t len, uint32_t peers)
+{
+	struct wgdevice *device = calloc(1, sizeof(*device));
+	struct wgpeer **list = calloc(peers, sizeof(*list));
+	size_t *starts = calloc(peers + 1, sizeof(*starts)), *order = calloc(len ?: 1, sizeof(*order));
+
+	if (!device || !list || !starts || !order)
+		goto err;
+	if (interface)
+		strncpy(device->name, interface, sizeof(device->name) - 1);
+	device->flags = WGDEVICE_REPLACE_PEERS;
+	for (uint32_t i = 0; i < peers; ++i) {
+		list[i] = calloc(1, sizeof(*list[i]));
+		if (!list[i])
+			goto err;
+		list[i]->flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_REPLACE_ALLOWEDIPS;
+		memcpy(list[i]->public_key, &(uint32_t){ i + 1 }, sizeof(uint32_t));
+		list[i]->public_key[31] = 0x40;
+		if (device->last_peer)
+			device->last_peer->next_peer = list[i];
+		else
+			device->first_peer = list[i];
+		device->last_peer = list[i];
+	}
+	/* Like the config parser, allocate each peer's allowed IPs together, in the order given. */
+	for (size_t i = 0; i < len; ++i)
+		++starts[prefixes[i].peer + 1];
+	for (uint32_t i = 0; i < peers; ++i)
+		starts[i + 1] += starts[i];
+	for (size_t i = 0; i < len; ++i)
+		order[starts[prefixes[i].peer]++] = i;
+	for (size_t j = 0; j < len; ++j) {
+		size_t i = order[j];
+		struct wgallowedip *allowedip = calloc(1, sizeof(*allowedip));
+		struct wgpeer *peer = list[prefixes[i].peer];
+
+		if (!allowedip)
+			goto err;
+		allowedip->family = prefixes[i].family;
+		allowedip->cidr = prefixes[i].cidr;
+		memcpy(&allowedip->ip6, prefixes[i].bits, prefixes[i].family == AF_INET ? 4 : 16);
+		if (peer->last_allowedip)
+			peer->last_allowedip->next_allowedip = allowedip;
+		else
+			peer->first_allowedip = allowedip;
+		peer->last_allowedip = allowedip;
+	}
+	free(list);
+	free(starts);
+	free(order);
+	return device;
+err:
+	perror("calloc");
+	exit(2);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t model_round(struct wgdevice *device, bool sorted)
+{
+	struct trie trie = { 0 };
+	struct wgallowedip *allowedip;
+	struct wgpeer *peer;
+	uint64_t start = now_ns();
+
+	trie_reset(&trie);
+	if (sorted)
+		order_allowedips(device);
+	for_each_wgpeer(device, peer) {
+		for_each_wgallowedip(peer, allowedip) {
+			if (!trie_insert(&trie, allowedip->family == AF_INET6, (const uint8_t *)&allowedip->ip6, allowedip->cidr)) {
+				perror("realloc");
+				exit(2);
+			}
+		}
+	}
+	return now_ns() - start;
+}
+
+static uint64_t live_round(struct wgdevice *device, bool sorted)
+{
+	struct wgdevice empty = { .flags = WGDEVICE_REPLACE_PEERS };
+	uint64_t start, end;
+
+	setenv("WG_ALLOWED_IPS_ORDER", sorted ? "sorted" : "given", 1);
+	start = now_ns();
+	if (ipc_set_device(device) < 0) {
+		perror("Unable to modify interface");
+		exit(2);
+	}
+	end = now_ns();
+	memcpy(empty.name, device->name, sizeof(empty.name));
+	if (ipc_set_device(&empty) < 0) {
+		perror("Unable to modify interface");
+		exit(2);
+	}
+	return end - start;
+}
+
+static int u64_cmp(const void *first, const void *second)
+{
+	uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+
+	return a < b ? -1 : a > b;
+}
+
+static void bench(const char *label, const char *interface, const struct prefix *prefixes, size_t len, uint32_t peers, bool sorted, unsigned int rounds)
+{
+	uint64_t *samples = calloc(rounds, sizeof(*samples));
+
+	if (!samples) {
+		perror("calloc");
+		exit(2);
+	}
+	/* Every round runs in a child of its own, so that like wg(8) it starts from a fresh heap, rather
+	 * than from one where the last round's allowed IPs were freed in an order other than allocated. */
+	for (unsigned int i = 0; i < rounds; ++i) {
+		int fds[2], status;
+		pid_t pid;
+
+		if (pipe(fds) < 0 || (pid = fork()) < 0) {
+			perror("fork");
+			exit(2);
+		}
+		if (!pid) {
+			struct wgdevice *device = build(interface, prefixes, len, peers);
+			uint64_t sample = interface ? live_round(device, sorted) : model_round(device, sorted);
+
+			_exit(write(fds[1], &sample, sizeof(sample)) == sizeof(sample) ? 0 : 2);
+		}
+		close(fds[1]);
+		if (read(fds[0], &samples[i], sizeof(samples[i])) != sizeof(samples[i]) || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			exit(2);
+		close(fds[0]);
+	}
+	qsort(samples, rounds, sizeof(*samples), u64_cmp);
+	printf("%-24s %12.1f %12.1f %12.1f  ms\n", label, samples[0] / 1e6, samples[rounds / 2] / 1e6, samples[rounds - 1 - rounds / 10] / 1e6);
+	free(samples);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n <prefixes>] [-p <peers>] [-r <rounds>] [-s <seed>] [<interface>]\n", prog);
+	fprintf(stderr, "  Without an interface, a userspace model of the allowed IPs trie is measured instead.\n");
+	fprintf(stderr, "  With one, its peers are replaced, and then removed after every round.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len = 1000000;
+	uint32_t peers = 1000;
+	unsigned int rounds = 5;
+	const char *interface = NULL;
+	struct prefix *prefixes;
+	int opt;
+
+	prng_state = time(NULL) ^ ((uint64_t)getpid() << 32);
+	while ((opt = getopt(argc, argv, "n:p:r:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			len = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			peers = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			prng_state = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind + 1 < argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (optind < argc)
+		interface = argv[optind];
+	if (!prng_state)
+		prng_state = 1;
+	if (!rounds)
+		rounds = 1;
+	if (!peers)
+		peers = 1;
+
+	printf("Seed: 0x%016llx\n", (unsigned long long)prng_state);
+	prefixes = generate(len, peers);
+	printf("%zu prefixes over %u peers, set %s\n", len, peers, interface ? interface : "into a userspace model of the trie");
+
+	printf("\n%-24s %12s %12s %12s\n", "order", "min", "median", "p90");
+	bench("random", interface, prefixes, len, peers, false, rounds);
+	bench("sorted", interface, prefixes, len, peers, true, rounds);
+	free(prefixes);
+	return 0;
+}
@@ -0,0 +1,434 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2018-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * Known-answer, differential and throughput tests for every Curve25519 backend
+ * that the compiler can build, as well as for the key encoding routines.
+ */
+
+#include "../curve25519.c"
+#ifdef __SIZEOF_INT128__
+#define curve25519_generic curve25519_fiat32
+#include "../curve25519-fiat32.h"
+#undef curve25519_generic
+#endif
+#include "../encoding.c"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const struct {
+	const char *name;
+	void (*fn)(u8 out[CURVE25519_KEY_SIZE], const u8 scalar[CURVE25519_KEY_SIZE], const u8 point[CURVE25519_KEY_SIZE]);
+} backends[] = {
+#ifdef __SIZEOF_INT128__
+	{ "hacl64", curve25519_generic },
+	{ "fiat32", curve25519_fiat32 },
+#else
+	{ "fiat32", curve25519_generic },
+#endif
+};
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+/* RFC 7748, sections 5.2 and 6.1. */
+static const struct {
+	const char *scalar, *point, *result;
+} kat_vectors[] = {
+	{ "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+	  "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c",
+	  "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552" },
+	{ "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+	  "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493",
+	  "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957" },
+	{ "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+	  "0900000000000000000000000000000000000000000000000000000000000000",
+	  "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a" },
+	{ "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb",
+	  "0900000000000000000000000000000000000000000000000000000000000000",
+	  "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f" },
+	{ "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+	  "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f",
+	  "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742" },
+	{ "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb",
+	  "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a",
+	  "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742" }
+};
+
+/* RFC 7748, section 5.2, iterated test. */
+static const struct {
+	unsigned long iterations;
+	const char *result;
+} iterated_vectors[] = {
+	{ 1, "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079" },
+	{ 1000, "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51" },
+	{ 1000000, "7c3911e0ab2586fd864497297e575e6f3bc601c0883c30df5f4dd2d24f665424" }
+};
+
+static const struct {
+	const char *hex, *base64;
+} encoding_vectors[] = {
+	{ "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4", "pUbja/BSfJ07FhVLgkZe3WIUTArB/FoYUGoiRLpEmsQ=" },
+	{ "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", "dwdtCnMYpX08FsFyUbJmRd9ML4frwJkqsXf7pR25LCo=" },
+	{ "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a", "hSDwCYkwp1R0i33ctD73Wg2/Og0mOBr066SpjqqbTmo=" },
+	{ "0000000000000000000000000000000000000000000000000000000000000000", "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=" },
+	{ "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff", "//////////////////////////////////////////8=" }
+};
+
+static const char *invalid_base64[] = {
+	"",
+	"pUbja/BSfJ07FhVLgkZe3WIUTArB/FoYUGoiRLpEmsQ",
+	"pUbja/BSfJ07FhVLgkZe3WIUTArB/FoYUGoiRLpEmsQ==",
+	"pUbja/BSfJ07FhVLgkZe3WIUTArB/FoYUGoiRLpEmsR=",
+	"pUbja/BSfJ07FhVLgkZe3WIUTArB/FoYUGoiRLpEms-=",
+	"pUbja/BSfJ07FhVLgkZe3WIUTArB/FoYUGoiRLpEm\x80Q="
+};
+
+static const char *invalid_hex[] = {
+	"",
+	"a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac",
+	"a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4a",
+	"g546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+	"a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449a:4"
+};
+
+static uint64_t prng_state;
+
+static uint64_t prng_next(void)
+{
+	/* xorshift64*, so that a failing differential run can be reproduced from its seed. */
+	prng_state ^= prng_state >> 12;
+	prng_state ^= prng_state << 25;
+	prng_state ^= prng_state >> 27;
+	return prng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void prng_fill(u8 *out, size_t len)
+{
+	for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+		uint64_t r = prng_next();
+
+		memcpy(out + i, &r, len - i < sizeof(r) ? len - i : sizeof(r));
+	}
+}
+
+static void must_hex(u8 key[static WG_KEY_LEN], const char *hex)
+{
+	if (!key_from_hex(key, hex)) {
+		fprintf(stderr, "Internal error: bad test vector `%s'\n", hex);
+		exit(2);
+	}
+}
+
+static bool test_kat(void)
+{
+	u8 scalar[CURVE25519_KEY_SIZE], point[CURVE25519_KEY_SIZE], expected[CURVE25519_KEY_SIZE], out[CURVE25519_KEY_SIZE];
+	bool ret = true;
+
+	for (size_t b = 0; b < BACKEND_COUNT; ++b) {
+		for (size_t i = 0; i < sizeof(kat_vectors) / sizeof(kat_vectors[0]); ++i) {
+			must_hex(scalar, kat_vectors[i].scalar);
+			must_hex(point, kat_vectors[i].point);
+			must_hex(expected, kat_vectors[i].result);
+			backends[b].fn(out, scalar, point);
+			if (memcmp(out, expected, sizeof(out))) {
+				fprintf(stderr, "%s: known-answer vector %zu: FAIL\n", backends[b].name, i + 1);
+				ret = false;
+			}
+		}
+	}
+	return ret;
+}
+
+static bool test_iterated(unsigned long max_iterations)
+{
+	u8 k[CURVE25519_KEY_SIZE], u[CURVE25519_KEY_SIZE], out[CURVE25519_KEY_SIZE], expected[CURVE25519_KEY_SIZE];
+	bool ret = true;
+
+	for (size_t b = 0; b < BACKEND_COUNT; ++b) {
+		unsigned long done = 0;
+
+		memset(k, 0, sizeof(k));
+		memset(u, 0, sizeof(u));
+		k[0] = u[0] = 9;
+		for (size_t i = 0; i < sizeof(iterated_vectors) / sizeof(iterated_vectors[0]); ++i) {
+			if (iterated_vectors[i].iterations > max_iterations)
+				break;
+			for (; done < iterated_vectors[i].iterations; ++done) {
+				backends[b].fn(out, k, u);
+				memcpy(u, k, sizeof(u));
+				memcpy(k, out, sizeof(k));
+			}
+			must_hex(expected, iterated_vectors[i].result);
+			if (memcmp(k, expected, sizeof(k))) {
+				fprintf(stderr, "%s: iterated vector after %lu iterations: FAIL\n", backends[b].name, done);
+				ret = false;
+				break;
+			}
+		}
+	}
+	return ret;
+}
+
+static bool test_differential(unsigned long count)
+{
+	u8 scalar[CURVE25519_KEY_SIZE], point[CURVE25519_KEY_SIZE], out[BACKEND_COUNT][CURVE25519_KEY_SIZE];
+	u8 pub_a[CURVE25519_KEY_SIZE], pub_b[CURVE25519_KEY_SIZE], shared_a[CURVE25519_KEY_SIZE], shared_b[CURVE25519_KEY_SIZE];
+
+	for (unsigned long i = 0; i < count; ++i) {
+		prng_fill(scalar, sizeof(scalar));
+		prng_fill(point, sizeof(point));
+		for (size_t b = 0; b < BACKEND_COUNT; ++b) {
+			backends[b].fn(out[b], scalar, point);
+			if (b && memcmp(out[b], out[0], sizeof(out[0]))) {
+				fprintf(stderr, "%s and %s disagree on random input %lu\n", backends[0].name, backends[b].name, i);
+				return false;
+			}
+		}
+
+		/* Each backend must also agree with itself on Diffie-Hellman, with the other backend's public keys. */
+		for (size_t b = 0; b < BACKEND_COUNT; ++b) {
+			size_t c = (b + 1) % BACKEND_COUNT;
+
+			curve25519_clamp_secret(scalar);
+			prng_fill(point, sizeof(point));
+			curve25519_clamp_secret(point);
+			backends[b].fn(pub_a, scalar, (const u8[CURVE25519_KEY_SIZE]){ 9 });
+			backends[c].fn(pub_b, point, (const u8[CURVE25519_KEY_SIZE]){ 9 });
+			backends[b].fn(shared_a, scalar, pub_b);
+			backends[c].fn(shared_b, point, pub_a);
+			if (memcmp(shared_a, shared_b, sizeof(shared_a))) {
+				fprintf(stderr, "%s and %s fail Diffie-Hellman on random input %lu\n", backends[b].name, backends[c].name, i);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool test_encoding(unsigned long count)
+{
+	u8 key[WG_KEY_LEN], expected[WG_KEY_LEN];
+	char base64[WG_KEY_LEN_BASE64], hex[WG_KEY_LEN_HEX];
+	bool ret = true;
+
+	for (size_t i = 0; i < sizeof(encoding_vectors) / sizeof(encoding_vectors[0]); ++i) {
+		must_hex(expected, encoding_vectors[i].hex);
+		key_to_base64(base64, expected);
+		key_to_hex(hex, expected);
+		if (strcmp(base64, encoding_vectors[i].base64) || strcmp(hex, encoding_vectors[i].hex)) {
+			fprintf(stderr, "Encoding vector %zu: FAIL\n", i + 1);
+			ret = false;
+		}
+		if (!key_from_base64(key, encoding_vectors[i].base64) || memcmp(key, expected, sizeof(key))) {
+			fprintf(stderr, "Decoding vector %zu: FAIL\n", i + 1);
+			ret = false;
+		}
+		if (key_is_zero(expected) != !strcmp(encoding_vectors[i].hex, "0000000000000000000000000000000000000000000000000000000000000000")) {
+			fprintf(stderr, "Zero check vector %zu: FAIL\n", i + 1);
+			ret = false;
+		}
+	}
+	for (size_t i = 0; i < sizeof(invalid_base64) / sizeof(invalid_base64[0]); ++i) {
+		if (key_from_base64(key, invalid_base64[i])) {
+			fprintf(stderr, "Invalid base64 vector %zu was accepted\n", i + 1);
+			ret = false;
+		}
+	}
+	for (size_t i = 0; i < sizeof(invalid_hex) / sizeof(invalid_hex[0]); ++i) {
+		if (key_from_hex(key, invalid_hex[i])) {
+			fprintf(stderr, "Invalid hex vector %zu was accepted\n", i + 1);
+			ret = false;
+		}
+	}
+	for (unsigned long i = 0; i < count; ++i) {
+		prng_fill(expected, sizeof(expected));
+		key_to_base64(base64, expected);
+		if (!key_from_base64(key, base64) || memcmp(key, expected, sizeof(key))) {
+			fprintf(stderr, "Base64 round trip of random input %lu: FAIL\n", i);
+			return false;
+		}
+		key_to_hex(hex, expected);
+		if (!key_from_hex(key, hex) || memcmp(key, expected, sizeof(key))) {
+			fprintf(stderr, "Hex round trip of random input %lu: FAIL\n", i);
+			return false;
+		}
+	}
+	return ret;
+}
+
+static inline uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLE_UNIT "cycles"
+#else
+#define CYCLE_UNIT "ns"
+#endif
+
+static int u64_cmp(const void *first, const void *second)
+{
+	uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+
+	return a < b ? -1 : a > b;
+}
+
+static volatile u8 sink;
+
+enum bench_op {
+	BENCH_SCALARMULT,
+	BENCH_GENERATE_PUBLIC,
+	BENCH_TO_BASE64,
+	BENCH_FROM_BASE64,
+	BENCH_TO_HEX,
+	BENCH_FROM_HEX
+};
+
+static uint64_t bench_round(enum bench_op op, size_t backend, unsigned long batch)
+{
+	u8 a[WG_KEY_LEN] __aligned(sizeof(uintptr_t)), b[WG_KEY_LEN] __aligned(sizeof(uintptr_t));
+	char base64[WG_KEY_LEN_BASE64], hex[WG_KEY_LEN_HEX];
+	uint64_t start, end;
+
+	prng_fill(a, sizeof(a));
+	prng_fill(b, sizeof(b));
+	key_to_base64(base64, a);
+	key_to_hex(hex, a);
+
+	start = cycles();
+	for (unsigned long i = 0; i < batch; ++i) {
+		switch (op) {
+		case BENCH_SCALARMULT:
+			backends[backend].fn(a, a, b);
+			break;
+		case BENCH_GENERATE_PUBLIC:
+			backends[backend].fn(a, a, (const u8[CURVE25519_KEY_SIZE]){ 9 });
+			break;
+		case BENCH_TO_BASE64:
+			key_to_base64(base64, a);
+			a[i % WG_KEY_LEN] ^= base64[i % (WG_KEY_LEN_BASE64 - 1)];
+			break;
+		case BENCH_FROM_BASE64:
+			sink ^= key_from_base64(a, base64);
+			break;
+		case BENCH_TO_HEX:
+			key_to_hex(hex, a);
+			a[i % WG_KEY_LEN] ^= hex[i % (WG_KEY_LEN_HEX - 1)];
+			break;
+		case BENCH_FROM_HEX:
+			sink ^= key_from_hex(a, hex);
+			break;
+		}
+	}
+	end = cycles();
+	sink ^= a[0];
+	return end - start;
+}
+
+static void bench(const char *label, enum bench_op op, size_t backend, unsigned long batch, unsigned int rounds)
+{
+	uint64_t *samples = calloc(rounds, sizeof(*samples));
+
+	if (!samples) {
+		perror("calloc");
+		exit(2);
+	}
+	/* Warm up caches, branch predictors and frequency scaling before measuring. */
+	for (unsigned int i = 0; i < rounds / 4 + 1; ++i)
+		bench_round(op, backend, batch);
+	for (unsigned int i = 0; i < rounds; ++i)
+		samples[i] = bench_round(op, backend, batch);
+	qsort(samples, rounds, sizeof(*samples), u64_cmp);
+	printf("%-24s %12.1f %12.1f %12.1f  " CYCLE_UNIT "/op\n", label,
+	       (double)samples[0] / batch, (double)samples[rounds / 2] / batch,
+	       (double)samples[rounds - 1 - rounds / 10] / batch);
+	free(samples);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-q] [-l] [-s <seed>] [-r <rounds>] [-d <differential count>]\n", prog);
+	fprintf(stderr, "  -q  only run correctness tests, skip benchmarks\n");
+	fprintf(stderr, "  -l  also run the 1,000,000-iteration RFC 7748 test\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long differential = 10000;
+	unsigned int rounds = 64;
+	bool quick = false, longer = false, ok = true;
+	char label[64];
+	int opt;
+
+	prng_state = time(NULL) ^ ((uint64_t)getpid() << 32);
+	while ((opt = getopt(argc, argv, "qls:r:d:h")) != -1) {
+		switch (opt) {
+		case 'q':
+			quick = true;
+			break;
+		case 'l':
+			longer = true;
+			break;
+		case 's':
+			prng_state = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			differential = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!prng_state)
+		prng_state = 1;
+	if (!rounds)
+		rounds = 1;
+
+	printf("Backends:");
+	for (size_t b = 0; b < BACKEND_COUNT; ++b)
+		printf(" %s", backends[b].name);
+	printf("\nSeed: 0x%016llx\n", (unsigned long long)prng_state);
+
+	ok &= test_kat();
+	ok &= test_iterated(longer ? 1000000 : 1000);
+	ok &= test_differential(differential);
+	ok &= test_encoding(differential * 10);
+	printf("Correctness: %s\n", ok ? "PASS" : "FAIL");
+	if (!ok)
+		return 1;
+	if (quick)
+		return 0;
+
+	printf("\n%-24s %12s %12s %12s\n", "operation", "min", "median", "p90");
+	for (size_t b = 0; b < BACKEND_COUNT; ++b) {
+		snprintf(label, sizeof(label), "%s scalarmult", backends[b].name);
+		bench(label, BENCH_SCALARMULT, b, 64, rounds);
+		snprintf(label, sizeof(label), "%s generate_public", backends[b].name);
+		bench(label, BENCH_GENERATE_PUBLIC, b, 64, rounds);
+	}
+	bench("key_to_base64", BENCH_TO_BASE64, 0, 65536, rounds);
+	bench("key_from_base64", BENCH_FROM_BASE64, 0, 65536, rounds);
+	bench("key_to_hex", BENCH_TO_HEX, 0, 65536, rounds);
+	bench("key_from_hex", BENCH_FROM_HEX, 0, 65536, rounds);
+	return 0;
+}
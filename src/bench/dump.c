@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * Wall time of a netlink dump, received and parsed the way wg(8) does it.
+ * Given an interface, its device is dumped, after being filled with peers if
+ * asked.
+ * Otherwise, as a stand-in where there is no WireGuard module, blackhole
+ * routes are put in a table of their own, and the kernel's dump of them is
+ * parsed into a list the way peers are.
+ */
+
+#define RUNSTATEDIR "/var/run"
+#include "../curve25519.c"
+#include "../encoding.c"
+#include "../ipc.c"
+#include "../apply.c"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define ROUTE_TABLE 51820
+
+struct route {
+	uint32_t dst, table;
+	uint8_t dst_len, type;
+	struct route *next;
+};
+
+struct routes {
+	struct route *first, *last;
+	size_t len;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct mnlg_socket *route_socket_open(void)
+{
+	struct mnlg_socket *nlg = calloc(1, sizeof(*nlg));
+
+	if (!nlg)
+		return NULL;
+	nlg->buf = malloc(mnl_ideal_socket_buffer_size());
+	nlg->nl = mnl_socket_open(NETLINK_ROUTE);
+	if (!nlg->buf || !nlg->nl || mnl_socket_bind(nlg->nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		perror("Unable to open a route socket");
+		exit(2);
+	}
+	nlg->portid = mnl_socket_get_portid(nlg->nl);
+	return nlg;
+}
+
+static struct nlmsghdr *route_msg(void *buf, uint16_t type, uint16_t flags, unsigned int seq)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	struct rtmsg *rtm;
+
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = seq;
+	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(*rtm));
+	rtm->rtm_family = AF_INET;
+	return nlh;
+}
+
+/* Adds or deletes 10.0.0.0/8 host routes one batch of requests at a time, waiting for each batch's acks. */
+static void route_edit(struct mnlg_socket *nlg, uint16_t type, size_t count)
+{
+	static char batch[1 << 14];
+	size_t per_batch = sizeof(batch) / 128, done = 0;
+
+	while (done < count) {
+		size_t len = 0, sent = 0;
+
+		for (; sent < per_batch && done + sent < count; ++sent) {
+			struct nlmsghdr *nlh = route_msg(batch + len, type, NLM_F_ACK | (type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_EXCL : 0), done + sent + 1);
+			struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+
+			rtm->rtm_dst_len = 32;
+			rtm->rtm_table = RT_TABLE_UNSPEC;
+			rtm->rtm_protocol = RTPROT_STATIC;
+			rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+			rtm->rtm_type = RTN_BLACKHOLE;
+			mnl_attr_put_u32(nlh, RTA_TABLE, ROUTE_TABLE);
+			mnl_attr_put_u32(nlh, RTA_DST, htonl(0x0a000000 | (uint32_t)(done + sent + 1)));
+			len += MNL_ALIGN(nlh->nlmsg_len);
+		}
+		if (mnl_socket_sendto(nlg->nl, batch, len) < 0) {
+			perror("Unable to edit routes");
+			exit(2);
+		}
+		for (size_t acked = 0; acked < sent;) {
+			const struct nlmsghdr *nlh = (const struct nlmsghdr *)nlg->buf;
+			int remaining = mnl_socket_recvfrom(nlg->nl, nlg->buf, mnl_ideal_socket_buffer_size());
+
+			if (remaining <= 0) {
+				perror("Unable to edit routes");
+				exit(2);
+			}
+			for (; mnl_nlmsg_ok(nlh, remaining); nlh = mnl_nlmsg_next(nlh, &remaining), ++acked) {
+				const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+
+				if (nlh->nlmsg_type == NLMSG_ERROR && err->error && !(type == RTM_DELROUTE && err->error == -ESRCH)) {
+					fprintf(stderr, "Unable to edit routes: %s\n", strerror(-err->error));
+					exit(2);
+				}
+			}
+		}
+		done += sent;
+	}
+}
+
+static int parse_route_attr(const struct nlattr *attr, void *data)
+{
+	struct route *route = data;
+
+	switch (mnl_attr_get_type(attr)) {
+	case RTA_TABLE:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
+			route->table = mnl_attr_get_u32(attr);
+		break;
+	case RTA_DST:
+		if (mnl_attr_get_payload_len(attr) == sizeof(route->dst))
+			memcpy(&route->dst, mnl_attr_get_payload(attr), sizeof(route->dst));
+		break;
+	}
+	return MNL_CB_OK;
+}
+
+static int read_route_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct rtmsg *rtm = mnl_nlmsg_get_payload(nlh);
+	struct routes *routes = data;
+	struct route *route;
+
+	if (nlh->nlmsg_type != RTM_NEWROUTE)
+		return MNL_CB_OK;
+	route = calloc(1, sizeof(*route));
+	if (!route)
+		return MNL_CB_ERROR;
+	route->dst_len = rtm->rtm_dst_len;
+	route->type = rtm->rtm_type;
+	if (routes->last)
+		routes->last->next = route;
+	else
+		routes->first = route;
+	routes->last = route;
+	++routes->len;
+	return mnl_attr_parse(nlh, sizeof(*rtm), parse_route_attr, route);
+}
+
+static size_t route_round(void)
+{
+	struct mnlg_socket *nlg = route_socket_open();
+	struct routes routes = { 0 };
+	size_t len = 0;
+
+	nlg->seq = time(NULL);
+	if (mnlg_socket_send(nlg, route_msg(nlg->buf, RTM_GETROUTE, NLM_F_DUMP, nlg->seq)) < 0 ||
+	    mnlg_socket_recv_run(nlg, read_route_cb, &routes) < 0) {
+		perror("Unable to dump routes");
+		exit(2);
+	}
+	for (struct route *route = routes.first, *next; route; route = next) {
+		next = route->next;
+		len += route->table == ROUTE_TABLE;
+		free(route);
+	}
+	mnlg_socket_close(nlg);
+	return len;
+}
+
+static size_t device_round(const char *interface)
+{
+	struct mnlg_socket *nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	struct wgdevice *device = calloc(1, sizeof(*device));
+	struct nlmsghdr *nlh;
+	struct wgpeer *peer;
+	size_t len = 0;
+
+	if (!nlg || !device) {
+		perror("Unable to open a WireGuard socket");
+		exit(2);
+	}
+	nlh = mnlg_msg_prepare(nlg, WG_CMD_GET_DEVICE, NLM_F_REQUEST | NLM_F_ACK | NLM_F_DUMP);
+	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, interface);
+	if (mnlg_socket_send(nlg, nlh) < 0 ||
+	    mnlg_socket_recv_run(nlg, read_device_cb, device) < 0) {
+		perror("Unable to access interface");
+		exit(2);
+	}
+	coalesce_peers(device);
+	for_each_wgpeer(device, peer)
+		++len;
+	free_wgdevice(device);
+	mnlg_socket_close(nlg);
+	return len;
+}
+
+/* Peers get keys that are simply their index, and a /32 each out of 10.0.0.0/8. */
+static void fill_device(const char *interface, size_t count)
+{
+	struct wgdevice *device = calloc(1, sizeof(*device));
+
+	if (!device)
+		goto err;
+	strncpy(device->name, interface, sizeof(device->name) - 1);
+	device->flags = WGDEVICE_REPLACE_PEERS;
+	for (size_t i = 0; i < count; ++i) {
+		struct wgpeer *peer = calloc(1, sizeof(*peer));
+		struct wgallowedip *allowedip = calloc(1, sizeof(*allowedip));
+
+		if (!peer || !allowedip)
+			goto err;
+		peer->flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_REPLACE_ALLOWEDIPS;
+		memcpy(peer->public_key, &(uint64_t){ i + 1 }, sizeof(uint64_t));
+		peer->public_key[31] = 0x40;
+		allowedip->family = AF_INET;
+		allowedip->cidr = 32;
+		allowedip->ip4.s_addr = htonl(0x0a000000 | (uint32_t)(i + 1));
+		peer->first_allowedip = peer->last_allowedip = allowedip;
+		if (device->last_peer)
+			device->last_peer->next_peer = peer;
+		else
+			device->first_peer = peer;
+		device->last_peer = peer;
+	}
+	if (ipc_set_device(device) < 0) {
+		perror("Unable to modify interface");
+		exit(2);
+	}
+	free_wgdevice(device);
+	return;
+err:
+	perror("calloc");
+	exit(2);
+}
+
+static int u64_cmp(const void *first, const void *second)
+{
+	uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+
+	return a < b ? -1 : a > b;
+}
+
+static void bench(const char *interface, unsigned int rounds, size_t expected)
+{
+	uint64_t *samples = calloc(rounds, sizeof(*samples));
+
+	if (!samples) {
+		perror("calloc");
+		exit(2);
+	}
+	for (unsigned int i = 0; i < rounds; ++i) {
+		uint64_t start = now_ns();
+		size_t len = interface ? device_round(interface) : route_round();
+
+		samples[i] = now_ns() - start;
+		if (len != expected) {
+			fprintf(stderr, "Dumped %zu entries rather than %zu\n", len, expected);
+			exit(2);
+		}
+	}
+	qsort(samples, rounds, sizeof(*samples), u64_cmp);
+	printf("%12.1f %12.1f %12.1f  ms\n", samples[0] / 1e6, samples[rounds / 2] / 1e6, samples[rounds - 1 - rounds / 10] / 1e6);
+	free(samples);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n <entries>] [-r <rounds>] [<interface>]\n", prog);
+	fprintf(stderr, "  With an interface, it is dumped, after its peers are replaced by <entries> of them if -n is given.\n");
+	fprintf(stderr, "  Without, <entries> blackhole routes are added to table %u, dumped, and removed again.\n", ROUTE_TABLE);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = 200000, expected;
+	unsigned int rounds = 5;
+	const char *interface = NULL;
+	bool fill = false;
+	struct mnlg_socket *nlg = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoull(optarg, NULL, 10);
+			fill = true;
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind + 1 < argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (optind < argc)
+		interface = argv[optind];
+	if (!rounds)
+		rounds = 1;
+
+	if (interface) {
+		if (fill)
+			fill_device(interface, count);
+		expected = device_round(interface);
+		printf("%zu peers of %s", expected, interface);
+	} else {
+		nlg = route_socket_open();
+		route_edit(nlg, RTM_NEWROUTE, count);
+		expected = count;
+		printf("%zu blackhole routes in table %u", expected, ROUTE_TABLE);
+	}
+	printf(", %ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+	printf("\n%12s %12s %12s\n", "min", "median", "p90");
+	bench(interface, rounds, expected);
+
+	if (nlg) {
+		route_edit(nlg, RTM_DELROUTE, count);
+		mnlg_socket_close(nlg);
+	}
+	return 0;
+}
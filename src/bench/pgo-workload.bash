@@ -0,0 +1,151 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+#
+# Offline training workload for profile-guided builds of wg(8), and a timing
+# comparison between builds. It needs neither root nor a kernel module: wg(8)
+# talks to bench/uapi-server, which replays a synthetic device dump over the
+# userspace UAPI socket under <runstatedir>, so the binaries passed in must
+# have been built with RUNSTATEDIR=<runstatedir>.
+#
+# Usage: pgo-workload.bash <runstatedir> <wg>            (train)
+#        pgo-workload.bash -c <runstatedir> <wg>...      (compare)
+
+set -e -o pipefail
+export LC_ALL=C WG_COLOR_MODE=never WG_HIDE_KEYS=never
+
+SELF="$(readlink -f "${BASH_SOURCE[0]}")"
+BENCHDIR="${SELF%/*}"
+PEERS=${PEERS:-5000}
+ROUNDS=${ROUNDS:-5}
+INTERFACE=wgpgo
+COMPARE=0
+
+die() {
+	echo "$*" >&2
+	exit 1
+}
+
+[[ $1 == -c ]] && { COMPARE=1; shift; }
+[[ $# -ge 2 ]] || die "Usage: $0 [-c] <runstatedir> <wg>..."
+RUNSTATEDIR="$(readlink -f "$1")"
+shift
+WGS=( "$@" )
+[[ -x $BENCHDIR/uapi-server ]] || die "Missing $BENCHDIR/uapi-server; run \`make -C $BENCHDIR uapi-server' first"
+
+WORKDIR="$(mktemp -d)"
+SERVER_PID=""
+cleanup() {
+	[[ -z $SERVER_PID ]] || kill "$SERVER_PID" 2>/dev/null || true
+	wait 2>/dev/null || true
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+generate_inputs() {
+	local i
+	{
+		printf 'private_key=%064x\nlisten_port=51820\nfwmark=0\n' 7
+		for ((i = 0; i < PEERS; ++i)); do
+			printf 'public_key=%064x\npreshared_key=%064x\nendpoint=192.0.2.%d:%d\nlast_handshake_time_sec=%d\nlast_handshake_time_nsec=0\nrx_bytes=%d\ntx_bytes=%d\npersistent_keepalive_interval=%d\nallowed_ip=10.%d.%d.0/24\nallowed_ip=fd00:%x::/64\nprotocol_version=1\n' \
+				$((i + 1)) $((i % 3 ? 0 : i + 7)) $((i % 254 + 1)) $((1024 + i % 60000)) $((i % 4 ? 1600000000 + i : 0)) $((i * 4099)) $((i * 1031)) $((i % 2 ? 25 : 0)) \
+				$((i / 256 % 256)) $((i % 256)) "$i"
+		done
+	} > "$WORKDIR/dump"
+	{
+		printf '[Interface]\nPrivateKey = %042dA=\nListenPort = 51820\n\n' 7
+		for ((i = 0; i < PEERS; ++i)); do
+			printf '[Peer]\nPublicKey = %042dA=\nEndpoint = 192.0.2.%d:%d\nAllowedIPs = 10.%d.%d.0/24, fd00:%x::/64\nPersistentKeepalive = 25\n\n' \
+				$((i + 1)) $((i % 254 + 1)) $((1024 + i % 60000)) $((i / 256 % 256)) $((i % 256)) "$i"
+		done
+	} > "$WORKDIR/config"
+	for ((i = 0; i < 4096; ++i)); do
+		printf '10.%d.%d.0/24,' $((i / 256)) $((i % 256))
+	done > "$WORKDIR/allowedips"
+	printf '%042dA=' 7 > "$WORKDIR/private"
+}
+
+start_server() {
+	mkdir -p "$RUNSTATEDIR/wireguard"
+	"$BENCHDIR/uapi-server" "$RUNSTATEDIR/wireguard/$INTERFACE.sock" "$WORKDIR/dump" &
+	SERVER_PID=$!
+	for ((i = 0; i < 100; ++i)); do
+		[[ -S $RUNSTATEDIR/wireguard/$INTERFACE.sock ]] && return 0
+		sleep 0.05
+	done
+	die "uapi-server did not start"
+}
+
+phase_keys() {
+	local i
+	for ((i = 0; i < 64; ++i)); do
+		"$1" genkey | "$1" pubkey
+		"$1" genpsk
+	done
+}
+
+phase_show() {
+	local field
+	"$1" show "$INTERFACE"
+	"$1" show all dump
+	for field in public-key private-key listen-port fwmark peers preshared-keys endpoints allowed-ips latest-handshakes transfer persistent-keepalive; do
+		"$1" show "$INTERFACE" "$field"
+	done
+	"$1" showconf "$INTERFACE"
+}
+
+phase_set() {
+	"$1" setconf "$INTERFACE" "$WORKDIR/config"
+	"$1" addconf "$INTERFACE" "$WORKDIR/config"
+	"$1" syncconf "$INTERFACE" "$WORKDIR/config"
+	"$1" set "$INTERFACE" listen-port 51820 private-key "$WORKDIR/private" peer "$(printf '%042dA=' 1)" endpoint 192.0.2.1:51820 persistent-keepalive 25 allowed-ips "$(< "$WORKDIR/allowedips")0.0.0.0/0"
+}
+
+PHASES=( keys show set )
+
+generate_inputs
+start_server
+
+if [[ $COMPARE -eq 0 ]]; then
+	for wg in "${WGS[@]}"; do
+		for phase in "${PHASES[@]}"; do
+			"phase_$phase" "$wg" > /dev/null
+		done
+	done
+	exit 0
+fi
+
+declare -A best
+for wg in "${WGS[@]}"; do
+	[[ -x $wg ]] || die "Not executable: \`$wg'"
+	for phase in "${PHASES[@]}"; do
+		"phase_$phase" "$wg" > /dev/null
+		best[$wg,$phase]=""
+		for ((round = 0; round < ROUNDS; ++round)); do
+			start=$EPOCHREALTIME
+			"phase_$phase" "$wg" > /dev/null
+			end=$EPOCHREALTIME
+			elapsed=$(( (${end/./} - ${start/./}) / 1000 ))
+			[[ -n ${best[$wg,$phase]} && ${best[$wg,$phase]} -le $elapsed ]] || best[$wg,$phase]=$elapsed
+		done
+	done
+done
+
+printf '%-28s %10s' "build" "size"
+for phase in "${PHASES[@]}"; do
+	printf ' %14s' "$phase (ms)"
+done
+printf '\n'
+base="${WGS[0]}"
+for wg in "${WGS[@]}"; do
+	printf '%-28s %10s' "${wg##*/}" "$(stat -c %s "$wg")"
+	for phase in "${PHASES[@]}"; do
+		if [[ $wg == "$base" ]]; then
+			printf ' %14s' "${best[$wg,$phase]}"
+		else
+			printf ' %6s (%+4d%%)' "${best[$wg,$phase]}" $(( (best[$wg,$phase] - best[$base,$phase]) * 100 / (best[$base,$phase] ? best[$base,$phase] : 1) ))
+		fi
+	done
+	printf '\n'
+done
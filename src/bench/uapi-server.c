@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * A stand-in for a userspace WireGuard implementation's UAPI socket, which
+ * answers every get=1 with a canned dump and acknowledges every set=1. It lets
+ * wg(8) be driven through its real parsing and formatting paths without root
+ * or a kernel module, for profile training and benchmarks.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static const char *socket_path;
+
+static void cleanup(int signum)
+{
+	unlink(socket_path);
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+static char *read_dump(const char *path, size_t *len)
+{
+	char *buffer = NULL;
+	size_t cap = 0, ret;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	*len = 0;
+	for (;;) {
+		if (cap - *len < 65536) {
+			char *new_buffer = realloc(buffer, cap + 65536);
+
+			if (!new_buffer) {
+				free(buffer);
+				fclose(f);
+				return NULL;
+			}
+			buffer = new_buffer;
+			cap += 65536;
+		}
+		ret = fread(buffer + *len, 1, cap - *len, f);
+		if (!ret)
+			break;
+		*len += ret;
+	}
+	fclose(f);
+	return buffer;
+}
+
+static void serve(FILE *in, FILE *out, const char *dump, size_t dump_len)
+{
+	char *line = NULL;
+	size_t line_len = 0;
+	bool get;
+
+	/* wg(8) issues one operation per connection and reads the reply until EOF. */
+	if (getline(&line, &line_len, in) <= 0)
+		goto out;
+	if (!strcmp(line, "get=1\n"))
+		get = true;
+	else if (!strcmp(line, "set=1\n"))
+		get = false;
+	else
+		goto out;
+	while (getline(&line, &line_len, in) > 0) {
+		if (strcmp(line, "\n"))
+			continue;
+		if (get)
+			fwrite(dump, 1, dump_len, out);
+		fputs("errno=0\n\n", out);
+		break;
+	}
+out:
+	free(line);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	size_t dump_len;
+	char *dump;
+	int fd;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <socket path> <dump file>\n", argv[0]);
+		return 1;
+	}
+	socket_path = argv[1];
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long: `%s'\n", socket_path);
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	dump = read_dump(argv[2], &dump_len);
+	if (!dump) {
+		perror("Unable to read dump");
+		return 1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		perror("bind");
+		return 1;
+	}
+	signal(SIGTERM, cleanup);
+	signal(SIGINT, cleanup);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+		FILE *in, *out;
+
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		/* Separate streams, since stdio may not switch from reading to writing without a seek. */
+		in = fdopen(client, "r");
+		out = in ? fdopen(dup(client), "w") : NULL;
+		if (!out) {
+			if (in)
+				fclose(in);
+			else
+				close(client);
+			continue;
+		}
+		serve(in, out, dump, dump_len);
+		fclose(out);
+		fclose(in);
+	}
+	unlink(socket_path);
+	free(dump);
+	return 1;
+}
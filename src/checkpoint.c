@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "containers.h"
+#include "ipc.h"
+#include "subcommands.h"
+
+/* A checkpoint holds the endpoint each peer was last heard from, so that once
+ * the interface is brought back up, peers without a configured endpoint can be
+ * reached again at once instead of waiting for them to initiate. It is a
+ * 16-byte header, the magic, a version and the time it was taken, followed by
+ * one 64-byte record per peer, all integers little-endian except the port,
+ * which is kept in network order as in the socket address:
+ *
+ *     public key      32
+ *     last handshake   8   seconds since the epoch
+ *     family           1   4 or 6
+ *     reserved         1
+ *     port             2
+ *     scope id         4
+ *     address         16
+ */
+
+#define CHECKPOINT_MAGIC "WGCK"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_HEADER_LEN 16
+#define CHECKPOINT_RECORD_LEN 64
+#define CHECKPOINT_MAX_RECORDS (1U << 24)
+#define CHECKPOINT_DEFAULT_MAX_AGE (60 * 60)
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = value >> (8 * i);
+}
+
+static void put_le64(uint8_t *p, uint64_t value)
+{
+	for (int i = 0; i < 8; ++i)
+		p[i] = value >> (8 * i);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	uint32_t value = 0;
+
+	for (int i = 0; i < 4; ++i)
+		value |= (uint32_t)p[i] << (8 * i);
+	return value;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t value = 0;
+
+	for (int i = 0; i < 8; ++i)
+		value |= (uint64_t)p[i] << (8 * i);
+	return value;
+}
+
+static bool encode_record(uint8_t *record, const struct wgpeer *peer)
+{
+	memset(record, 0, CHECKPOINT_RECORD_LEN);
+	memcpy(record, peer->public_key, WG_KEY_LEN);
+	put_le64(record + 32, peer->last_handshake_time.tv_sec);
+	if (peer->endpoint.addr.sa_family == AF_INET) {
+		record[40] = 4;
+		memcpy(record + 42, &peer->endpoint.addr4.sin_port, 2);
+		memcpy(record + 48, &peer->endpoint.addr4.sin_addr, 4);
+	} else if (peer->endpoint.addr.sa_family == AF_INET6) {
+		record[40] = 6;
+		memcpy(record + 42, &peer->endpoint.addr6.sin6_port, 2);
+		put_le32(record + 44, peer->endpoint.addr6.sin6_scope_id);
+		memcpy(record + 48, &peer->endpoint.addr6.sin6_addr, 16);
+	} else
+		return false;
+	return true;
+}
+
+static bool decode_record(struct wgpeer *peer, uint64_t *last_handshake, const uint8_t *record)
+{
+	memset(peer, 0, sizeof(*peer));
+	memcpy(peer->public_key, record, WG_KEY_LEN);
+	*last_handshake = get_le64(record + 32);
+	if (record[40] == 4) {
+		peer->endpoint.addr4.sin_family = AF_INET;
+		memcpy(&peer->endpoint.addr4.sin_port, record + 42, 2);
+		memcpy(&peer->endpoint.addr4.sin_addr, record + 48, 4);
+	} else if (record[40] == 6) {
+		peer->endpoint.addr6.sin6_family = AF_INET6;
+		memcpy(&peer->endpoint.addr6.sin6_port, record + 42, 2);
+		peer->endpoint.addr6.sin6_scope_id = get_le32(record + 44);
+		memcpy(&peer->endpoint.addr6.sin6_addr, record + 48, 16);
+	} else
+		return false;
+	return true;
+}
+
+static bool write_checkpoint(const char *path, const uint8_t *buf, size_t len)
+{
+	char *tmp = NULL;
+	ssize_t ret;
+	int fd = -1;
+
+	/* Written beside the target and renamed over it, so that a checkpoint cut short never replaces a good one. */
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		tmp = NULL;
+		goto err;
+	}
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		goto err;
+	for (size_t off = 0; off < len; off += ret) {
+		ret = write(fd, buf + off, len - off);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			goto err_unlink;
+		}
+	}
+	if (fsync(fd) < 0 || close(fd) < 0) {
+		fd = -1;
+		goto err_unlink;
+	}
+	fd = -1;
+	if (rename(tmp, path) < 0)
+		goto err_unlink;
+	free(tmp);
+	return true;
+
+err_unlink:
+	ret = errno;
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	errno = ret;
+err:
+	fprintf(stderr, "Unable to write checkpoint to `%s': %s\n", path, strerror(errno));
+	free(tmp);
+	return false;
+}
+
+static uint8_t *read_checkpoint(const char *path, size_t *records)
+{
+	uint8_t *buf = NULL;
+	struct stat st;
+	size_t len;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Unable to read checkpoint from `%s': %s\n", path, strerror(errno));
+		goto out;
+	}
+	if (st.st_size < CHECKPOINT_HEADER_LEN || (st.st_size - CHECKPOINT_HEADER_LEN) % CHECKPOINT_RECORD_LEN ||
+	    (uint64_t)(st.st_size - CHECKPOINT_HEADER_LEN) / CHECKPOINT_RECORD_LEN > CHECKPOINT_MAX_RECORDS)
+		goto invalid;
+	len = st.st_size;
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		goto out;
+	}
+	for (size_t off = 0; off < len; off += ret) {
+		ret = read(fd, buf + off, len - off);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			fprintf(stderr, "Unable to read checkpoint from `%s': %s\n", path, ret ? strerror(errno) : "Unexpected end of file");
+			goto err;
+		}
+	}
+	if (memcmp(buf, CHECKPOINT_MAGIC, 4) || get_le32(buf + 4) != CHECKPOINT_VERSION)
+		goto invalid;
+	*records = (len - CHECKPOINT_HEADER_LEN) / CHECKPOINT_RECORD_LEN;
+	goto out;
+
+invalid:
+	fprintf(stderr, "`%s' is not a checkpoint\n", path);
+err:
+	free(buf);
+	buf = NULL;
+out:
+	if (fd >= 0)
+		close(fd);
+	return buf;
+}
+
+int checkpoint_main(int argc, char *argv[])
+{
+	struct wgdevice *device = NULL;
+	struct wgpeer *peer;
+	uint8_t *buf = NULL;
+	size_t count = 0;
+	int ret = 1;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s %s <interface> <file>\n", PROG_NAME, argv[0]);
+		return 1;
+	}
+
+	ipc_device_fields(IPC_FIELD_ENDPOINTS | IPC_FIELD_HANDSHAKES);
+	if (ipc_get_device(&device, argv[1]) < 0) {
+		perror("Unable to access interface");
+		goto cleanup;
+	}
+	for_each_wgpeer(device, peer)
+		++count;
+	if (count > CHECKPOINT_MAX_RECORDS)
+		count = CHECKPOINT_MAX_RECORDS;
+	buf = calloc(1, CHECKPOINT_HEADER_LEN + count * CHECKPOINT_RECORD_LEN);
+	if (!buf) {
+		perror("calloc");
+		goto cleanup;
+	}
+	memcpy(buf, CHECKPOINT_MAGIC, 4);
+	put_le32(buf + 4, CHECKPOINT_VERSION);
+	put_le64(buf + 8, time(NULL));
+
+	/* An endpoint that never completed a handshake was only ever configured, and the configuration still has it. */
+	count = 0;
+	for_each_wgpeer(device, peer) {
+		if (count == CHECKPOINT_MAX_RECORDS)
+			break;
+		if (!peer->last_handshake_time.tv_sec)
+			continue;
+		if (encode_record(buf + CHECKPOINT_HEADER_LEN + count * CHECKPOINT_RECORD_LEN, peer))
+			++count;
+	}
+	if (write_checkpoint(argv[2], buf, CHECKPOINT_HEADER_LEN + count * CHECKPOINT_RECORD_LEN))
+		ret = 0;
+
+cleanup:
+	free(buf);
+	free_wgdevice(device);
+	return ret;
+}
+
+static int peer_cmp(const void *a, const void *b)
+{
+	const struct wgpeer *const *peer_a = a, *const *peer_b = b;
+
+	return memcmp((*peer_a)->public_key, (*peer_b)->public_key, WG_KEY_LEN);
+}
+
+int restore_endpoints_main(int argc, char *argv[])
+{
+	struct wgdevice *device = NULL, *update = NULL;
+	struct wgpeer *peer, **current = NULL;
+	uint64_t max_age = CHECKPOINT_DEFAULT_MAX_AGE;
+	size_t records = 0, current_len = 0, count = 0, i;
+	uint8_t *buf = NULL;
+	time_t now;
+	bool forwarding;
+	int ret = 1, got;
+
+	if (argc == 5 && !strcmp(argv[3], "--max-age")) {
+		if (!config_parse_duration(&max_age, argv[4]))
+			return 1;
+	} else if (argc != 3) {
+		fprintf(stderr, "Usage: %s %s <interface> <file> [--max-age <duration>]\n", PROG_NAME, argv[0]);
+		return 1;
+	}
+
+	buf = read_checkpoint(argv[2], &records);
+	if (!buf)
+		return 1;
+
+	ipc_session_begin();
+	ipc_device_fields(IPC_FIELD_ENDPOINTS);
+	/* Whether a peer has an endpoint of its own is read from the interface itself, never from a cached copy. */
+	forwarding = ipc_daemon_forwarding(false);
+	got = ipc_get_device(&device, argv[1]);
+	ipc_daemon_forwarding(forwarding);
+	if (got < 0) {
+		perror("Unable to access interface");
+		goto cleanup;
+	}
+	update = calloc(1, sizeof(*update));
+	if (!update) {
+		perror("calloc");
+		goto cleanup;
+	}
+	memcpy(update->name, device->name, sizeof(update->name));
+	for_each_wgpeer(device, peer)
+		++current_len;
+	if (current_len) {
+		current = malloc(current_len * sizeof(*current));
+		if (!current) {
+			perror("malloc");
+			goto cleanup;
+		}
+		i = 0;
+		for_each_wgpeer(device, peer)
+			current[i++] = peer;
+		qsort(current, current_len, sizeof(*current), peer_cmp);
+	}
+
+	/* Only peers that are still configured, and have no endpoint of their own, are
+	 * given the one they were last heard from, and only if that was recent enough
+	 * for it to be worth trying before they get in touch themselves. */
+	now = time(NULL);
+	for (i = 0; i < records && current_len; ++i) {
+		struct wgpeer restored, *key = &restored, **found;
+		uint64_t last_handshake;
+
+		if (!decode_record(&restored, &last_handshake, buf + CHECKPOINT_HEADER_LEN + i * CHECKPOINT_RECORD_LEN))
+			continue;
+		if ((uint64_t)now > last_handshake && (uint64_t)now - last_handshake > max_age)
+			continue;
+		found = bsearch(&key, current, current_len, sizeof(*current), peer_cmp);
+		if (!found || (*found)->endpoint.addr.sa_family != AF_UNSPEC)
+			continue;
+		peer = calloc(1, sizeof(*peer));
+		if (!peer) {
+			perror("calloc");
+			goto cleanup;
+		}
+		/* A peer removed since the dump is left removed, rather than brought back with only an endpoint. */
+		peer->flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_UPDATE_ONLY;
+		memcpy(peer->public_key, restored.public_key, WG_KEY_LEN);
+		memcpy(&peer->endpoint, &restored.endpoint, sizeof(peer->endpoint));
+		if (update->last_peer)
+			update->last_peer->next_peer = peer;
+		else
+			update->first_peer = peer;
+		update->last_peer = peer;
+		/* Marked as having one now, so that a peer recorded twice is only restored once. */
+		(*found)->endpoint.addr.sa_family = restored.endpoint.addr.sa_family;
+		++count;
+	}
+	if (count && ipc_set_device(update) != 0) {
+		perror("Unable to modify interface");
+		goto cleanup;
+	}
+	printf("Restored %zu of %zu endpoints\n", count, records);
+	ret = 0;
+
+cleanup:
+	ipc_session_end();
+	free(current);
+	free(buf);
+	free_wgdevice(update);
+	free_wgdevice(device);
+	return ret;
+}
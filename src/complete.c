@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "containers.h"
+#include "encoding.h"
+#include "ipc.h"
+#include "subcommands.h"
+
+/* The peers of an interface are cached for completion as a header and then
+ * their sorted public keys, each padded to a line of the same length, so that
+ * a prefix is found by binary search with a few reads rather than by parsing
+ * the whole file. The header names the network namespace and interface index
+ * the keys were read from, so a recreated interface is noticed, and sets drop
+ * the file; anything else changing the peers is only seen once it is old. */
+
+#define RECORD_LEN WG_KEY_LEN_BASE64
+#define CACHE_VERSION 1
+#define CACHE_MAX_AGE 60
+
+struct stamp {
+	uint64_t netns;
+	unsigned int ifindex;
+};
+
+static bool cache_path(char path[static 4096], const char *interface)
+{
+	if (strchr(interface, '/') || (size_t)snprintf(path, 4096, IPC_COMPLETE_PATH "%s.peers", interface) >= 4096)
+		return false;
+	return true;
+}
+
+static struct stamp current_stamp(const char *interface)
+{
+	struct stamp stamp = { .ifindex = if_nametoindex(interface) };
+#ifdef __linux__
+	struct stat sbuf;
+
+	if (!stat("/proc/self/ns/net", &sbuf))
+		stamp.netns = sbuf.st_ino;
+#endif
+	return stamp;
+}
+
+static bool read_exactly(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	for (size_t done = 0; done < len; done += ret) {
+		ret = pread(fd, (char *)buf + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret <= 0)
+			return false;
+	}
+	return true;
+}
+
+/* Returns false when there is no usable cache, and otherwise prints the keys starting with the prefix. */
+static bool print_cached(const char *interface, const char *prefix)
+{
+	char path[4096], header[RECORD_LEN + 1], record[RECORD_LEN], *matches = NULL;
+	struct stamp stamp = current_stamp(interface);
+	unsigned long long netns;
+	unsigned int version, ifindex;
+	size_t count, low, high, prefix_len = strlen(prefix), first;
+	struct stat sbuf;
+	int fd;
+	bool ret = false;
+
+	if (!cache_path(path, interface))
+		return false;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &sbuf) < 0 || time(NULL) - sbuf.st_mtime > CACHE_MAX_AGE || time(NULL) < sbuf.st_mtime)
+		goto out;
+	if (!read_exactly(fd, header, RECORD_LEN, 0))
+		goto out;
+	header[RECORD_LEN] = '\0';
+	if (sscanf(header, "%u %llu %u %zu", &version, &netns, &ifindex, &count) != 4 || version != CACHE_VERSION ||
+	    netns != stamp.netns || ifindex != stamp.ifindex || (uint64_t)sbuf.st_size != (uint64_t)(count + 1) * RECORD_LEN)
+		goto out;
+	ret = true;
+	if (prefix_len > RECORD_LEN - 1)
+		goto out;
+
+	/* The first key not before the prefix, and then the first not starting with it, bound the matches. */
+	for (low = 0, high = count; low < high;) {
+		size_t middle = low + (high - low) / 2;
+
+		if (!read_exactly(fd, record, RECORD_LEN, (middle + 1) * RECORD_LEN)) {
+			ret = false;
+			goto out;
+		}
+		if (memcmp(record, prefix, prefix_len) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	first = low;
+	for (high = count; low < high;) {
+		size_t middle = low + (high - low) / 2;
+
+		if (!read_exactly(fd, record, RECORD_LEN, (middle + 1) * RECORD_LEN)) {
+			ret = false;
+			goto out;
+		}
+		if (!memcmp(record, prefix, prefix_len))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low == first)
+		goto out;
+	matches = malloc((low - first) * RECORD_LEN);
+	if (!matches || !read_exactly(fd, matches, (low - first) * RECORD_LEN, (first + 1) * RECORD_LEN)) {
+		ret = false;
+		goto out;
+	}
+	fwrite(matches, RECORD_LEN, low - first, stdout);
+
+out:
+	free(matches);
+	close(fd);
+	return ret;
+}
+
+static int record_cmp(const void *first, const void *second)
+{
+	return memcmp(first, second, RECORD_LEN);
+}
+
+/* Returns the header and sorted records, having written them to the cache if its directory can be made. */
+static char *refresh_cache(const char *interface, size_t *count)
+{
+	struct stamp stamp = current_stamp(interface);
+	struct wgdevice *device = NULL;
+	struct wgpeer *peer;
+	char path[4096], tmp[4096 + 8], *records;
+	size_t i = 0;
+	int fd;
+
+	if (ipc_get_device(&device, interface) < 0)
+		return NULL;
+	*count = 0;
+	for_each_wgpeer(device, peer)
+		++*count;
+	records = malloc((*count + 1) * RECORD_LEN);
+	if (!records) {
+		free_wgdevice(device);
+		return NULL;
+	}
+	for_each_wgpeer(device, peer) {
+		key_to_base64(records + (++i) * RECORD_LEN, peer->public_key);
+		records[(i + 1) * RECORD_LEN - 1] = '\n';
+	}
+	free_wgdevice(device);
+	qsort(records + RECORD_LEN, *count, RECORD_LEN, record_cmp);
+	snprintf(records, RECORD_LEN, "%u %" PRIu64 " %u %zu", CACHE_VERSION, stamp.netns, stamp.ifindex, *count);
+	memset(records + strlen(records), ' ', RECORD_LEN - strlen(records));
+	records[RECORD_LEN - 1] = '\n';
+
+	/* Caching is only a nicety, so failing to is not an error. */
+	if (!cache_path(path, interface))
+		return records;
+	mkdir(RUNSTATEDIR "/wireguard", 0755);
+	mkdir(IPC_COMPLETE_PATH, 0700);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return records;
+	for (size_t len = (*count + 1) * RECORD_LEN, done = 0; done < len;) {
+		ssize_t ret = write(fd, records + done, len - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			close(fd);
+			unlink(tmp);
+			return records;
+		}
+		done += ret;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+	return records;
+}
+
+static int complete_peers(const char *interface, const char *prefix)
+{
+	size_t count, prefix_len = strlen(prefix);
+	char *records;
+
+	if (print_cached(interface, prefix))
+		return 0;
+	records = refresh_cache(interface, &count);
+	if (!records)
+		return 1;
+	for (size_t i = 1; i <= count; ++i) {
+		if (prefix_len < RECORD_LEN && !strncmp(records + i * RECORD_LEN, prefix, prefix_len))
+			fwrite(records + i * RECORD_LEN, RECORD_LEN, 1, stdout);
+	}
+	free(records);
+	return 0;
+}
+
+static int complete_interfaces(const char *prefix)
+{
+	char *interfaces = ipc_list_devices(), *interface;
+
+	if (!interfaces)
+		return 1;
+	for (interface = interfaces; *interface; interface += strlen(interface) + 1) {
+		if (!strncmp(interface, prefix, strlen(prefix)))
+			printf("%s\n", interface);
+	}
+	free(interfaces);
+	return 0;
+}
+
+/* Used by the shell completion, and so kept out of the list of subcommands. */
+int complete_main(int argc, char *argv[])
+{
+	if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "interfaces"))
+		return complete_interfaces(argc == 3 ? argv[2] : "");
+	if (argc >= 3 && argc <= 4 && !strcmp(argv[1], "peers"))
+		return complete_peers(argv[2], argc == 4 ? argv[3] : "");
+	fprintf(stderr, "Usage: %s %s { interfaces | peers <interface> } [<prefix>]\n", PROG_NAME, argv[0]);
+	return 1;
+}
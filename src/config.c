@@ -174,7 +174,38 @@ static inline bool parse_ip(struct wgallowedip *allowedip, const char *value)
 	return true;
 }
 
-static inline int parse_dns_retries(void)
+bool config_parse_duration(uint64_t *seconds, const char *value)
+{
+	static const struct { char suffix; uint64_t seconds; } units[] = {
+		{ 's', 1 }, { 'm', 60 }, { 'h', 60 * 60 }, { 'd', 24 * 60 * 60 }, { 'w', 7 * 24 * 60 * 60 }
+	};
+	unsigned long long count;
+	char *end;
+
+	if (*value < '0' || *value > '9')
+		goto err;
+	errno = 0;
+	count = strtoull(value, &end, 10);
+	if (errno)
+		goto err;
+	if (!*end) {
+		*seconds = count;
+		return true;
+	}
+	if (end[1])
+		goto err;
+	for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); ++i) {
+		if (*end == units[i].suffix && count <= UINT64_MAX / units[i].seconds) {
+			*seconds = count * units[i].seconds;
+			return true;
+		}
+	}
+err:
+	fprintf(stderr, "Duration is not a number of seconds, or of minutes, hours, days or weeks with an m, h, d or w suffix: `%s'\n", value);
+	return false;
+}
+
+int config_dns_retries(void)
 {
 	unsigned long ret;
 	char *retries = getenv("WG_ENDPOINT_RESOLUTION_RETRIES"), *end;
@@ -192,25 +223,27 @@ static inline int parse_dns_retries(void)
 	return (int)ret;
 }
 
-static inline bool parse_endpoint(struct sockaddr *endpoint, const char *value)
+static inline bool resolution_in_background(void)
+{
+	const char *var = getenv("WG_ENDPOINT_RESOLUTION");
+
+	return var && !strcmp(var, "background");
+}
+
+/* Splits a copy of the endpoint into its host and port, returning the copy, which holds both, or NULL. */
+static char *split_endpoint(const char *value, char **host, char **port)
 {
 	char *mutable = strdup(value);
 	char *begin, *end;
-	int ret, retries = parse_dns_retries();
-	struct addrinfo *resolved;
-	struct addrinfo hints = {
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_DGRAM,
-		.ai_protocol = IPPROTO_UDP
-	};
+
 	if (!mutable) {
 		perror("strdup");
-		return false;
+		return NULL;
 	}
 	if (!strlen(value)) {
 		free(mutable);
 		fprintf(stderr, "Unable to parse empty endpoint\n");
-		return false;
+		return NULL;
 	}
 	if (mutable[0] == '[') {
 		begin = &mutable[1];
@@ -218,13 +251,13 @@ static inline bool parse_endpoint(struct sockaddr *endpoint, const char *value)
 		if (!end) {
 			free(mutable);
 			fprintf(stderr, "Unable to find matching brace of endpoint: `%s'\n", value);
-			return false;
+			return NULL;
 		}
 		*end++ = '\0';
 		if (*end++ != ':' || !*end) {
 			free(mutable);
 			fprintf(stderr, "Unable to find port of endpoint: `%s'\n", value);
-			return false;
+			return NULL;
 		}
 	} else {
 		begin = mutable;
@@ -232,50 +265,114 @@ static inline bool parse_endpoint(struct sockaddr *endpoint, const char *value)
 		if (!end || !*(end + 1)) {
 			free(mutable);
 			fprintf(stderr, "Unable to find port of endpoint: `%s'\n", value);
-			return false;
+			return NULL;
 		}
 		*end++ = '\0';
 	}
+	*host = begin;
+	*port = end;
+	return mutable;
+}
+
+/* A single attempt, returning 0 or a getaddrinfo error, EAI_FAMILY standing for an address of neither family. */
+static int lookup_endpoint(struct sockaddr *endpoint, const char *host, const char *port, int flags)
+{
+	struct addrinfo *resolved;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_protocol = IPPROTO_UDP,
+		.ai_flags = flags
+	};
+	int ret = getaddrinfo(host, port, &hints, &resolved);
+
+	if (ret)
+		return ret;
+	if ((resolved->ai_family == AF_INET && resolved->ai_addrlen == sizeof(struct sockaddr_in)) ||
+	    (resolved->ai_family == AF_INET6 && resolved->ai_addrlen == sizeof(struct sockaddr_in6)))
+		memcpy(endpoint, resolved->ai_addr, resolved->ai_addrlen);
+	else
+		ret = EAI_FAMILY;
+	freeaddrinfo(resolved);
+	return ret;
+}
+
+/* The set of return codes that are "permanent failures". All other possibilities are potentially transient.
+ *
+ * This is according to https://sourceware.org/glibc/wiki/NameResolver which states:
+ *	"From the perspective of the application that calls getaddrinfo() it perhaps
+ *	 doesn't matter that much since EAI_FAIL, EAI_NONAME and EAI_NODATA are all
+ *	 permanent failure codes and the causes are all permanent failures in the
+ *	 sense that there is no point in retrying later."
+ *
+ * So this is what we do, except FreeBSD removed EAI_NODATA some time ago, so that's conditional.
+ */
+bool config_dns_error_is_permanent(int ret)
+{
+	return ret == EAI_NONAME || ret == EAI_FAIL ||
+		#ifdef EAI_NODATA
+			ret == EAI_NODATA ||
+		#endif
+			ret == EAI_FAMILY;
+}
+
+int config_lookup_endpoint(struct sockaddr *endpoint, const char *value, bool numeric)
+{
+	char *host, *port, *mutable = split_endpoint(value, &host, &port);
+	int ret;
+
+	if (!mutable)
+		return EAI_NONAME;
+	ret = lookup_endpoint(endpoint, host, port, numeric ? AI_NUMERICHOST : 0);
+	free(mutable);
+	return ret;
+}
+
+/* When resolving in the background, only an address is taken here, and a name leaves the endpoint unset. */
+static inline bool parse_endpoint(struct sockaddr *endpoint, const char *value, bool background)
+{
+	char *host, *port, *mutable = split_endpoint(value, &host, &port);
+	int ret, retries = background ? 0 : config_dns_retries();
+
+	if (!mutable)
+		return false;
 
 	#define min(a, b) ((a) < (b) ? (a) : (b))
 	for (unsigned int timeout = 1000000;; timeout = min(20000000, timeout * 6 / 5)) {
-		ret = getaddrinfo(begin, end, &hints, &resolved);
-		if (!ret)
+		ret = lookup_endpoint(endpoint, host, port, background ? AI_NUMERICHOST : 0);
+		if (!ret || (background && ret == EAI_NONAME && !strpbrk(value, " \t\r\n")))
 			break;
-		/* The set of return codes that are "permanent failures". All other possibilities are potentially transient.
-		 *
-		 * This is according to https://sourceware.org/glibc/wiki/NameResolver which states:
-		 *	"From the perspective of the application that calls getaddrinfo() it perhaps
-		 *	 doesn't matter that much since EAI_FAIL, EAI_NONAME and EAI_NODATA are all
-		 *	 permanent failure codes and the causes are all permanent failures in the
-		 *	 sense that there is no point in retrying later."
-		 *
-		 * So this is what we do, except FreeBSD removed EAI_NODATA some time ago, so that's conditional.
-		 */
-		if (ret == EAI_NONAME || ret == EAI_FAIL ||
-			#ifdef EAI_NODATA
-				ret == EAI_NODATA ||
-			#endif
-				(retries >= 0 && !retries--)) {
+		if (config_dns_error_is_permanent(ret) || (retries >= 0 && !retries--)) {
 			free(mutable);
-			fprintf(stderr, "%s: `%s'\n", ret == EAI_SYSTEM ? strerror(errno) : gai_strerror(ret), value);
+			if (ret == EAI_FAMILY)
+				fprintf(stderr, "Neither IPv4 nor IPv6 address found: `%s'\n", value);
+			else
+				fprintf(stderr, "%s: `%s'\n", ret == EAI_SYSTEM ? strerror(errno) : gai_strerror(ret), value);
 			return false;
 		}
 		fprintf(stderr, "%s: `%s'. Trying again in %.2f seconds...\n", ret == EAI_SYSTEM ? strerror(errno) : gai_strerror(ret), value, timeout / 1000000.0);
 		usleep(timeout);
 	}
+	free(mutable);
+	return true;
+}
 
-	if ((resolved->ai_family == AF_INET && resolved->ai_addrlen == sizeof(struct sockaddr_in)) ||
-	    (resolved->ai_family == AF_INET6 && resolved->ai_addrlen == sizeof(struct sockaddr_in6)))
-		memcpy(endpoint, resolved->ai_addr, resolved->ai_addrlen);
-	else {
-		freeaddrinfo(resolved);
-		free(mutable);
-		fprintf(stderr, "Neither IPv4 nor IPv6 address found: `%s'\n", value);
+static bool parse_peer_endpoint(struct wgpeer *peer, const char *value)
+{
+	bool background = resolution_in_background();
+
+	free(peer->deferred_endpoint);
+	peer->deferred_endpoint = NULL;
+	memset(&peer->endpoint, 0, sizeof(peer->endpoint));
+	if (!parse_endpoint(&peer->endpoint.addr, value, background))
 		return false;
+	if (peer->endpoint.addr.sa_family == AF_UNSPEC) {
+		peer->deferred_endpoint = strdup(value);
+		if (!peer->deferred_endpoint) {
+			perror("strdup");
+			return false;
+		}
 	}
-	freeaddrinfo(resolved);
-	free(mutable);
 	return true;
 }
 
@@ -337,26 +434,36 @@ static bool validate_netmask(struct wgallowedip *allowedip)
 	return true;
 }
 
-static inline bool parse_allowedips(struct wgpeer *peer, struct wgallowedip **last_allowedip, const char *value)
+/* With incremental set, entries may all be prefixed with + or -, to add or remove them alone rather than replacing the rest. */
+static inline bool parse_allowedips(struct wgpeer *peer, struct wgallowedip **last_allowedip, const char *value, bool incremental)
 {
 	struct wgallowedip *allowedip = *last_allowedip, *new_allowedip;
 	char *mask, *mutable = strdup(value), *sep, *saved_entry;
+	size_t signed_entries = 0, entries = 0;
 
 	if (!mutable) {
 		perror("strdup");
 		return false;
 	}
-	peer->flags |= WGPEER_REPLACE_ALLOWEDIPS;
 	if (!strlen(value)) {
+		peer->flags |= WGPEER_REPLACE_ALLOWEDIPS;
 		free(mutable);
 		return true;
 	}
 	sep = mutable;
 	while ((mask = strsep(&sep, ","))) {
 		unsigned long cidr;
+		uint32_t flags = 0;
 		char *end, *ip;
 
 		saved_entry = strdup(mask);
+		if (incremental && (mask[0] == '+' || mask[0] == '-')) {
+			if (mask[0] == '-')
+				flags = WGALLOWEDIP_REMOVE_ME;
+			++mask;
+			++signed_entries;
+		}
+		++entries;
 		ip = strsep(&mask, "/");
 
 		new_allowedip = calloc(1, sizeof(*new_allowedip));
@@ -387,6 +494,7 @@ static inline bool parse_allowedips(struct wgpeer *peer, struct wgallowedip **la
 		else
 			goto err;
 		new_allowedip->cidr = cidr;
+		new_allowedip->flags = flags;
 
 		if (!validate_netmask(new_allowedip))
 			fprintf(stderr, "Warning: AllowedIP has nonzero host part: %s/%s\n", ip, mask);
@@ -400,6 +508,12 @@ static inline bool parse_allowedips(struct wgpeer *peer, struct wgallowedip **la
 	}
 	free(mutable);
 	*last_allowedip = allowedip;
+	if (signed_entries && signed_entries != entries) {
+		fprintf(stderr, "AllowedIPs must either all or none be prefixed with + or -: `%s'\n", value);
+		return false;
+	}
+	if (!signed_entries)
+		peer->flags |= WGPEER_REPLACE_ALLOWEDIPS;
 	return true;
 
 err:
@@ -454,13 +568,13 @@ static bool process_line(struct config_ctx *ctx, const char *line)
 			goto error;
 	} else if (ctx->is_peer_section) {
 		if (key_match("Endpoint"))
-			ret = parse_endpoint(&ctx->last_peer->endpoint.addr, value);
+			ret = parse_peer_endpoint(ctx->last_peer, value);
 		else if (key_match("PublicKey")) {
 			ret = parse_key(ctx->last_peer->public_key, value);
 			if (ret)
 				ctx->last_peer->flags |= WGPEER_HAS_PUBLIC_KEY;
 		} else if (key_match("AllowedIPs"))
-			ret = parse_allowedips(ctx->last_peer, &ctx->last_allowedip, value);
+			ret = parse_allowedips(ctx->last_peer, &ctx->last_allowedip, value, false);
 		else if (key_match("PersistentKeepalive"))
 			ret = parse_persistent_keepalive(&ctx->last_peer->persistent_keepalive_interval, &ctx->last_peer->flags, value);
 		else if (key_match("PresharedKey")) {
@@ -543,6 +657,29 @@ err:
 	return NULL;
 }
 
+struct wgdevice *config_read_file(FILE *f, bool append)
+{
+	struct config_ctx ctx;
+	char *line = NULL;
+	size_t line_len = 0;
+	struct wgdevice *device = NULL;
+
+	if (!config_read_init(&ctx, append))
+		return NULL;
+	while (getline(&line, &line_len, f) >= 0) {
+		if (!config_read_line(&ctx, line)) {
+			fprintf(stderr, "Configuration parsing error\n");
+			goto out;
+		}
+	}
+	device = config_read_finish(&ctx);
+	if (!device)
+		fprintf(stderr, "Invalid configuration\n");
+out:
+	free(line);
+	return device;
+}
+
 static char *strip_spaces(const char *in)
 {
 	char *out;
@@ -611,7 +748,7 @@ struct wgdevice *config_read_cmd(char *argv[], int argc)
 			argv += 1;
 			argc -= 1;
 		} else if (!strcmp(argv[0], "endpoint") && argc >= 2 && peer) {
-			if (!parse_endpoint(&peer->endpoint.addr, argv[1]))
+			if (!parse_peer_endpoint(peer, argv[1]))
 				goto error;
 			argv += 2;
 			argc -= 2;
@@ -620,7 +757,7 @@ struct wgdevice *config_read_cmd(char *argv[], int argc)
 
 			if (!line)
 				goto error;
-			if (!parse_allowedips(peer, &allowedip, line)) {
+			if (!parse_allowedips(peer, &allowedip, line, true)) {
 				free(line);
 				goto error;
 			}
@@ -7,6 +7,9 @@
 #define CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
 
 struct wgdevice;
 struct wgpeer;
@@ -23,5 +26,10 @@ struct wgdevice *config_read_cmd(char *argv[], int argc);
 bool config_read_init(struct config_ctx *ctx, bool append);
 bool config_read_line(struct config_ctx *ctx, const char *line);
 struct wgdevice *config_read_finish(struct config_ctx *ctx);
+struct wgdevice *config_read_file(FILE *f, bool append);
+bool config_parse_duration(uint64_t *seconds, const char *value);
+int config_dns_retries(void);
+bool config_dns_error_is_permanent(int ret);
+int config_lookup_endpoint(struct sockaddr *endpoint, const char *value, bool numeric);
 
 #endif
@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <net/if.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "containers.h"
+#include "format.h"
+#include "ipc.h"
+#include "subcommands.h"
+
+struct cached_device {
+	char name[IFNAMSIZ];
+	struct wgdevice *device;
+	uint64_t when;
+};
+
+static struct {
+	struct cached_device *items;
+	size_t len, cap;
+	char *interfaces;
+	uint64_t interfaces_when;
+} cache;
+
+static uint64_t freshness_ns = 1000000000ULL;
+
+/* The control socket is reachable from every network namespace, but what is
+ * cached is only good for the one the daemon runs in. */
+static char own_netns[64];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cleanup(int signum)
+{
+	unlink(IPC_DAEMON_PATH);
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+static struct cached_device *cache_find(const char *name)
+{
+	for (size_t i = 0; i < cache.len; ++i) {
+		if (!strcmp(cache.items[i].name, name))
+			return &cache.items[i];
+	}
+	return NULL;
+}
+
+static void cache_drop(const char *name)
+{
+	struct cached_device *entry = cache_find(name);
+
+	if (!entry)
+		return;
+	free_wgdevice(entry->device);
+	*entry = cache.items[--cache.len];
+}
+
+static int cache_get(struct wgdevice **device, const char *name)
+{
+	struct cached_device *entry = cache_find(name);
+	uint64_t now = now_ns();
+	int ret;
+
+	if (entry && now - entry->when < freshness_ns) {
+		*device = entry->device;
+		return 0;
+	}
+	cache_drop(name);
+	ret = ipc_get_device(device, name);
+	if (ret < 0)
+		return ret;
+
+	if (cache.len == cache.cap) {
+		size_t new_cap = cache.cap ? cache.cap * 2 : 8;
+		struct cached_device *new_items = realloc(cache.items, new_cap * sizeof(*new_items));
+
+		if (!new_items) {
+			free_wgdevice(*device);
+			*device = NULL;
+			return -ENOMEM;
+		}
+		cache.items = new_items;
+		cache.cap = new_cap;
+	}
+	entry = &cache.items[cache.len++];
+	strncpy(entry->name, name, IFNAMSIZ - 1);
+	entry->name[IFNAMSIZ - 1] = '\0';
+	entry->device = *device;
+	entry->when = now;
+	return 0;
+}
+
+static int cache_list(const char **interfaces)
+{
+	uint64_t now = now_ns();
+
+	if (!cache.interfaces || now - cache.interfaces_when >= freshness_ns) {
+		free(cache.interfaces);
+		cache.interfaces = ipc_list_devices();
+		if (!cache.interfaces)
+			return -errno;
+		cache.interfaces_when = now;
+	}
+	*interfaces = cache.interfaces;
+	return 0;
+}
+
+static void serve(FILE *in, FILE *out)
+{
+	char *line = NULL, *extra = NULL, *value, *netns = NULL;
+	size_t line_len = 0, extra_len = 0;
+	ssize_t len;
+	int ret = -EPROTO;
+
+	/* Like the UAPI, one operation per connection: a key=value line, the caller's netns=net:[<inode>], and a blank line. */
+	len = getline(&line, &line_len, in);
+	if (len <= 1 || line[len - 1] != '\n')
+		goto out;
+	line[len - 1] = '\0';
+	value = strchr(line, '=');
+	if (!value)
+		goto out;
+	*value++ = '\0';
+	while ((len = getline(&extra, &extra_len, in)) > 1) {
+		if (extra[len - 1] != '\n' || strncmp(extra, "netns=", 6))
+			goto out;
+		extra[len - 1] = '\0';
+		free(netns);
+		netns = strdup(extra + 6);
+		if (!netns) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	if (len != 1)
+		goto out;
+	if (strcmp(netns ?: "", own_netns)) {
+		ret = -EXDEV;
+		goto out;
+	}
+
+	if (!strcmp(line, "get") && strlen(value) < IFNAMSIZ) {
+		struct wgdevice *device;
+
+		ret = cache_get(&device, value);
+		if (!ret)
+			format_uapi(out, device);
+	} else if (!strcmp(line, "list")) {
+		const char *interfaces = NULL, *interface;
+
+		ret = cache_list(&interfaces);
+		if (!ret) {
+			for (interface = interfaces; *interface; interface += strlen(interface) + 1)
+				fprintf(out, "interface=%s\n", interface);
+		}
+	} else if (!strcmp(line, "invalidate")) {
+		cache_drop(value);
+		free(cache.interfaces);
+		cache.interfaces = NULL;
+		ret = 0;
+	}
+out:
+	fprintf(out, "errno=%d\n\n", -ret);
+	free(netns);
+	free(extra);
+	free(line);
+}
+
+static bool daemon_running(const struct sockaddr_un *addr)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	bool running;
+
+	if (fd < 0)
+		return false;
+	running = !connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+	close(fd);
+	return running;
+}
+
+int daemon_main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct timeval timeout = { .tv_sec = 1 };
+	int fd;
+
+	if (argc == 3 && !strcmp(argv[1], "--freshness")) {
+		char *end;
+		unsigned long ms = strtoul(argv[2], &end, 10);
+
+		if (*end || !*argv[2]) {
+			fprintf(stderr, "Freshness is not a number of milliseconds: `%s'\n", argv[2]);
+			return 1;
+		}
+		freshness_ns = ms * 1000000ULL;
+	} else if (argc != 1) {
+		fprintf(stderr, "Usage: %s %s [--freshness <milliseconds>]\n", PROG_NAME, argv[0]);
+		return 1;
+	}
+
+	if (strlen(IPC_DAEMON_PATH) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path is too long: `%s'\n", IPC_DAEMON_PATH);
+		return 1;
+	}
+	strcpy(addr.sun_path, IPC_DAEMON_PATH);
+	if (daemon_running(&addr)) {
+		fprintf(stderr, "Another daemon is already listening on `%s'\n", IPC_DAEMON_PATH);
+		return 1;
+	}
+
+	readlink("/proc/self/ns/net", own_netns, sizeof(own_netns) - 1);
+
+	/* Gets come from the kernel or the userspace implementation, never from ourselves. */
+	ipc_daemon_forwarding(false);
+	ipc_session_begin();
+
+	mkdir(RUNSTATEDIR "/wireguard", 0755);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(IPC_DAEMON_PATH);
+	/* The cache holds private keys, so only our own user may connect. */
+	umask(077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+		perror("Unable to listen on control socket");
+		close(fd);
+		return 1;
+	}
+	signal(SIGTERM, cleanup);
+	signal(SIGINT, cleanup);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+		FILE *in, *out;
+
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		/* Requests are served one at a time, so a stuck client must not hold up the others. */
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		in = fdopen(client, "r");
+		out = in ? fdopen(dup(client), "w") : NULL;
+		if (!out) {
+			if (in)
+				fclose(in);
+			else
+				close(client);
+			continue;
+		}
+		serve(in, out);
+		fclose(out);
+		fclose(in);
+	}
+	unlink(IPC_DAEMON_PATH);
+	close(fd);
+	ipc_session_end();
+	return 1;
+}
@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allowedips.h"
+#include "config.h"
+#include "containers.h"
+#include "encoding.h"
+#include "format.h"
+#include "ipc.h"
+#include "subcommands.h"
+
+/* Changes are described in the terms of syncconf: peers missing from the file
+ * are removed, and a peer's endpoint, preshared key, persistent keepalive and
+ * allowed IPs are only compared when the file sets them. */
+
+enum output { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_SET };
+
+struct peer_index {
+	struct wgpeer **slots;
+	bool *matched;
+	size_t mask;
+};
+
+struct allowedip_delta {
+	struct wgallowedip *added, *removed;
+	size_t added_len, removed_len;
+};
+
+struct totals {
+	size_t peers_added, peers_removed, peers_changed, peers_unchanged;
+	size_t allowedips_added, allowedips_removed;
+};
+
+static enum output output;
+static const char *interface;
+static bool first_json_peer = true;
+
+static uint64_t key_hash(const uint8_t key[static WG_KEY_LEN])
+{
+	uint64_t hash = 0, word;
+
+	/* Keys need not be random, so every byte must reach the low bits that pick the slot. */
+	for (size_t i = 0; i < WG_KEY_LEN; i += sizeof(word)) {
+		memcpy(&word, key + i, sizeof(word));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	return hash ^ (hash >> 33);
+}
+
+static bool index_init(struct peer_index *index, struct wgdevice *device)
+{
+	struct wgpeer *peer;
+	size_t count = 0, size = 16;
+
+	for_each_wgpeer(device, peer)
+		++count;
+	while (size < count * 2)
+		size <<= 1;
+	index->slots = calloc(size, sizeof(*index->slots));
+	index->matched = calloc(size, sizeof(*index->matched));
+	if (!index->slots || !index->matched) {
+		free(index->slots);
+		free(index->matched);
+		return false;
+	}
+	index->mask = size - 1;
+	for_each_wgpeer(device, peer) {
+		size_t slot = key_hash(peer->public_key) & index->mask;
+
+		while (index->slots[slot]) {
+			/* The kernel never reports a peer twice, but a userspace implementation might. */
+			if (!memcmp(index->slots[slot]->public_key, peer->public_key, WG_KEY_LEN))
+				break;
+			slot = (slot + 1) & index->mask;
+		}
+		if (!index->slots[slot])
+			index->slots[slot] = peer;
+	}
+	return true;
+}
+
+static ssize_t index_find(const struct peer_index *index, const uint8_t key[static WG_KEY_LEN])
+{
+	size_t slot = key_hash(key) & index->mask;
+
+	for (; index->slots[slot]; slot = (slot + 1) & index->mask) {
+		if (!memcmp(index->slots[slot]->public_key, key, WG_KEY_LEN))
+			return slot;
+	}
+	return -1;
+}
+
+static int allowedip_sort_cmp(const void *first, const void *second)
+{
+	return allowedip_cmp(first, second);
+}
+
+/* Copies, masks, sorts and dedups a peer's allowed IPs, as the kernel would store them. */
+static struct wgallowedip *sorted_allowedips(const struct wgpeer *peer, size_t *len)
+{
+	struct wgallowedip *allowedip, *array;
+	size_t count = 0, i = 0, j;
+
+	for_each_wgallowedip(peer, allowedip)
+		++count;
+	array = calloc(count ?: 1, sizeof(*array));
+	if (!array)
+		return NULL;
+	for_each_wgallowedip(peer, allowedip) {
+		if (allowedip->family != AF_INET && allowedip->family != AF_INET6)
+			continue;
+		array[i] = *allowedip;
+		array[i].next_allowedip = NULL;
+		allowedip_mask(&array[i++]);
+	}
+	qsort(array, i, sizeof(*array), allowedip_sort_cmp);
+	for (j = 0, count = 0; j < i; ++j) {
+		if (!count || allowedip_cmp(&array[count - 1], &array[j]))
+			array[count++] = array[j];
+	}
+	*len = count;
+	return array;
+}
+
+static bool diff_allowedips(const struct wgpeer *want, const struct wgpeer *have, struct allowedip_delta *delta)
+{
+	struct wgallowedip *a, *b;
+	size_t a_len = 0, b_len = 0, i = 0, j = 0;
+
+	memset(delta, 0, sizeof(*delta));
+	a = sorted_allowedips(want, &a_len);
+	b = have ? sorted_allowedips(have, &b_len) : calloc(1, sizeof(*b));
+	if (!a || !b) {
+		free(a);
+		free(b);
+		return false;
+	}
+	/* Both arrays are reused in place: they only ever shrink. */
+	while (i < a_len || j < b_len) {
+		int cmp = i == a_len ? 1 : j == b_len ? -1 : allowedip_cmp(&a[i], &b[j]);
+
+		if (cmp < 0)
+			a[delta->added_len++] = a[i++];
+		else if (cmp > 0)
+			b[delta->removed_len++] = b[j++];
+		else
+			++i, ++j;
+	}
+	delta->added = a;
+	delta->removed = b;
+	return true;
+}
+
+static bool endpoint_equal(const struct wgpeer *a, const struct wgpeer *b)
+{
+	if (a->endpoint.addr.sa_family != b->endpoint.addr.sa_family)
+		return false;
+	if (a->endpoint.addr.sa_family == AF_INET)
+		return a->endpoint.addr4.sin_port == b->endpoint.addr4.sin_port &&
+		       a->endpoint.addr4.sin_addr.s_addr == b->endpoint.addr4.sin_addr.s_addr;
+	if (a->endpoint.addr.sa_family == AF_INET6)
+		return a->endpoint.addr6.sin6_port == b->endpoint.addr6.sin6_port &&
+		       a->endpoint.addr6.sin6_scope_id == b->endpoint.addr6.sin6_scope_id &&
+		       !memcmp(&a->endpoint.addr6.sin6_addr, &b->endpoint.addr6.sin6_addr, sizeof(struct in6_addr));
+	return true;
+}
+
+static const char *endpoint_string(char buf[static FORMAT_ENDPOINT_LEN], const struct wgpeer *peer)
+{
+	if (peer->endpoint.addr.sa_family != AF_INET && peer->endpoint.addr.sa_family != AF_INET6)
+		return "(none)";
+	format_endpoint(buf, &peer->endpoint.addr);
+	return buf;
+}
+
+static const char *keepalive_string(char buf[static 8], uint16_t interval)
+{
+	if (!interval)
+		return "off";
+	snprintf(buf, 8, "%u", interval);
+	return buf;
+}
+
+static void print_allowedips(const struct wgallowedip *array, size_t len, const char *separator, const char *quote)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	for (size_t i = 0; i < len; ++i)
+		printf("%s%s%s/%u%s", i ? separator : "", quote, format_ip(ip, &array[i]), array[i].cidr, quote);
+}
+
+static void print_device(const struct wgdevice *want, const struct wgdevice *have, size_t *changes)
+{
+	bool private_key = (want->flags & WGDEVICE_HAS_PRIVATE_KEY) &&
+			   ((bool)(have->flags & WGDEVICE_HAS_PRIVATE_KEY) != !key_is_zero(want->private_key) ||
+			    memcmp(want->private_key, have->private_key, WG_KEY_LEN));
+	bool listen_port = (want->flags & WGDEVICE_HAS_LISTEN_PORT) && want->listen_port != have->listen_port;
+	bool fwmark = (want->flags & WGDEVICE_HAS_FWMARK) && want->fwmark != have->fwmark;
+
+	*changes = private_key + listen_port + fwmark;
+	if (output == OUTPUT_TEXT) {
+		if (private_key)
+			printf("interface: private key %s\n", key_is_zero(want->private_key) ? "removed" : have->flags & WGDEVICE_HAS_PRIVATE_KEY ? "changed" : "added");
+		if (listen_port)
+			printf("interface: listen port %u -> %u\n", have->listen_port, want->listen_port);
+		if (fwmark)
+			printf("interface: fwmark 0x%x -> 0x%x\n", have->fwmark, want->fwmark);
+	} else if (output == OUTPUT_JSON) {
+		printf("\t\"interface\": {");
+		if (private_key)
+			printf("\"private_key\": \"%s\"%s", key_is_zero(want->private_key) ? "removed" : have->flags & WGDEVICE_HAS_PRIVATE_KEY ? "changed" : "added", listen_port || fwmark ? ", " : "");
+		if (listen_port)
+			printf("\"listen_port\": [%u, %u]%s", have->listen_port, want->listen_port, fwmark ? ", " : "");
+		if (fwmark)
+			printf("\"fwmark\": [%u, %u]", have->fwmark, want->fwmark);
+		printf("},\n\t\"peers\": [");
+	} else {
+		/* `wg set' only takes keys from files, so a new private key is left to the caller. */
+		if (private_key && !key_is_zero(want->private_key))
+			printf("# %s: private key differs, and must be set from a file\n", interface);
+		if ((private_key && key_is_zero(want->private_key)) || listen_port || fwmark) {
+			printf("set %s", interface);
+			if (private_key && key_is_zero(want->private_key))
+				printf(" private-key /dev/null");
+			if (listen_port)
+				printf(" listen-port %u", want->listen_port);
+			if (fwmark)
+				printf(" fwmark %u", want->fwmark);
+			printf("\n");
+		}
+	}
+}
+
+static void print_removed(const struct wgpeer *have)
+{
+	char base64[WG_KEY_LEN_BASE64];
+
+	key_to_base64(base64, have->public_key);
+	if (output == OUTPUT_TEXT)
+		printf("peer %s: removed\n", base64);
+	else if (output == OUTPUT_JSON) {
+		printf("%s\n\t\t{\"public_key\": \"%s\", \"change\": \"removed\"}", first_json_peer ? "" : ",", base64);
+		first_json_peer = false;
+	} else
+		printf("set %s peer %s remove\n", interface, base64);
+}
+
+/* Returns whether anything differs, or -1 on allocation failure. */
+static int print_peer(const struct wgpeer *want, const struct wgpeer *have, struct totals *totals)
+{
+	char base64[WG_KEY_LEN_BASE64], old_addr[FORMAT_ENDPOINT_LEN], new_addr[FORMAT_ENDPOINT_LEN], old_keepalive[8], new_keepalive[8];
+	struct allowedip_delta delta = { 0 };
+	bool endpoint = false, preshared_key = false, keepalive = false, allowedips;
+	const char *psk_change = NULL;
+
+	if (want->flags & WGPEER_REPLACE_ALLOWEDIPS) {
+		if (!diff_allowedips(want, have, &delta))
+			return -1;
+	}
+	allowedips = delta.added_len || delta.removed_len;
+	if (have) {
+		endpoint = (want->endpoint.addr.sa_family == AF_INET || want->endpoint.addr.sa_family == AF_INET6) && !endpoint_equal(want, have);
+		if (want->flags & WGPEER_HAS_PRESHARED_KEY) {
+			bool had = have->flags & WGPEER_HAS_PRESHARED_KEY, wants = !key_is_zero(want->preshared_key);
+
+			preshared_key = had != wants || (had && memcmp(want->preshared_key, have->preshared_key, WG_KEY_LEN));
+			psk_change = !wants ? "removed" : had ? "changed" : "added";
+		}
+		keepalive = (want->flags & WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL) && want->persistent_keepalive_interval != have->persistent_keepalive_interval;
+		if (!endpoint && !preshared_key && !keepalive && !allowedips) {
+			++totals->peers_unchanged;
+			free(delta.added);
+			free(delta.removed);
+			return 0;
+		}
+		++totals->peers_changed;
+	} else {
+		endpoint = want->endpoint.addr.sa_family == AF_INET || want->endpoint.addr.sa_family == AF_INET6;
+		preshared_key = (want->flags & WGPEER_HAS_PRESHARED_KEY) && !key_is_zero(want->preshared_key);
+		psk_change = "added";
+		keepalive = want->persistent_keepalive_interval;
+		++totals->peers_added;
+	}
+	totals->allowedips_added += delta.added_len;
+	totals->allowedips_removed += delta.removed_len;
+
+	key_to_base64(base64, want->public_key);
+	if (output == OUTPUT_TEXT) {
+		printf("peer %s: %s\n", base64, have ? "changed" : "added");
+		if (endpoint)
+			printf("  endpoint: %s -> %s\n", have ? endpoint_string(old_addr, have) : "(none)", endpoint_string(new_addr, want));
+		if (preshared_key)
+			printf("  preshared key: %s\n", psk_change);
+		if (keepalive)
+			printf("  persistent keepalive: %s -> %s\n", keepalive_string(old_keepalive, have ? have->persistent_keepalive_interval : 0), keepalive_string(new_keepalive, want->persistent_keepalive_interval));
+		if (delta.added_len) {
+			printf("  allowed ips added: ");
+			print_allowedips(delta.added, delta.added_len, ", ", "");
+			printf("\n");
+		}
+		if (delta.removed_len) {
+			printf("  allowed ips removed: ");
+			print_allowedips(delta.removed, delta.removed_len, ", ", "");
+			printf("\n");
+		}
+	} else if (output == OUTPUT_JSON) {
+		printf("%s\n\t\t{\"public_key\": \"%s\", \"change\": \"%s\"", first_json_peer ? "" : ",", base64, have ? "changed" : "added");
+		first_json_peer = false;
+		if (endpoint) {
+			printf(", \"endpoint\": [");
+			if (have && (have->endpoint.addr.sa_family == AF_INET || have->endpoint.addr.sa_family == AF_INET6))
+				format_json_string(stdout, endpoint_string(old_addr, have));
+			else
+				printf("null");
+			printf(", ");
+			format_json_string(stdout, endpoint_string(new_addr, want));
+			printf("]");
+		}
+		if (preshared_key)
+			printf(", \"preshared_key\": \"%s\"", psk_change);
+		if (keepalive)
+			printf(", \"persistent_keepalive\": [%u, %u]", have ? have->persistent_keepalive_interval : 0, want->persistent_keepalive_interval);
+		if (delta.added_len) {
+			printf(", \"allowed_ips_added\": [");
+			print_allowedips(delta.added, delta.added_len, ", ", "\"");
+			printf("]");
+		}
+		if (delta.removed_len) {
+			printf(", \"allowed_ips_removed\": [");
+			print_allowedips(delta.removed, delta.removed_len, ", ", "\"");
+			printf("]");
+		}
+		printf("}");
+	} else {
+		if (preshared_key && (!have || strcmp(psk_change, "removed")))
+			printf("# %s: preshared key of peer %s differs, and must be set from a file\n", interface, base64);
+		/* A peer that is only missing its new preshared key has nothing left to set. */
+		if (have && !endpoint && !keepalive && !allowedips && strcmp(psk_change, "removed"))
+			goto out;
+		printf("set %s peer %s", interface, base64);
+		if (preshared_key && have && !strcmp(psk_change, "removed"))
+			printf(" preshared-key /dev/null");
+		if (endpoint)
+			printf(" endpoint %s", endpoint_string(new_addr, want));
+		if (keepalive)
+			printf(" persistent-keepalive %s", keepalive_string(new_keepalive, want->persistent_keepalive_interval));
+		/* Give the allowed IPs to add and remove, unless the full new list is shorter. */
+		if (allowedips || !have) {
+			struct wgallowedip *all;
+			size_t all_len = 0;
+
+			all = sorted_allowedips(want, &all_len);
+			if (!all) {
+				free(delta.added);
+				free(delta.removed);
+				return -1;
+			}
+			printf(" allowed-ips ");
+			if (have && delta.added_len + delta.removed_len < all_len) {
+				for (size_t i = 0; i < delta.added_len + delta.removed_len; ++i) {
+					bool added = i < delta.added_len;
+					const struct wgallowedip *allowedip = added ? &delta.added[i] : &delta.removed[i - delta.added_len];
+					char ip[INET6_ADDRSTRLEN];
+
+					printf("%s%c%s/%u", i ? "," : "", added ? '+' : '-', format_ip(ip, allowedip), allowedip->cidr);
+				}
+			} else if (all_len)
+				print_allowedips(all, all_len, ",", "");
+			else
+				printf("\"\"");
+			free(all);
+		}
+		printf("\n");
+	}
+out:
+	free(delta.added);
+	free(delta.removed);
+	return 1;
+}
+
+int diff_main(int argc, char *argv[])
+{
+	struct wgdevice *want = NULL, *have = NULL;
+	struct peer_index index = { 0 };
+	struct totals totals = { 0 };
+	ssize_t *partners = NULL;
+	struct wgpeer *peer;
+	size_t device_changes = 0, i;
+	FILE *config_input;
+	int ret = 2;
+
+	output = OUTPUT_TEXT;
+	if (argc == 4 && !strcmp(argv[3], "--json"))
+		output = OUTPUT_JSON;
+	else if (argc == 4 && !strcmp(argv[3], "--set"))
+		output = OUTPUT_SET;
+	else if (argc != 3) {
+		fprintf(stderr, "Usage: %s %s <interface> <configuration filename> [--json | --set]\n", PROG_NAME, argv[0]);
+		return 2;
+	}
+	interface = argv[1];
+
+	config_input = fopen(argv[2], "r");
+	if (!config_input) {
+		perror("fopen");
+		return 2;
+	}
+	want = config_read_file(config_input, false);
+	fclose(config_input);
+	if (!want)
+		return 2;
+
+	if (ipc_get_device(&have, interface) < 0) {
+		perror("Unable to access interface");
+		goto cleanup;
+	}
+	if (!index_init(&index, have)) {
+		perror("Peer index allocation");
+		goto cleanup;
+	}
+
+	/* First pair up peers, so that removals may be listed before additions and changes. */
+	i = 0;
+	for_each_wgpeer(want, peer)
+		++i;
+	partners = calloc(i ?: 1, sizeof(*partners));
+	if (!partners) {
+		perror("Peer allocation");
+		goto cleanup;
+	}
+	i = 0;
+	for_each_wgpeer(want, peer) {
+		partners[i] = index_find(&index, peer->public_key);
+		if (partners[i] >= 0)
+			index.matched[partners[i]] = true;
+		++i;
+	}
+
+	if (output == OUTPUT_JSON) {
+		printf("{\n\t\"interface_name\": ");
+		format_json_string(stdout, interface);
+		printf(",\n");
+	}
+	print_device(want, have, &device_changes);
+	for_each_wgpeer(have, peer) {
+		ssize_t slot = index_find(&index, peer->public_key);
+
+		if (slot >= 0 && index.slots[slot] == peer && !index.matched[slot]) {
+			print_removed(peer);
+			++totals.peers_removed;
+		}
+	}
+	i = 0;
+	for_each_wgpeer(want, peer) {
+		if (print_peer(peer, partners[i] >= 0 ? index.slots[partners[i]] : NULL, &totals) < 0) {
+			perror("Allowed IP allocation");
+			goto cleanup;
+		}
+		++i;
+	}
+
+	if (output == OUTPUT_TEXT)
+		printf("%zu peers added, %zu removed, %zu changed, %zu unchanged; %zu allowed ips added, %zu removed\n",
+		       totals.peers_added, totals.peers_removed, totals.peers_changed, totals.peers_unchanged,
+		       totals.allowedips_added, totals.allowedips_removed);
+	else if (output == OUTPUT_JSON)
+		printf("%s],\n\t\"summary\": {\"peers_added\": %zu, \"peers_removed\": %zu, \"peers_changed\": %zu, \"peers_unchanged\": %zu, \"allowed_ips_added\": %zu, \"allowed_ips_removed\": %zu}\n}\n",
+		       first_json_peer ? "" : "\n\t", totals.peers_added, totals.peers_removed, totals.peers_changed, totals.peers_unchanged,
+		       totals.allowedips_added, totals.allowedips_removed);
+	/* Like diff(1): 0 when nothing would change, 1 when something would, and 2 on trouble. */
+	ret = device_changes || totals.peers_added || totals.peers_removed || totals.peers_changed ? 1 : 0;
+
+cleanup:
+	free(partners);
+	free(index.slots);
+	free(index.matched);
+	free_wgdevice(have);
+	free_wgdevice(want);
+	return ret;
+}
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "subcommands.h"
+
+#ifdef __linux__
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+/* wg-quick(8) keeps the rules it adds for an interface in nf_tables tables of
+ * their own, named wg-quick-<interface> in the ip and ip6 families, so tearing
+ * them down is a matter of deleting those two by name. Doing so directly saves
+ * listing every table on the system through nft(8) first, which on hosts with
+ * very large rulesets takes far longer than the deletion itself. */
+
+#define TABLE_PREFIX "wg-quick-"
+#define NL_ALIGN(len) (((len) + 3U) & ~3U)
+
+static void *put_msg(char *buf, size_t *len, uint16_t type, uint16_t flags, uint32_t seq, uint8_t family, uint16_t res_id)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(buf + *len);
+	struct nfgenmsg *nfg = (struct nfgenmsg *)(nlh + 1);
+
+	memset(nlh, 0, NLMSG_HDRLEN + sizeof(*nfg));
+	nlh->nlmsg_len = NLMSG_HDRLEN + NL_ALIGN(sizeof(*nfg));
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = seq;
+	nfg->nfgen_family = family;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(res_id);
+	return nlh;
+}
+
+static void put_strz(struct nlmsghdr *nlh, uint16_t type, const char *value)
+{
+	struct nlattr *attr = (struct nlattr *)((char *)nlh + nlh->nlmsg_len);
+	size_t len = strlen(value) + 1;
+
+	attr->nla_type = type;
+	attr->nla_len = NLA_HDRLEN + len;
+	memcpy((char *)attr + NLA_HDRLEN, value, len);
+	memset((char *)attr + NLA_HDRLEN + len, 0, NL_ALIGN(attr->nla_len) - attr->nla_len);
+	nlh->nlmsg_len += NL_ALIGN(attr->nla_len);
+}
+
+/* Each family goes in a batch of its own, since a batch is a transaction, and
+ * the table missing from one family would otherwise keep the other's from
+ * being deleted. A table that is not there counts as deleted. */
+static int delete_table(int fd, uint8_t family, const char *name, uint32_t seq)
+{
+	char buf[512] __attribute__((aligned(NLMSG_ALIGNTO)));
+	size_t len = 0;
+	struct nlmsghdr *nlh;
+	ssize_t ret;
+
+	nlh = put_msg(buf, &len, NFNL_MSG_BATCH_BEGIN, 0, seq, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+	len += nlh->nlmsg_len;
+	nlh = put_msg(buf, &len, (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_DELTABLE, NLM_F_ACK, seq + 1, family, 0);
+	put_strz(nlh, NFTA_TABLE_NAME, name);
+	len += nlh->nlmsg_len;
+	nlh = put_msg(buf, &len, NFNL_MSG_BATCH_END, 0, seq + 2, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+	len += nlh->nlmsg_len;
+	if (send(fd, buf, len, 0) != (ssize_t)len)
+		return -errno;
+
+	for (;;) {
+		ret = recv(fd, buf, sizeof(buf), 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, ret); nlh = NLMSG_NEXT(nlh, ret)) {
+			const struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+			if (nlh->nlmsg_type != NLMSG_ERROR || nlh->nlmsg_seq < seq || nlh->nlmsg_seq > seq + 2)
+				continue;
+			if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*err)))
+				return -EBADMSG;
+			if (err->error && err->error != -ENOENT)
+				return err->error;
+			if (nlh->nlmsg_seq == seq + 1)
+				return 0;
+		}
+	}
+}
+
+static int remove_firewall(const char *interface)
+{
+	static const uint8_t families[] = { NFPROTO_IPV4, NFPROTO_IPV6 };
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	char name[sizeof(TABLE_PREFIX) + IFNAMSIZ];
+	struct timeval timeout = { .tv_sec = 5 };
+	uint32_t seq = time(NULL);
+	int fd, ret = 0;
+
+	if (strlen(interface) >= IFNAMSIZ)
+		return -EINVAL;
+	snprintf(name, sizeof(name), TABLE_PREFIX "%s", interface);
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+	if (fd < 0)
+		return -errno;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]) && !ret; ++i, seq += 3)
+		ret = delete_table(fd, families[i], name, seq);
+out:
+	close(fd);
+	return ret;
+}
+#else
+static int remove_firewall(const char *interface)
+{
+	(void)interface;
+	return -EOPNOTSUPP;
+}
+#endif
+
+int remove_firewall_main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s %s <interface>\n", PROG_NAME, argv[0]);
+		return 1;
+	}
+	ret = remove_firewall(argv[1]);
+	/* Without nf_tables there can be no tables to delete, which wg-quick(8) expects quietly on iptables-only hosts. */
+	if (ret == -EPROTONOSUPPORT || ret == -EOPNOTSUPP)
+		return 2;
+	if (ret < 0) {
+		fprintf(stderr, "Unable to delete the nftables tables of `%s': %s\n", argv[1], strerror(-ret));
+		return 1;
+	}
+	return 0;
+}
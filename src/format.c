@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+
+#include "containers.h"
+#include "encoding.h"
+#include "format.h"
+
+/* Unlike their counterparts in show.c, these write into the caller's buffers,
+ * since they are also used by library callers that may be threaded. */
+
+static const char *maybe_key(char base64[static WG_KEY_LEN_BASE64], const uint8_t key[static WG_KEY_LEN], bool have_it)
+{
+	if (!have_it)
+		return "(none)";
+	key_to_base64(base64, key);
+	return base64;
+}
+
+const char *format_ip(char buf[static INET6_ADDRSTRLEN], const struct wgallowedip *allowedip)
+{
+	buf[0] = '\0';
+	if (allowedip->family == AF_INET)
+		inet_ntop(AF_INET, &allowedip->ip4, buf, INET6_ADDRSTRLEN);
+	else if (allowedip->family == AF_INET6)
+		inet_ntop(AF_INET6, &allowedip->ip6, buf, INET6_ADDRSTRLEN);
+	return buf;
+}
+
+/* On failure, buf holds the resolver's error string instead. */
+bool format_endpoint(char buf[static FORMAT_ENDPOINT_LEN], const struct sockaddr *addr)
+{
+	char host[4096 + 1];
+	char service[512 + 1];
+	socklen_t addr_len = 0;
+	int ret;
+
+	if (addr->sa_family == AF_INET)
+		addr_len = sizeof(struct sockaddr_in);
+	else if (addr->sa_family == AF_INET6)
+		addr_len = sizeof(struct sockaddr_in6);
+
+	ret = getnameinfo(addr, addr_len, host, sizeof(host), service, sizeof(service), NI_DGRAM | NI_NUMERICSERV | NI_NUMERICHOST);
+	if (ret) {
+		snprintf(buf, FORMAT_ENDPOINT_LEN, "%s", gai_strerror(ret));
+		return false;
+	}
+	snprintf(buf, FORMAT_ENDPOINT_LEN, (addr->sa_family == AF_INET6 && strchr(host, ':')) ? "[%s]:%s" : "%s:%s", host, service);
+	return true;
+}
+
+void format_conf(FILE *f, const struct wgdevice *device)
+{
+	char base64[WG_KEY_LEN_BASE64];
+	char buf[INET6_ADDRSTRLEN], addr[FORMAT_ENDPOINT_LEN];
+	struct wgpeer *peer;
+	struct wgallowedip *allowedip;
+
+	fprintf(f, "[Interface]\n");
+	if (device->listen_port)
+		fprintf(f, "ListenPort = %u\n", device->listen_port);
+	if (device->fwmark)
+		fprintf(f, "FwMark = 0x%x\n", device->fwmark);
+	if (device->flags & WGDEVICE_HAS_PRIVATE_KEY)
+		fprintf(f, "PrivateKey = %s\n", maybe_key(base64, device->private_key, true));
+	fprintf(f, "\n");
+	for_each_wgpeer(device, peer) {
+		fprintf(f, "[Peer]\nPublicKey = %s\n", maybe_key(base64, peer->public_key, true));
+		if (peer->flags & WGPEER_HAS_PRESHARED_KEY)
+			fprintf(f, "PresharedKey = %s\n", maybe_key(base64, peer->preshared_key, true));
+		if (peer->first_allowedip)
+			fprintf(f, "AllowedIPs = ");
+		for_each_wgallowedip(peer, allowedip) {
+			if (!*format_ip(buf, allowedip))
+				continue;
+			fprintf(f, "%s/%d", buf, allowedip->cidr);
+			if (allowedip->next_allowedip)
+				fprintf(f, ", ");
+		}
+		if (peer->first_allowedip)
+			fprintf(f, "\n");
+
+		if ((peer->endpoint.addr.sa_family == AF_INET || peer->endpoint.addr.sa_family == AF_INET6) && format_endpoint(addr, &peer->endpoint.addr))
+			fprintf(f, "Endpoint = %s\n", addr);
+
+		if (peer->persistent_keepalive_interval)
+			fprintf(f, "PersistentKeepalive = %u\n", peer->persistent_keepalive_interval);
+
+		if (peer->next_peer)
+			fprintf(f, "\n");
+	}
+}
+
+void format_dump(FILE *f, const struct wgdevice *device, bool with_interface)
+{
+	char base64[WG_KEY_LEN_BASE64];
+	char buf[INET6_ADDRSTRLEN], addr[FORMAT_ENDPOINT_LEN];
+	struct wgpeer *peer;
+	struct wgallowedip *allowedip;
+
+	if (with_interface)
+		fprintf(f, "%s\t", device->name);
+	fprintf(f, "%s\t", maybe_key(base64, device->private_key, device->flags & WGDEVICE_HAS_PRIVATE_KEY));
+	fprintf(f, "%s\t", maybe_key(base64, device->public_key, device->flags & WGDEVICE_HAS_PUBLIC_KEY));
+	fprintf(f, "%u\t", device->listen_port);
+	if (device->fwmark)
+		fprintf(f, "0x%x\n", device->fwmark);
+	else
+		fprintf(f, "off\n");
+	for_each_wgpeer(device, peer) {
+		if (with_interface)
+			fprintf(f, "%s\t", device->name);
+		fprintf(f, "%s\t", maybe_key(base64, peer->public_key, true));
+		fprintf(f, "%s\t", maybe_key(base64, peer->preshared_key, peer->flags & WGPEER_HAS_PRESHARED_KEY));
+		if (peer->endpoint.addr.sa_family == AF_INET || peer->endpoint.addr.sa_family == AF_INET6) {
+			format_endpoint(addr, &peer->endpoint.addr);
+			fprintf(f, "%s\t", addr);
+		} else
+			fprintf(f, "(none)\t");
+		if (peer->first_allowedip) {
+			for_each_wgallowedip(peer, allowedip)
+				fprintf(f, "%s/%u%c", format_ip(buf, allowedip), allowedip->cidr, allowedip->next_allowedip ? ',' : '\t');
+		} else
+			fprintf(f, "(none)\t");
+		fprintf(f, "%llu\t", (unsigned long long)peer->last_handshake_time.tv_sec);
+		fprintf(f, "%" PRIu64 "\t%" PRIu64 "\t", (uint64_t)peer->rx_bytes, (uint64_t)peer->tx_bytes);
+		if (peer->persistent_keepalive_interval)
+			fprintf(f, "%u\n", peer->persistent_keepalive_interval);
+		else
+			fprintf(f, "off\n");
+	}
+}
+
+/* The reply to a UAPI get=1, without its errno line. */
+void format_uapi(FILE *f, const struct wgdevice *device)
+{
+	char hex[WG_KEY_LEN_HEX];
+	char buf[INET6_ADDRSTRLEN], addr[FORMAT_ENDPOINT_LEN];
+	struct wgpeer *peer;
+	struct wgallowedip *allowedip;
+
+	if (device->flags & WGDEVICE_HAS_PRIVATE_KEY) {
+		key_to_hex(hex, device->private_key);
+		fprintf(f, "private_key=%s\n", hex);
+	}
+	fprintf(f, "listen_port=%u\n", device->listen_port);
+	if (device->fwmark)
+		fprintf(f, "fwmark=%u\n", device->fwmark);
+	for_each_wgpeer(device, peer) {
+		key_to_hex(hex, peer->public_key);
+		fprintf(f, "public_key=%s\n", hex);
+		if (peer->flags & WGPEER_HAS_PRESHARED_KEY) {
+			key_to_hex(hex, peer->preshared_key);
+			fprintf(f, "preshared_key=%s\n", hex);
+		}
+		if ((peer->endpoint.addr.sa_family == AF_INET || peer->endpoint.addr.sa_family == AF_INET6) && format_endpoint(addr, &peer->endpoint.addr))
+			fprintf(f, "endpoint=%s\n", addr);
+		fprintf(f, "last_handshake_time_sec=%llu\nlast_handshake_time_nsec=%llu\n",
+			(unsigned long long)peer->last_handshake_time.tv_sec, (unsigned long long)peer->last_handshake_time.tv_nsec);
+		fprintf(f, "rx_bytes=%" PRIu64 "\ntx_bytes=%" PRIu64 "\n", (uint64_t)peer->rx_bytes, (uint64_t)peer->tx_bytes);
+		fprintf(f, "persistent_keepalive_interval=%u\n", peer->persistent_keepalive_interval);
+		for_each_wgallowedip(peer, allowedip) {
+			if (*format_ip(buf, allowedip))
+				fprintf(f, "allowed_ip=%s/%u\n", buf, allowedip->cidr);
+		}
+	}
+}
+
+void format_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define FORMAT_ENDPOINT_LEN (4096 + 1 + 512 + 1 + 4)
+
+struct wgdevice;
+struct wgallowedip;
+
+const char *format_ip(char buf[static INET6_ADDRSTRLEN], const struct wgallowedip *allowedip);
+bool format_endpoint(char buf[static FORMAT_ENDPOINT_LEN], const struct sockaddr *addr);
+
+void format_conf(FILE *f, const struct wgdevice *device);
+void format_dump(FILE *f, const struct wgdevice *device, bool with_interface);
+void format_uapi(FILE *f, const struct wgdevice *device);
+void format_json_string(FILE *f, const char *str);
+
+#endif
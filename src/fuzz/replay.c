@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2018-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * Deterministic, non-fuzzing driver for the harnesses in this directory. It
+ * feeds every file of a saved corpus to LLVMFuzzerTestOneInput and times each
+ * one. Inputs that are slow enough to matter are then timed again on their first
+ * half: linear parsing roughly halves the time, while quadratic parsing
+ * quarters it, so a high full-to-half ratio flags an algorithmic blowup.
+ */
+
+#undef main
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len);
+
+struct sample {
+	char *path;
+	size_t len;
+	uint64_t ns, half_ns;
+};
+
+struct samples {
+	struct sample *items;
+	size_t len, cap;
+};
+
+/* Some harnesses point stdout and stderr at /dev/null, so report through our own stream. */
+static FILE *report;
+
+static unsigned int repetitions = 3;
+static double growth_limit = 3.0;
+static uint64_t min_ns = 1000000ULL, max_ns = 2000000000ULL;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+	uint8_t *data = NULL;
+	struct stat sbuf;
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &sbuf) < 0)
+		goto err;
+	/* Always allocate at least one byte, so that harnesses may look at data[0] for an empty input, like libFuzzer. */
+	data = malloc(sbuf.st_size + 1);
+	if (!data)
+		goto err;
+	while (done < (size_t)sbuf.st_size) {
+		ret = read(fd, data + done, sbuf.st_size - done);
+		if (ret <= 0)
+			goto err;
+		done += ret;
+	}
+	close(fd);
+	*len = done;
+	return data;
+err:
+	free(data);
+	close(fd);
+	return NULL;
+}
+
+static uint64_t time_input(const uint8_t *data, uint8_t *copy, size_t len)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (unsigned int i = 0; i < repetitions; ++i) {
+		uint64_t start, elapsed;
+
+		/* Harnesses may scribble on their input, so hand them a fresh copy each time. */
+		memcpy(copy, data, len);
+		start = now_ns();
+		LLVMFuzzerTestOneInput(copy, len);
+		elapsed = now_ns() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static int run_one(struct samples *samples, const char *path)
+{
+	uint64_t ns, half_ns = 0;
+	struct sample *sample;
+	uint8_t *data, *copy;
+	size_t len;
+
+	data = read_file(path, &len);
+	if (!data) {
+		fprintf(report, "Unable to read `%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	copy = malloc(len + 1);
+	if (!copy) {
+		free(data);
+		return -1;
+	}
+	ns = time_input(data, copy, len);
+	if (ns > min_ns && len >= 2)
+		half_ns = time_input(data, copy, len / 2);
+	free(copy);
+	free(data);
+
+	if (samples->len == samples->cap) {
+		size_t new_cap = samples->cap ? samples->cap * 2 : 256;
+		struct sample *new_items = realloc(samples->items, new_cap * sizeof(*new_items));
+
+		if (!new_items)
+			return -1;
+		samples->items = new_items;
+		samples->cap = new_cap;
+	}
+	sample = &samples->items[samples->len];
+	sample->path = strdup(path);
+	if (!sample->path)
+		return -1;
+	sample->len = len;
+	sample->ns = ns;
+	sample->half_ns = half_ns;
+	++samples->len;
+	return 0;
+}
+
+static int run_path(struct samples *samples, const char *path)
+{
+	struct dirent **entries;
+	struct stat sbuf;
+	int count, ret = 0;
+
+	if (stat(path, &sbuf) < 0) {
+		fprintf(report, "Unable to stat `%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(sbuf.st_mode))
+		return run_one(samples, path);
+
+	/* Sorting keeps the run order, and therefore any warm-up effects, reproducible. */
+	count = scandir(path, &entries, NULL, alphasort);
+	if (count < 0) {
+		fprintf(report, "Unable to list `%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < count; ++i) {
+		char *child;
+
+		if (!ret && entries[i]->d_name[0] != '.') {
+			if (asprintf(&child, "%s/%s", path, entries[i]->d_name) < 0)
+				ret = -1;
+			else {
+				ret = run_path(samples, child);
+				free(child);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	return ret;
+}
+
+static int time_cmp(const void *first, const void *second)
+{
+	uint64_t a = ((const struct sample *)first)->ns, b = ((const struct sample *)second)->ns;
+
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-r <repetitions>] [-g <growth limit>] [-m <min ms>] [-M <max ms>] [-v] <corpus file or directory>...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct samples samples = { 0 };
+	double total = 0;
+	size_t outliers = 0;
+	bool verbose = false;
+	int opt, null_fd;
+
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	if (!report) {
+		perror("fdopen");
+		return 1;
+	}
+	while ((opt = getopt(argc, argv, "r:g:m:M:vh")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'r':
+			repetitions = strtoul(optarg, NULL, 10) ?: 1;
+			break;
+		case 'g':
+			growth_limit = strtod(optarg, NULL);
+			break;
+		case 'm':
+			min_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		case 'M':
+			max_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!verbose && (null_fd = open("/dev/null", O_WRONLY)) >= 0) {
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+		close(null_fd);
+	}
+	for (int i = optind; i < argc; ++i) {
+		if (run_path(&samples, argv[i]) < 0)
+			return 1;
+	}
+	if (!samples.len) {
+		fprintf(report, "%s: empty corpus\n", argv[0]);
+		return 0;
+	}
+
+	qsort(samples.items, samples.len, sizeof(*samples.items), time_cmp);
+	for (size_t i = 0; i < samples.len; ++i) {
+		const struct sample *sample = &samples.items[i];
+		double growth = sample->half_ns ? (double)sample->ns / sample->half_ns : 0;
+
+		total += sample->ns;
+		if (sample->ns > max_ns || growth > growth_limit) {
+			fprintf(report, "  SLOW    %s: %zu bytes in %.3f ms, %.2fx the time of its first half\n",
+				sample->path, sample->len, sample->ns / 1e6, growth);
+			++outliers;
+		}
+	}
+	fprintf(report, "%s: %zu inputs in %.3f ms, slowest %s at %.3f ms, %zu outlier%s\n",
+		argv[0], samples.len, total / 1e6, samples.items[0].path, samples.items[0].ns / 1e6,
+		outliers, outliers == 1 ? "" : "s");
+	fflush(report);
+	for (size_t i = 0; i < samples.len; ++i)
+		free(samples.items[i].path);
+	free(samples.items);
+	return outliers ? 1 : 0;
+}
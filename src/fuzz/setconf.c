@@ -10,9 +10,12 @@
 #include "../curve25519.c"
 #define parse_allowedips parse_allowedips_ipc
 #include "../ipc.c"
+#include "../apply.c"
 #undef parse_allowedips
 #include "../encoding.c"
 #include "../config.c"
+#include "../format.c"
+#define resolve_set_device ipc_set_device
 static FILE *hacked_fopen(const char *pathname, const char *mode);
 #define fopen hacked_fopen
 #include "../setconf.c"
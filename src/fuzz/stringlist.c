@@ -7,6 +7,7 @@
 #include "../curve25519.c"
 #undef __linux__
 #include "../ipc.c"
+#include "../apply.c"
 #include "../encoding.c"
 
 #include <stdint.h>
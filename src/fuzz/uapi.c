@@ -11,6 +11,7 @@ static FILE *hacked_userspace_interface_file(const char *iface);
 #include "../curve25519.c"
 #undef __linux__
 #include "../ipc.c"
+#include "../apply.c"
 #include "../encoding.c"
 
 #include <stdint.h>
@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "containers.h"
+#include "encoding.h"
+#include "format.h"
+#include "ipc.h"
+#include "subcommands.h"
+
+static bool is_idle(const struct wgpeer *peer, time_t now, uint64_t idle, bool has_idle, bool never_handshaked)
+{
+	if (!peer->last_handshake_time.tv_sec && !peer->last_handshake_time.tv_nsec) {
+		/* Nothing can be received before a handshake, so traffic means the time is simply not reported. */
+		return never_handshaked && !peer->rx_bytes;
+	}
+	return has_idle && peer->last_handshake_time.tv_sec < now && (uint64_t)(now - peer->last_handshake_time.tv_sec) > idle;
+}
+
+static bool save_peers(const char *path, const struct wgdevice *device)
+{
+	FILE *f;
+	int fd;
+
+	/* Preshared keys go into the file, so nobody else may read it. */
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto err;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto err;
+	}
+	format_conf(f, device);
+	if (ferror(f) | fclose(f))
+		goto err;
+	return true;
+err:
+	fprintf(stderr, "Unable to save removed peers to `%s': %s\n", path, strerror(errno));
+	return false;
+}
+
+int gc_main(int argc, char *argv[])
+{
+	struct wgdevice *device = NULL, *removed = NULL;
+	struct wgpeer *peer, *next, **kept_tail, *last_removed = NULL;
+	bool has_idle = false, never_handshaked = false, dry_run = false, forwarding;
+	const char *save_path = NULL;
+	size_t total = 0, count = 0;
+	uint64_t idle = 0;
+	time_t now;
+	int i, ret = 1, got;
+
+	if (argc < 2)
+		goto usage;
+	for (i = 2; i < argc; ++i) {
+		if (!strcmp(argv[i], "--idle") && i + 1 < argc) {
+			if (!config_parse_duration(&idle, argv[++i]))
+				return 1;
+			has_idle = true;
+		} else if (!strcmp(argv[i], "--never-handshaked"))
+			never_handshaked = true;
+		else if (!strcmp(argv[i], "--dry-run"))
+			dry_run = true;
+		else if (!strcmp(argv[i], "--save") && i + 1 < argc)
+			save_path = argv[++i];
+		else
+			goto usage;
+	}
+	if (!has_idle && !never_handshaked)
+		goto usage;
+
+	ipc_session_begin();
+	/* A cached copy may predate a peer's latest handshake, and that peer would be removed as idle. */
+	forwarding = ipc_daemon_forwarding(false);
+	got = ipc_get_device(&device, argv[1]);
+	ipc_daemon_forwarding(forwarding);
+	if (got < 0) {
+		perror("Unable to access interface");
+		goto cleanup;
+	}
+	removed = calloc(1, sizeof(*removed));
+	if (!removed) {
+		perror("calloc");
+		goto cleanup;
+	}
+	memcpy(removed->name, device->name, sizeof(removed->name));
+
+	/* Selected peers are moved out of the dump, keeping their order, so that neither list is copied. */
+	now = time(NULL);
+	kept_tail = &device->first_peer;
+	for (peer = device->first_peer; peer; peer = next) {
+		next = peer->next_peer;
+		peer->next_peer = NULL;
+		++total;
+		if (!is_idle(peer, now, idle, has_idle, never_handshaked)) {
+			*kept_tail = peer;
+			kept_tail = &peer->next_peer;
+			continue;
+		}
+		if (last_removed)
+			last_removed->next_peer = peer;
+		else
+			removed->first_peer = peer;
+		last_removed = peer;
+		++count;
+	}
+	*kept_tail = NULL;
+
+	if (save_path && !save_peers(save_path, removed))
+		goto cleanup;
+
+	if (dry_run) {
+		char base64[WG_KEY_LEN_BASE64];
+
+		for_each_wgpeer(removed, peer) {
+			key_to_base64(base64, peer->public_key);
+			printf("%s\t%llu\n", base64, (unsigned long long)peer->last_handshake_time.tv_sec);
+		}
+		printf("Would remove %zu of %zu peers\n", count, total);
+		ret = 0;
+		goto cleanup;
+	}
+	if (!count) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	/* Only the public key is needed to remove a peer, and leaving out the rest packs many more into each message. */
+	for_each_wgpeer(removed, peer) {
+		struct wgallowedip *allowedip, *next_allowedip;
+
+		for (allowedip = peer->first_allowedip; allowedip; allowedip = next_allowedip) {
+			next_allowedip = allowedip->next_allowedip;
+			free(allowedip);
+		}
+		peer->first_allowedip = peer->last_allowedip = NULL;
+		memset(&peer->endpoint, 0, sizeof(peer->endpoint));
+		peer->flags = WGPEER_REMOVE_ME;
+	}
+	if (ipc_set_device(removed) != 0) {
+		perror("Unable to modify interface");
+		goto cleanup;
+	}
+	printf("Removed %zu of %zu peers\n", count, total);
+	ret = 0;
+
+cleanup:
+	ipc_session_end();
+	free_wgdevice(removed);
+	free_wgdevice(device);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: %s %s <interface> [--idle <duration>] [--never-handshaked] [--dry-run] [--save <file>]\n", PROG_NAME, argv[0]);
+	return 1;
+}
@@ -11,67 +11,12 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <fcntl.h>
-#ifdef __linux__
-#include <sys/syscall.h>
-#endif
-#ifdef __APPLE__
-#include <AvailabilityMacros.h>
-#ifndef MAC_OS_X_VERSION_10_12
-#define MAC_OS_X_VERSION_10_12 101200
-#endif
-#if MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_12
-#include <sys/random.h>
-#endif
-#endif
 
 #include "curve25519.h"
 #include "encoding.h"
+#include "random.h"
 #include "subcommands.h"
 
-#ifndef _WIN32
-static inline bool __attribute__((__warn_unused_result__)) get_random_bytes(uint8_t *out, size_t len)
-{
-	ssize_t ret = 0;
-	size_t i;
-	int fd;
-
-	if (len > 256) {
-		errno = EOVERFLOW;
-		return false;
-	}
-
-#if defined(__OpenBSD__) || (defined(__APPLE__) && MAC_OS_X_VERSION_MIN_REQUIRED >= MAC_OS_X_VERSION_10_12) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25)))
-	if (!getentropy(out, len))
-		return true;
-#endif
-
-#if defined(__NR_getrandom) && defined(__linux__)
-	if (syscall(__NR_getrandom, out, len, 0) == (ssize_t)len)
-		return true;
-#endif
-
-	fd = open("/dev/urandom", O_RDONLY);
-	if (fd < 0)
-		return false;
-	for (errno = 0, i = 0; i < len; i += ret, ret = 0) {
-		ret = read(fd, out + i, len - i);
-		if (ret <= 0) {
-			ret = errno ? -errno : -EIO;
-			break;
-		}
-	}
-	close(fd);
-	errno = -ret;
-	return i == len;
-}
-#else
-#include <ntsecapi.h>
-static inline bool __attribute__((__warn_unused_result__)) get_random_bytes(uint8_t *out, size_t len)
-{
-        return RtlGenRandom(out, len);
-}
-#endif
-
 int genkey_main(int argc, char *argv[])
 {
 	uint8_t key[WG_KEY_LEN];
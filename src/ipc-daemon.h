@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define IPC_SUPPORTS_DAEMON
+
+/* When `wg daemon' is running, gets and listings are answered from its cache,
+ * and sets, which are always applied directly, tell it to drop its copy, even
+ * when forwarding is off. Its socket is found by path, which does not change
+ * with the network namespace, so every request carries the caller's, and a
+ * daemon in another namespace refuses it with EXDEV. That, or a daemon that is
+ * slow to answer, sends the caller to the kernel or the userspace
+ * implementation directly instead. */
+static bool daemon_forwarding = true;
+
+static bool daemon_forwarding_enabled(void)
+{
+	const char *var = getenv("WG_DAEMON");
+
+	return daemon_forwarding && !(var && !strcmp(var, "never"));
+}
+
+#define DAEMON_TIMEOUT_SEC 2
+
+static FILE *daemon_file(const char *request, const char *value)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct timeval timeout = { .tv_sec = DAEMON_TIMEOUT_SEC };
+	char netns[64];
+	ssize_t netns_len;
+	FILE *f;
+	int fd;
+
+	if (strlen(IPC_DAEMON_PATH) >= sizeof(addr.sun_path))
+		return NULL;
+	strcpy(addr.sun_path, IPC_DAEMON_PATH);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return NULL;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0 ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	f = fdopen(fd, "r+");
+	if (!f) {
+		close(fd);
+		return NULL;
+	}
+	fprintf(f, "%s=%s\n", request, value);
+	/* Read as a link, net:[<inode>], which names the namespace as netns.c does. */
+	netns_len = readlink("/proc/self/ns/net", netns, sizeof(netns) - 1);
+	if (netns_len > 0)
+		fprintf(f, "netns=%.*s\n", (int)netns_len, netns);
+	fprintf(f, "\n");
+	if (fflush(f) || ferror(f)) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+static bool daemon_get_device(struct wgdevice **dev, const char *iface, int *ret)
+{
+	FILE *f;
+
+	if (!daemon_forwarding_enabled() || strchr(iface, '\n'))
+		return false;
+	f = daemon_file("get", iface);
+	if (!f)
+		return false;
+	*ret = userspace_read_device(f, dev, iface);
+	/* A read that timed out leaves an error on the stream, and the device unread, but perhaps some peers handed over. */
+	if (ferror(f) || *ret == -EXDEV) {
+		fclose(f);
+		sink_restart();
+		return false;
+	}
+	fclose(f);
+	errno = -*ret;
+	return true;
+}
+
+static bool daemon_get_wireguard_interfaces(struct string_list *list, int *ret)
+{
+	size_t line_buffer_len = 0, line_len;
+	char *line = NULL;
+	FILE *f;
+
+	if (!daemon_forwarding_enabled())
+		return false;
+	f = daemon_file("list", "1");
+	if (!f)
+		return false;
+
+	*ret = -EPROTO;
+	while (getline(&line, &line_buffer_len, f) > 0) {
+		line_len = strlen(line);
+		if (line_len == 1 && line[0] == '\n')
+			break;
+		if (line[line_len - 1] != '\n')
+			break;
+		line[--line_len] = '\0';
+		if (!strncmp(line, "interface=", 10)) {
+			if (string_list_add(list, line + 10) < 0) {
+				*ret = -ENOMEM;
+				break;
+			}
+		} else if (!strncmp(line, "errno=", 6))
+			*ret = -abs(atoi(line + 6));
+	}
+	free(line);
+	if (ferror(f) || *ret == -EXDEV) {
+		fclose(f);
+		free(list->buffer);
+		*list = (struct string_list){ 0 };
+		return false;
+	}
+	fclose(f);
+	return true;
+}
+
+static void daemon_invalidate(const char *iface)
+{
+	char buf[64];
+	FILE *f;
+
+	if (strchr(iface, '\n'))
+		return;
+	f = daemon_file("invalidate", iface);
+	if (!f)
+		return;
+	/* Wait for the acknowledgement, so that a following get cannot race ahead. */
+	while (fgets(buf, sizeof(buf), f) && strcmp(buf, "\n"));
+	fclose(f);
+}
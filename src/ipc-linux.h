@@ -13,6 +13,7 @@
 #include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <linux/genetlink.h>
 #include <linux/if_link.h>
 #include <linux/netlink.h>
@@ -24,9 +25,22 @@
 #include "netlink.h"
 
 #define IPC_SUPPORTS_KERNEL_INTERFACE
+#define IPC_SUPPORTS_SESSIONS
+#define IPC_SUPPORTS_LINK_STATS
+
+/* The system's <linux/wireguard.h> is preferred, and only has these since Linux 6.16. */
+#define WG_ALLOWEDIP_A_FLAGS (WGALLOWEDIP_A_CIDR_MASK + 1)
+#define WG_ALLOWEDIP_F_REMOVE_ME (1U << 0)
 
 #define SOCKET_BUFFER_SIZE (mnl_ideal_socket_buffer_size())
 
+/* While a session is open, the generic netlink socket, along with its buffer
+ * and resolved family id, is kept around for the next get or set. Sessions are
+ * per thread, since threads may each have entered another network namespace,
+ * and a socket stays in the one it was opened in. */
+static __thread unsigned int kernel_session_depth;
+static __thread struct mnlg_socket *kernel_session_nlg;
+
 struct interface {
 	const char *name;
 	bool is_wireguard;
@@ -139,20 +153,167 @@ cleanup:
 	return ret;
 }
 
+struct link {
+	struct interface interface;
+	struct wglinkstats *stats;
+	bool has_stats;
+};
+
+static int parse_link(const struct nlattr *attr, void *data)
+{
+	struct link *link = data;
+	struct rtnl_link_stats64 stats;
+
+	if (mnl_attr_get_type(attr) != IFLA_STATS64)
+		return parse_infomsg(attr, &link->interface);
+	if (mnl_attr_get_payload_len(attr) < sizeof(stats))
+		return MNL_CB_OK;
+	/* Attributes are only four byte aligned. */
+	memcpy(&stats, mnl_attr_get_payload(attr), sizeof(stats));
+	*link->stats = (struct wglinkstats){
+		.rx_packets = stats.rx_packets,
+		.tx_packets = stats.tx_packets,
+		.rx_bytes = stats.rx_bytes,
+		.tx_bytes = stats.tx_bytes,
+		.rx_errors = stats.rx_errors,
+		.tx_errors = stats.tx_errors,
+		.rx_dropped = stats.rx_dropped,
+		.tx_dropped = stats.tx_dropped
+	};
+	link->has_stats = true;
+	return MNL_CB_OK;
+}
+
+static int read_link_cb(const struct nlmsghdr *nlh, void *data)
+{
+	return mnl_attr_parse(nlh, sizeof(struct ifinfomsg), parse_link, data);
+}
+
+/* A single link is asked for by name, so the kernel's counters for the whole
+ * interface are read without going through its peers. Unless any_kind is set,
+ * as for the tunnel device of a userspace implementation, only a WireGuard
+ * interface will do. */
+static int kernel_get_link_stats(struct wglinkstats *stats, const char *iface, bool any_kind)
+{
+	struct link link = { .stats = stats };
+	struct mnl_socket *nl = NULL;
+	char *rtnl_buffer = NULL;
+	unsigned int portid, seq;
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifm;
+	ssize_t len;
+	int ret;
+
+	if (strlen(iface) >= IFNAMSIZ)
+		return -ENODEV;
+	ret = -ENOMEM;
+	rtnl_buffer = calloc(SOCKET_BUFFER_SIZE, 1);
+	if (!rtnl_buffer)
+		goto cleanup;
+	nl = mnl_socket_open(NETLINK_ROUTE);
+	if (!nl || mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+
+	seq = time(NULL);
+	portid = mnl_socket_get_portid(nl);
+	nlh = mnl_nlmsg_put_header(rtnl_buffer);
+	nlh->nlmsg_type = RTM_GETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_seq = seq;
+	ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = AF_UNSPEC;
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, iface);
+	if (mnl_socket_sendto(nl, rtnl_buffer, nlh->nlmsg_len) < 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+	if ((len = mnl_socket_recvfrom(nl, rtnl_buffer, SOCKET_BUFFER_SIZE)) < 0 ||
+	    mnl_cb_run(rtnl_buffer, len, seq, portid, read_link_cb, &link) < 0) {
+		ret = -errno;
+		goto cleanup;
+	}
+	ret = 0;
+	if (!link.interface.is_wireguard && !any_kind)
+		ret = -ENODEV;
+	else if (!link.has_stats)
+		ret = -EOPNOTSUPP;
+
+cleanup:
+	free(rtnl_buffer);
+	if (nl)
+		mnl_socket_close(nl);
+	return ret;
+}
+
+static struct mnlg_socket *kernel_socket_get(void)
+{
+	struct mnlg_socket *nlg = kernel_session_nlg;
+
+	if (nlg) {
+		kernel_session_nlg = NULL;
+		return nlg;
+	}
+	return mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+}
+
+static void kernel_socket_put(struct mnlg_socket *nlg, int ret)
+{
+	/* A failed operation may leave replies queued up, so never reuse its socket. */
+	if (kernel_session_depth && !ret && !kernel_session_nlg)
+		kernel_session_nlg = nlg;
+	else
+		mnlg_socket_close(nlg);
+}
+
+static void kernel_session_begin(void)
+{
+	++kernel_session_depth;
+}
+
+static void kernel_session_end(void)
+{
+	if (!kernel_session_depth || --kernel_session_depth)
+		return;
+	if (kernel_session_nlg)
+		mnlg_socket_close(kernel_session_nlg);
+	kernel_session_nlg = NULL;
+}
+
+/* WGALLOWEDIP_A_FLAGS is only understood by Linux 6.16 and later. Earlier kernels, like the
+ * out-of-tree module for those before 5.6, may ignore it rather than refuse it, and would add
+ * what was to be removed, so nothing older is trusted with removals. */
+static bool kernel_removes_allowedips(void)
+{
+	struct utsname uts;
+	unsigned int major, minor;
+
+	if (uname(&uts) < 0 || sscanf(uts.release, "%u.%u", &major, &minor) != 2)
+		return false;
+	return major > 6 || (major == 6 && minor >= 16);
+}
+
 static int kernel_set_device(struct wgdevice *dev)
 {
 	int ret = 0;
+	struct apply_schedule schedule;
+	size_t limit = SOCKET_BUFFER_SIZE, chunk_peers;
 	struct wgpeer *peer = NULL;
 	struct wgallowedip *allowedip = NULL;
 	struct nlattr *peers_nest, *peer_nest, *allowedips_nest, *allowedip_nest;
 	struct nlmsghdr *nlh;
 	struct mnlg_socket *nlg;
 
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	nlg = kernel_socket_get();
 	if (!nlg)
 		return -errno;
+	apply_schedule_init(&schedule, dev);
+	if (schedule.chunk_size && schedule.chunk_size < limit)
+		limit = schedule.chunk_size;
 
 again:
+	chunk_peers = 0;
 	nlh = mnlg_msg_prepare(nlg, WG_CMD_SET_DEVICE, NLM_F_REQUEST | NLM_F_ACK);
 	mnl_attr_put_strz(nlh, WGDEVICE_A_IFNAME, dev->name);
 
@@ -177,56 +338,60 @@ again:
 	for (peer = peer ? peer : dev->first_peer; peer; peer = peer->next_peer) {
 		uint32_t flags = 0;
 
-		peer_nest = mnl_attr_nest_start_check(nlh, SOCKET_BUFFER_SIZE, 0);
+		peer_nest = mnl_attr_nest_start_check(nlh, limit, 0);
 		if (!peer_nest)
 			goto toobig_peers;
-		if (!mnl_attr_put_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_PUBLIC_KEY, sizeof(peer->public_key), peer->public_key))
+		if (!mnl_attr_put_check(nlh, limit, WGPEER_A_PUBLIC_KEY, sizeof(peer->public_key), peer->public_key))
 			goto toobig_peers;
 		if (peer->flags & WGPEER_REMOVE_ME)
 			flags |= WGPEER_F_REMOVE_ME;
+		if (peer->flags & WGPEER_UPDATE_ONLY)
+			flags |= WGPEER_F_UPDATE_ONLY;
 		if (!allowedip) {
 			if (peer->flags & WGPEER_REPLACE_ALLOWEDIPS)
 				flags |= WGPEER_F_REPLACE_ALLOWEDIPS;
 			if (peer->flags & WGPEER_HAS_PRESHARED_KEY) {
-				if (!mnl_attr_put_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_PRESHARED_KEY, sizeof(peer->preshared_key), peer->preshared_key))
+				if (!mnl_attr_put_check(nlh, limit, WGPEER_A_PRESHARED_KEY, sizeof(peer->preshared_key), peer->preshared_key))
 					goto toobig_peers;
 			}
 			if (peer->endpoint.addr.sa_family == AF_INET) {
-				if (!mnl_attr_put_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr4), &peer->endpoint.addr4))
+				if (!mnl_attr_put_check(nlh, limit, WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr4), &peer->endpoint.addr4))
 					goto toobig_peers;
 			} else if (peer->endpoint.addr.sa_family == AF_INET6) {
-				if (!mnl_attr_put_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr6), &peer->endpoint.addr6))
+				if (!mnl_attr_put_check(nlh, limit, WGPEER_A_ENDPOINT, sizeof(peer->endpoint.addr6), &peer->endpoint.addr6))
 					goto toobig_peers;
 			}
 			if (peer->flags & WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL) {
-				if (!mnl_attr_put_u16_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL, peer->persistent_keepalive_interval))
+				if (!mnl_attr_put_u16_check(nlh, limit, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL, peer->persistent_keepalive_interval))
 					goto toobig_peers;
 			}
 		}
 		if (flags) {
-			if (!mnl_attr_put_u32_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_FLAGS, flags))
+			if (!mnl_attr_put_u32_check(nlh, limit, WGPEER_A_FLAGS, flags))
 				goto toobig_peers;
 		}
 		if (peer->first_allowedip) {
 			if (!allowedip)
 				allowedip = peer->first_allowedip;
-			allowedips_nest = mnl_attr_nest_start_check(nlh, SOCKET_BUFFER_SIZE, WGPEER_A_ALLOWEDIPS);
+			allowedips_nest = mnl_attr_nest_start_check(nlh, limit, WGPEER_A_ALLOWEDIPS);
 			if (!allowedips_nest)
 				goto toobig_allowedips;
 			for (; allowedip; allowedip = allowedip->next_allowedip) {
-				allowedip_nest = mnl_attr_nest_start_check(nlh, SOCKET_BUFFER_SIZE, 0);
+				allowedip_nest = mnl_attr_nest_start_check(nlh, limit, 0);
 				if (!allowedip_nest)
 					goto toobig_allowedips;
-				if (!mnl_attr_put_u16_check(nlh, SOCKET_BUFFER_SIZE, WGALLOWEDIP_A_FAMILY, allowedip->family))
+				if (!mnl_attr_put_u16_check(nlh, limit, WGALLOWEDIP_A_FAMILY, allowedip->family))
 					goto toobig_allowedips;
 				if (allowedip->family == AF_INET) {
-					if (!mnl_attr_put_check(nlh, SOCKET_BUFFER_SIZE, WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip4), &allowedip->ip4))
+					if (!mnl_attr_put_check(nlh, limit, WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip4), &allowedip->ip4))
 						goto toobig_allowedips;
 				} else if (allowedip->family == AF_INET6) {
-					if (!mnl_attr_put_check(nlh, SOCKET_BUFFER_SIZE, WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip6), &allowedip->ip6))
+					if (!mnl_attr_put_check(nlh, limit, WGALLOWEDIP_A_IPADDR, sizeof(allowedip->ip6), &allowedip->ip6))
 						goto toobig_allowedips;
 				}
-				if (!mnl_attr_put_u8_check(nlh, SOCKET_BUFFER_SIZE, WGALLOWEDIP_A_CIDR_MASK, allowedip->cidr))
+				if (!mnl_attr_put_u8_check(nlh, limit, WGALLOWEDIP_A_CIDR_MASK, allowedip->cidr))
+					goto toobig_allowedips;
+				if ((allowedip->flags & WGALLOWEDIP_REMOVE_ME) && !mnl_attr_put_u32_check(nlh, limit, WG_ALLOWEDIP_A_FLAGS, WG_ALLOWEDIP_F_REMOVE_ME))
 					goto toobig_allowedips;
 				mnl_attr_nest_end(nlh, allowedip_nest);
 				allowedip_nest = NULL;
@@ -237,6 +402,7 @@ again:
 
 		mnl_attr_nest_end(nlh, peer_nest);
 		peer_nest = NULL;
+		++chunk_peers;
 	}
 	mnl_attr_nest_end(nlh, peers_nest);
 	peers_nest = NULL;
@@ -248,6 +414,7 @@ toobig_allowedips:
 		mnl_attr_nest_end(nlh, allowedips_nest);
 	mnl_attr_nest_end(nlh, peer_nest);
 	mnl_attr_nest_end(nlh, peers_nest);
+	++chunk_peers;
 	goto send;
 toobig_peers:
 	if (peer_nest)
@@ -255,6 +422,7 @@ toobig_peers:
 	mnl_attr_nest_end(nlh, peers_nest);
 	goto send;
 send:
+	apply_chunk_start(&schedule);
 	if (mnlg_socket_send(nlg, nlh) < 0) {
 		ret = -errno;
 		goto out;
@@ -264,11 +432,12 @@ send:
 		ret = errno ? -errno : -EINVAL;
 		goto out;
 	}
+	apply_chunk_done(&schedule, dev->name, chunk_peers, nlh->nlmsg_len, peer != NULL);
 	if (peer)
 		goto again;
 
 out:
-	mnlg_socket_close(nlg);
+	kernel_socket_put(nlg, ret);
 	errno = -ret;
 	return ret;
 }
@@ -337,7 +506,7 @@ static int parse_peer(const struct nlattr *attr, void *data)
 		}
 		break;
 	case WGPEER_A_PRESHARED_KEY:
-		if (mnl_attr_get_payload_len(attr) == sizeof(peer->preshared_key)) {
+		if ((device_fields & IPC_FIELD_KEYS) && mnl_attr_get_payload_len(attr) == sizeof(peer->preshared_key)) {
 			memcpy(peer->preshared_key, mnl_attr_get_payload(attr), sizeof(peer->preshared_key));
 			if (!key_is_zero(peer->preshared_key))
 				peer->flags |= WGPEER_HAS_PRESHARED_KEY;
@@ -346,7 +515,7 @@ static int parse_peer(const struct nlattr *attr, void *data)
 	case WGPEER_A_ENDPOINT: {
 		struct sockaddr *addr;
 
-		if (mnl_attr_get_payload_len(attr) < sizeof(*addr))
+		if (!(device_fields & IPC_FIELD_ENDPOINTS) || mnl_attr_get_payload_len(attr) < sizeof(*addr))
 			break;
 		addr = mnl_attr_get_payload(attr);
 		if (addr->sa_family == AF_INET && mnl_attr_get_payload_len(attr) == sizeof(peer->endpoint.addr4))
@@ -356,32 +525,57 @@ static int parse_peer(const struct nlattr *attr, void *data)
 		break;
 	}
 	case WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL:
-		if (!mnl_attr_validate(attr, MNL_TYPE_U16))
+		if ((device_fields & IPC_FIELD_KEEPALIVES) && !mnl_attr_validate(attr, MNL_TYPE_U16))
 			peer->persistent_keepalive_interval = mnl_attr_get_u16(attr);
 		break;
 	case WGPEER_A_LAST_HANDSHAKE_TIME:
-		if (mnl_attr_get_payload_len(attr) == sizeof(peer->last_handshake_time))
+		if ((device_fields & IPC_FIELD_HANDSHAKES) && mnl_attr_get_payload_len(attr) == sizeof(peer->last_handshake_time))
 			memcpy(&peer->last_handshake_time, mnl_attr_get_payload(attr), sizeof(peer->last_handshake_time));
 		break;
 	case WGPEER_A_RX_BYTES:
-		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+		if ((device_fields & IPC_FIELD_TRANSFER) && !mnl_attr_validate(attr, MNL_TYPE_U64))
 			peer->rx_bytes = mnl_attr_get_u64(attr);
 		break;
 	case WGPEER_A_TX_BYTES:
-		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+		if ((device_fields & IPC_FIELD_TRANSFER) && !mnl_attr_validate(attr, MNL_TYPE_U64))
 			peer->tx_bytes = mnl_attr_get_u64(attr);
 		break;
 	case WGPEER_A_ALLOWEDIPS:
+		/* The bulk of a large dump, and so not even walked unless wanted. */
+		if (!allowedips_wanted(peer))
+			break;
 		return mnl_attr_parse_nested(attr, parse_allowedips, peer);
 	}
 
 	return MNL_CB_OK;
 }
 
+static void coalesce_peers(struct wgdevice *device)
+{
+	struct wgpeer *old_next_peer, *peer = device->first_peer;
+
+	while (peer && peer->next_peer) {
+		if (memcmp(peer->public_key, peer->next_peer->public_key, sizeof(peer->public_key))) {
+			peer = peer->next_peer;
+			continue;
+		}
+		if (!peer->first_allowedip) {
+			peer->first_allowedip = peer->next_peer->first_allowedip;
+			peer->last_allowedip = peer->next_peer->last_allowedip;
+		} else {
+			peer->last_allowedip->next_allowedip = peer->next_peer->first_allowedip;
+			peer->last_allowedip = peer->next_peer->last_allowedip;
+		}
+		old_next_peer = peer->next_peer;
+		peer->next_peer = old_next_peer->next_peer;
+		free(old_next_peer);
+	}
+}
+
 static int parse_peers(const struct nlattr *attr, void *data)
 {
 	struct wgdevice *device = data;
-	struct wgpeer *new_peer = calloc(1, sizeof(*new_peer));
+	struct wgpeer *new_peer = calloc(1, sizeof(*new_peer)), *last_peer = device->last_peer;
 	int ret;
 
 	if (!new_peer) {
@@ -399,6 +593,14 @@ static int parse_peers(const struct nlattr *attr, void *data)
 		return ret;
 	if (!(new_peer->flags & WGPEER_HAS_PUBLIC_KEY))
 		return MNL_CB_ERROR;
+	/* A peer's allowed IPs may go on in the next message, so the ones held are
+	 * only complete, and handed over, once a different peer begins. */
+	if (peer_sink && last_peer && memcmp(last_peer->public_key, new_peer->public_key, sizeof(new_peer->public_key))) {
+		last_peer->next_peer = NULL;
+		coalesce_peers(device);
+		sink_peers(device);
+		device->first_peer = device->last_peer = new_peer;
+	}
 	return MNL_CB_OK;
 }
 
@@ -420,13 +622,13 @@ static int parse_device(const struct nlattr *attr, void *data)
 		}
 		break;
 	case WGDEVICE_A_PRIVATE_KEY:
-		if (mnl_attr_get_payload_len(attr) == sizeof(device->private_key)) {
+		if ((device_fields & IPC_FIELD_KEYS) && mnl_attr_get_payload_len(attr) == sizeof(device->private_key)) {
 			memcpy(device->private_key, mnl_attr_get_payload(attr), sizeof(device->private_key));
 			device->flags |= WGDEVICE_HAS_PRIVATE_KEY;
 		}
 		break;
 	case WGDEVICE_A_PUBLIC_KEY:
-		if (mnl_attr_get_payload_len(attr) == sizeof(device->public_key)) {
+		if ((device_fields & IPC_FIELD_KEYS) && mnl_attr_get_payload_len(attr) == sizeof(device->public_key)) {
 			memcpy(device->public_key, mnl_attr_get_payload(attr), sizeof(device->public_key));
 			device->flags |= WGDEVICE_HAS_PUBLIC_KEY;
 		}
@@ -451,28 +653,6 @@ static int read_device_cb(const struct nlmsghdr *nlh, void *data)
 	return mnl_attr_parse(nlh, sizeof(struct genlmsghdr), parse_device, data);
 }
 
-static void coalesce_peers(struct wgdevice *device)
-{
-	struct wgpeer *old_next_peer, *peer = device->first_peer;
-
-	while (peer && peer->next_peer) {
-		if (memcmp(peer->public_key, peer->next_peer->public_key, sizeof(peer->public_key))) {
-			peer = peer->next_peer;
-			continue;
-		}
-		if (!peer->first_allowedip) {
-			peer->first_allowedip = peer->next_peer->first_allowedip;
-			peer->last_allowedip = peer->next_peer->last_allowedip;
-		} else {
-			peer->last_allowedip->next_allowedip = peer->next_peer->first_allowedip;
-			peer->last_allowedip = peer->next_peer->last_allowedip;
-		}
-		old_next_peer = peer->next_peer;
-		peer->next_peer = old_next_peer->next_peer;
-		free(old_next_peer);
-	}
-}
-
 static int kernel_get_device(struct wgdevice **device, const char *iface)
 {
 	int ret;
@@ -485,7 +665,7 @@ try_again:
 	if (!*device)
 		return -errno;
 
-	nlg = mnlg_socket_open(WG_GENL_NAME, WG_GENL_VERSION);
+	nlg = kernel_socket_get();
 	if (!nlg) {
 		free_wgdevice(*device);
 		*device = NULL;
@@ -507,11 +687,13 @@ try_again:
 
 out:
 	if (nlg)
-		mnlg_socket_close(nlg);
+		kernel_socket_put(nlg, ret);
 	if (ret) {
 		free_wgdevice(*device);
-		if (ret == -EINTR)
+		if (ret == -EINTR) {
+			sink_restart();
 			goto try_again;
+		}
 		*device = NULL;
 	}
 	errno = -ret;
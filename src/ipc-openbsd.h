@@ -248,6 +248,11 @@ static int kernel_set_device(struct wgdevice *dev)
 		if (peer->flags & WGPEER_REMOVE_ME)
 			wg_peer->p_flags |= WG_PEER_REMOVE;
 
+#ifdef WG_PEER_UPDATE
+		if (peer->flags & WGPEER_UPDATE_ONLY)
+			wg_peer->p_flags |= WG_PEER_UPDATE;
+#endif
+
 		aip_count = 0;
 		wg_aip = &wg_peer->p_aips[0];
 		for_each_wgallowedip(peer, aip) {
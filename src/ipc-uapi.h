@@ -9,6 +9,7 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,41 +25,93 @@
 #include "ipc-uapi-unix.h"
 #endif
 
+/* Counts what is written, so that sets can be cut into transactions of the chunk size. */
+static void __attribute__((format(printf, 3, 4))) userspace_printf(FILE *f, size_t *len, const char *fmt, ...)
+{
+	va_list args;
+	int ret;
+
+	va_start(args, fmt);
+	ret = vfprintf(f, fmt, args);
+	va_end(args);
+	if (ret > 0)
+		*len += ret;
+}
+
+static int userspace_finish_set(FILE *f)
+{
+	int ret;
+
+	fprintf(f, "\n");
+	fflush(f);
+	if (fscanf(f, "errno=%d\n\n", &ret) != 1)
+		ret = errno ? -errno : -EPROTO;
+	fclose(f);
+	return ret;
+}
+
 static int userspace_set_device(struct wgdevice *dev)
 {
 	char hex[WG_KEY_LEN_HEX], ip[INET6_ADDRSTRLEN], host[4096 + 1], service[512 + 1];
+	struct apply_schedule schedule;
 	struct wgpeer *peer;
 	struct wgallowedip *allowedip;
+	size_t len = 0, chunk_peers = 0;
 	FILE *f;
 	int ret;
 	socklen_t addr_len;
 
+	apply_schedule_init(&schedule, dev);
 	f = userspace_interface_file(dev->name);
 	if (!f)
 		return -errno;
-	fprintf(f, "set=1\n");
+	apply_chunk_start(&schedule);
+	userspace_printf(f, &len, "set=1\n");
 
 	if (dev->flags & WGDEVICE_HAS_PRIVATE_KEY) {
 		key_to_hex(hex, dev->private_key);
-		fprintf(f, "private_key=%s\n", hex);
+		userspace_printf(f, &len, "private_key=%s\n", hex);
 	}
 	if (dev->flags & WGDEVICE_HAS_LISTEN_PORT)
-		fprintf(f, "listen_port=%u\n", dev->listen_port);
+		userspace_printf(f, &len, "listen_port=%u\n", dev->listen_port);
 	if (dev->flags & WGDEVICE_HAS_FWMARK)
-		fprintf(f, "fwmark=%u\n", dev->fwmark);
+		userspace_printf(f, &len, "fwmark=%u\n", dev->fwmark);
 	if (dev->flags & WGDEVICE_REPLACE_PEERS)
-		fprintf(f, "replace_peers=true\n");
+		userspace_printf(f, &len, "replace_peers=true\n");
 
 	for_each_wgpeer(dev, peer) {
+		bool continued = false;
+
+		if (schedule.chunk_size && len >= schedule.chunk_size) {
+next_chunk:
+			ret = userspace_finish_set(f);
+			if (ret)
+				goto out;
+			apply_chunk_done(&schedule, dev->name, chunk_peers, len, true);
+			f = userspace_interface_file(dev->name);
+			if (!f) {
+				ret = -errno;
+				goto out;
+			}
+			apply_chunk_start(&schedule);
+			len = chunk_peers = 0;
+			userspace_printf(f, &len, "set=1\n");
+		}
 		key_to_hex(hex, peer->public_key);
-		fprintf(f, "public_key=%s\n", hex);
+		userspace_printf(f, &len, "public_key=%s\n", hex);
+		++chunk_peers;
+		if (peer->flags & WGPEER_UPDATE_ONLY)
+			userspace_printf(f, &len, "update_only=true\n");
 		if (peer->flags & WGPEER_REMOVE_ME) {
-			fprintf(f, "remove=true\n");
+			userspace_printf(f, &len, "remove=true\n");
 			continue;
 		}
+		/* A peer cut in two only has the rest of its allowed IPs in the next transaction. */
+		if (continued)
+			goto allowedips;
 		if (peer->flags & WGPEER_HAS_PRESHARED_KEY) {
 			key_to_hex(hex, peer->preshared_key);
-			fprintf(f, "preshared_key=%s\n", hex);
+			userspace_printf(f, &len, "preshared_key=%s\n", hex);
 		}
 		if (peer->endpoint.addr.sa_family == AF_INET || peer->endpoint.addr.sa_family == AF_INET6) {
 			addr_len = 0;
@@ -68,16 +121,22 @@ static int userspace_set_device(struct wgdevice *dev)
 				addr_len = sizeof(struct sockaddr_in6);
 			if (!getnameinfo(&peer->endpoint.addr, addr_len, host, sizeof(host), service, sizeof(service), NI_DGRAM | NI_NUMERICSERV | NI_NUMERICHOST)) {
 				if (peer->endpoint.addr.sa_family == AF_INET6 && strchr(host, ':'))
-					fprintf(f, "endpoint=[%s]:%s\n", host, service);
+					userspace_printf(f, &len, "endpoint=[%s]:%s\n", host, service);
 				else
-					fprintf(f, "endpoint=%s:%s\n", host, service);
+					userspace_printf(f, &len, "endpoint=%s:%s\n", host, service);
 			}
 		}
 		if (peer->flags & WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL)
-			fprintf(f, "persistent_keepalive_interval=%u\n", peer->persistent_keepalive_interval);
+			userspace_printf(f, &len, "persistent_keepalive_interval=%u\n", peer->persistent_keepalive_interval);
 		if (peer->flags & WGPEER_REPLACE_ALLOWEDIPS)
-			fprintf(f, "replace_allowed_ips=true\n");
-		for_each_wgallowedip(peer, allowedip) {
+			userspace_printf(f, &len, "replace_allowed_ips=true\n");
+		allowedip = peer->first_allowedip;
+allowedips:
+		for (; allowedip; allowedip = allowedip->next_allowedip) {
+			if (schedule.chunk_size && len >= schedule.chunk_size && allowedip != peer->first_allowedip) {
+				continued = true;
+				goto next_chunk;
+			}
 			if (allowedip->family == AF_INET) {
 				if (!inet_ntop(AF_INET, &allowedip->ip4, ip, INET6_ADDRSTRLEN))
 					continue;
@@ -86,15 +145,13 @@ static int userspace_set_device(struct wgdevice *dev)
 					continue;
 			} else
 				continue;
-			fprintf(f, "allowed_ip=%s/%d\n", ip, allowedip->cidr);
+			userspace_printf(f, &len, "allowed_ip=%s/%d\n", ip, allowedip->cidr);
 		}
 	}
-	fprintf(f, "\n");
-	fflush(f);
-
-	if (fscanf(f, "errno=%d\n\n", &ret) != 1)
-		ret = errno ? -errno : -EPROTO;
-	fclose(f);
+	ret = userspace_finish_set(f);
+	if (!ret)
+		apply_chunk_done(&schedule, dev->name, chunk_peers, len, false);
+out:
 	errno = -ret;
 	return ret;
 }
@@ -110,31 +167,20 @@ static int userspace_set_device(struct wgdevice *dev)
 	num; \
 })
 
-static int userspace_get_device(struct wgdevice **out, const char *iface)
+/* Parses the reply to get=1, up to and including its terminating blank line. */
+static int userspace_read_device(FILE *f, struct wgdevice **out, const char *iface)
 {
 	struct wgdevice *dev;
 	struct wgpeer *peer = NULL;
 	struct wgallowedip *allowedip = NULL;
 	size_t line_buffer_len = 0, line_len;
 	char *key = NULL, *value;
-	FILE *f;
 	int ret = -EPROTO;
 
 	*out = dev = calloc(1, sizeof(*dev));
 	if (!dev)
 		return -errno;
 
-	f = userspace_interface_file(iface);
-	if (!f) {
-		ret = -errno;
-		free(dev);
-		*out = NULL;
-		return ret;
-	}
-
-	fprintf(f, "get=1\n\n");
-	fflush(f);
-
 	strncpy(dev->name, iface, IFNAMSIZ - 1);
 	dev->name[IFNAMSIZ - 1] = '\0';
 
@@ -148,6 +194,9 @@ static int userspace_get_device(struct wgdevice **out, const char *iface)
 		*value++ = key[--line_len] = '\0';
 
 		if (!peer && !strcmp(key, "private_key")) {
+			/* Deriving the public key is the costliest part of a small device. */
+			if (!(device_fields & IPC_FIELD_KEYS))
+				continue;
 			if (!key_from_hex(dev->private_key, value))
 				break;
 			curve25519_generate_public(dev->public_key, dev->private_key);
@@ -159,8 +208,14 @@ static int userspace_get_device(struct wgdevice **out, const char *iface)
 			dev->fwmark = NUM(0xffffffffU);
 			dev->flags |= WGDEVICE_HAS_FWMARK;
 		} else if (!strcmp(key, "public_key")) {
-			struct wgpeer *new_peer = calloc(1, sizeof(*new_peer));
+			struct wgpeer *new_peer;
 
+			/* The peer before is complete once another begins, and the only one held. */
+			if (peer && peer_sink) {
+				sink_peers(dev);
+				peer = NULL;
+			}
+			new_peer = calloc(1, sizeof(*new_peer));
 			if (!new_peer) {
 				ret = -ENOMEM;
 				goto err;
@@ -174,12 +229,12 @@ static int userspace_get_device(struct wgdevice **out, const char *iface)
 			if (!key_from_hex(peer->public_key, value))
 				break;
 			peer->flags |= WGPEER_HAS_PUBLIC_KEY;
-		} else if (peer && !strcmp(key, "preshared_key")) {
+		} else if (peer && (device_fields & IPC_FIELD_KEYS) && !strcmp(key, "preshared_key")) {
 			if (!key_from_hex(peer->preshared_key, value))
 				break;
 			if (!key_is_zero(peer->preshared_key))
 				peer->flags |= WGPEER_HAS_PRESHARED_KEY;
-		} else if (peer && !strcmp(key, "endpoint")) {
+		} else if (peer && (device_fields & IPC_FIELD_ENDPOINTS) && !strcmp(key, "endpoint")) {
 			char *begin, *end;
 			struct addrinfo *resolved;
 			struct addrinfo hints = {
@@ -216,10 +271,10 @@ static int userspace_get_device(struct wgdevice **out, const char *iface)
 				break;
 			}
 			freeaddrinfo(resolved);
-		} else if (peer && !strcmp(key, "persistent_keepalive_interval")) {
+		} else if (peer && (device_fields & IPC_FIELD_KEEPALIVES) && !strcmp(key, "persistent_keepalive_interval")) {
 			peer->persistent_keepalive_interval = NUM(0xffffU);
 			peer->flags |= WGPEER_HAS_PERSISTENT_KEEPALIVE_INTERVAL;
-		} else if (peer && !strcmp(key, "allowed_ip")) {
+		} else if (peer && allowedips_wanted(peer) && !strcmp(key, "allowed_ip")) {
 			struct wgallowedip *new_allowedip;
 			char *end, *mask = value, *ip = strsep(&mask, "/");
 
@@ -246,13 +301,13 @@ static int userspace_get_device(struct wgdevice **out, const char *iface)
 			allowedip->cidr = strtoul(mask, &end, 10);
 			if (*end || allowedip->family == AF_UNSPEC || (allowedip->family == AF_INET6 && allowedip->cidr > 128) || (allowedip->family == AF_INET && allowedip->cidr > 32))
 				break;
-		} else if (peer && !strcmp(key, "last_handshake_time_sec"))
+		} else if (peer && (device_fields & IPC_FIELD_HANDSHAKES) && !strcmp(key, "last_handshake_time_sec"))
 			peer->last_handshake_time.tv_sec = NUM(0x7fffffffffffffffULL);
-		else if (peer && !strcmp(key, "last_handshake_time_nsec"))
+		else if (peer && (device_fields & IPC_FIELD_HANDSHAKES) && !strcmp(key, "last_handshake_time_nsec"))
 			peer->last_handshake_time.tv_nsec = NUM(0x7fffffffffffffffULL);
-		else if (peer && !strcmp(key, "rx_bytes"))
+		else if (peer && (device_fields & IPC_FIELD_TRANSFER) && !strcmp(key, "rx_bytes"))
 			peer->rx_bytes = NUM(0xffffffffffffffffULL);
-		else if (peer && !strcmp(key, "tx_bytes"))
+		else if (peer && (device_fields & IPC_FIELD_TRANSFER) && !strcmp(key, "tx_bytes"))
 			peer->tx_bytes = NUM(0xffffffffffffffffULL);
 		else if (!strcmp(key, "errno"))
 			ret = -NUM(0x7fffffffU);
@@ -264,9 +319,27 @@ err:
 		free_wgdevice(dev);
 		*out = NULL;
 	}
-	fclose(f);
 	errno = -ret;
 	return ret;
+}
+
+static int userspace_get_device(struct wgdevice **out, const char *iface)
+{
+	FILE *f;
+	int ret;
+
+	f = userspace_interface_file(iface);
+	if (!f) {
+		*out = NULL;
+		return -errno;
+	}
+
+	fprintf(f, "get=1\n\n");
+	fflush(f);
 
+	ret = userspace_read_device(f, out, iface);
+	fclose(f);
+	errno = -ret;
+	return ret;
 }
 #undef NUM
@@ -3,9 +3,11 @@
  * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include "apply.h"
 #include "containers.h"
 
 struct string_list {
@@ -39,7 +41,60 @@ static int string_list_add(struct string_list *list, const char *str)
 	return 0;
 }
 
+#include "ipc.h"
+
+/* Fields left out are skipped by the decoders without allocating anything, and left zeroed. */
+static unsigned int device_fields = IPC_FIELD_ALL;
+/* When set, only the allowed IPs of these peers, sorted by public key, are decoded. */
+static struct wgpeer *const *allowedips_peers;
+static size_t allowedips_peers_len;
+
+static int peer_key_find(const void *key, const void *peer)
+{
+	return memcmp(key, (*(struct wgpeer *const *)peer)->public_key, WG_KEY_LEN);
+}
+
+static bool allowedips_wanted(const struct wgpeer *peer)
+{
+	if (!(device_fields & IPC_FIELD_ALLOWEDIPS))
+		return false;
+	return !allowedips_peers || bsearch(peer->public_key, allowedips_peers, allowedips_peers_len, sizeof(*allowedips_peers), peer_key_find);
+}
+
+/* When set, each peer is handed over as soon as the decoders have all of it, and freed. */
+static __thread ipc_peer_fn peer_sink;
+static __thread void *peer_sink_ctx;
+
+static void sink_restart(void)
+{
+	if (peer_sink)
+		peer_sink(NULL, peer_sink_ctx);
+}
+
+/* Hands over every peer dev holds, leaving it with none. */
+static void sink_peers(struct wgdevice *dev)
+{
+	struct wgpeer *peer, *next_peer;
+	struct wgallowedip *allowedip, *next_allowedip;
+
+	for (peer = dev->first_peer; peer; peer = next_peer) {
+		next_peer = peer->next_peer;
+		peer->next_peer = NULL;
+		peer_sink(peer, peer_sink_ctx);
+		for (allowedip = peer->first_allowedip; allowedip; allowedip = next_allowedip) {
+			next_allowedip = allowedip->next_allowedip;
+			free(allowedip);
+		}
+		free(peer->deferred_endpoint);
+		free(peer);
+	}
+	dev->first_peer = dev->last_peer = NULL;
+}
+
 #include "ipc-uapi.h"
+#ifndef _WIN32
+#include "ipc-daemon.h"
+#endif
 #if defined(__linux__)
 #include "ipc-linux.h"
 #elif defined(__OpenBSD__)
@@ -48,15 +103,26 @@ static int string_list_add(struct string_list *list, const char *str)
 #include "ipc-freebsd.h"
 #endif
 
+#ifdef IPC_SUPPORTS_KERNEL_INTERFACE
+/* Userspace interfaces are found by their sockets in the filesystem, which look
+ * the same from every network namespace, so a thread that has entered another
+ * one hides them, lest they be listed once per namespace. */
+static __thread bool userspace_hidden;
+#endif
+
 /* first\0second\0third\0forth\0last\0\0 */
 char *ipc_list_devices(void)
 {
 	struct string_list list = { 0 };
 	int ret;
 
+#ifdef IPC_SUPPORTS_DAEMON
+	if (daemon_get_wireguard_interfaces(&list, &ret))
+		goto cleanup;
+#endif
 #ifdef IPC_SUPPORTS_KERNEL_INTERFACE
 	ret = kernel_get_wireguard_interfaces(&list);
-	if (ret < 0)
+	if (ret < 0 || userspace_hidden)
 		goto cleanup;
 #endif
 	ret = userspace_get_wireguard_interfaces(&list);
@@ -73,23 +139,151 @@ cleanup:
 }
 
 int ipc_get_device(struct wgdevice **dev, const char *iface)
+{
+	int ret;
+
+	sink_restart();
+#ifdef IPC_SUPPORTS_DAEMON
+	if (daemon_get_device(dev, iface, &ret))
+		goto out;
+#endif
+#ifdef IPC_SUPPORTS_KERNEL_INTERFACE
+	if (!userspace_hidden && userspace_has_wireguard_interface(iface))
+		ret = userspace_get_device(dev, iface);
+	else
+		ret = kernel_get_device(dev, iface);
+#else
+	ret = userspace_get_device(dev, iface);
+#endif
+#ifdef IPC_SUPPORTS_DAEMON
+out:
+#endif
+	/* Whatever the implementation could not hand over as it went is handed over now. */
+	if (!ret && peer_sink)
+		sink_peers(*dev);
+	errno = -ret;
+	return ret;
+}
+
+int ipc_get_link_stats(struct wglinkstats *stats, const char *iface)
+{
+	int ret;
+
+#ifdef IPC_SUPPORTS_LINK_STATS
+	ret = kernel_get_link_stats(stats, iface, !userspace_hidden && userspace_has_wireguard_interface(iface));
+#else
+	(void)stats;
+	(void)iface;
+	ret = -EOPNOTSUPP;
+#endif
+	errno = -ret;
+	return ret;
+}
+
+void ipc_session_begin(void)
+{
+#ifdef IPC_SUPPORTS_SESSIONS
+	kernel_session_begin();
+#endif
+}
+
+void ipc_session_end(void)
+{
+#ifdef IPC_SUPPORTS_SESSIONS
+	kernel_session_end();
+#endif
+}
+
+bool ipc_daemon_forwarding(bool enable)
+{
+#ifdef IPC_SUPPORTS_DAEMON
+	bool was_enabled = daemon_forwarding;
+
+	daemon_forwarding = enable;
+	return was_enabled;
+#else
+	(void)enable;
+	return false;
+#endif
+}
+
+bool ipc_userspace_interfaces(bool enable)
 {
 #ifdef IPC_SUPPORTS_KERNEL_INTERFACE
-	if (userspace_has_wireguard_interface(iface))
-		return userspace_get_device(dev, iface);
-	return kernel_get_device(dev, iface);
+	bool was_enabled = !userspace_hidden;
+
+	userspace_hidden = !enable;
+	return was_enabled;
 #else
-	return userspace_get_device(dev, iface);
+	(void)enable;
+	return true;
 #endif
 }
 
+unsigned int ipc_device_fields(unsigned int fields)
+{
+	unsigned int was = device_fields;
+
+	device_fields = fields & IPC_FIELD_ALL;
+	return was;
+}
+
+void ipc_device_peer_sink(ipc_peer_fn fn, void *ctx)
+{
+	peer_sink = fn;
+	peer_sink_ctx = ctx;
+}
+
+void ipc_device_allowedips_peers(struct wgpeer *const *peers, size_t len)
+{
+	allowedips_peers = peers;
+	allowedips_peers_len = len;
+}
+
+#ifndef _WIN32
+/* The peers `wg complete' has cached are dropped whenever they may have changed, like the daemon's copy. */
+static void complete_invalidate(const char *iface)
+{
+	char path[sizeof(IPC_COMPLETE_PATH) + 64];
+
+	if (!strchr(iface, '/') && (size_t)snprintf(path, sizeof(path), IPC_COMPLETE_PATH "%s.peers", iface) < sizeof(path))
+		unlink(path);
+}
+#endif
+
 int ipc_set_device(struct wgdevice *dev)
 {
+	bool resolve = true;
+	int ret;
+
+#ifdef IPC_SUPPORTS_KERNEL_INTERFACE
+	bool kernel = userspace_hidden || !userspace_has_wireguard_interface(dev->name);
+
+	resolve = !kernel || !kernel_removes_allowedips();
+#endif
+	if (resolve) {
+		ret = apply_resolve_removals(dev);
+		if (ret < 0) {
+			errno = -ret;
+			return ret;
+		}
+	}
+	apply_order(dev);
 #ifdef IPC_SUPPORTS_KERNEL_INTERFACE
-	if (userspace_has_wireguard_interface(dev->name))
-		return userspace_set_device(dev);
-	return kernel_set_device(dev);
+	if (kernel)
+		ret = kernel_set_device(dev);
+	else
+		ret = userspace_set_device(dev);
 #else
-	return userspace_set_device(dev);
+	ret = userspace_set_device(dev);
+#endif
+#ifdef IPC_SUPPORTS_DAEMON
+	/* Even a failed set may have been partially applied. */
+	daemon_invalidate(dev->name);
 #endif
+#ifndef _WIN32
+	complete_invalidate(dev->name);
+#endif
+	errno = -ret;
+	return ret;
 }
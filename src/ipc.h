@@ -7,11 +7,42 @@
 #define IPC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct wgdevice;
+struct wgpeer;
+struct wglinkstats;
+
+typedef void (*ipc_peer_fn)(const struct wgpeer *peer, void *ctx);
+
+/* The parts of a device ipc_get_device decodes, besides its name, listen port, fwmark and peer public keys. */
+enum {
+	IPC_FIELD_KEYS = 1U << 0,
+	IPC_FIELD_ENDPOINTS = 1U << 1,
+	IPC_FIELD_ALLOWEDIPS = 1U << 2,
+	IPC_FIELD_HANDSHAKES = 1U << 3,
+	IPC_FIELD_TRANSFER = 1U << 4,
+	IPC_FIELD_KEEPALIVES = 1U << 5,
+	IPC_FIELD_ALL = (1U << 6) - 1
+};
 
 int ipc_set_device(struct wgdevice *dev);
 int ipc_get_device(struct wgdevice **dev, const char *interface);
+int ipc_get_link_stats(struct wglinkstats *stats, const char *interface);
 char *ipc_list_devices(void);
+void ipc_session_begin(void);
+void ipc_session_end(void);
+bool ipc_daemon_forwarding(bool enable);
+bool ipc_userspace_interfaces(bool enable);
+unsigned int ipc_device_fields(unsigned int fields);
+/* Until called with NULL, hands each peer ipc_get_device decodes in this thread to fn as soon as it is complete,
+ * and frees it, so that the device returned has no peers. fn is called with NULL at the start of each device, and
+ * whenever a dump is started over, to forget the peers handed over so far. */
+void ipc_device_peer_sink(ipc_peer_fn fn, void *ctx);
+/* Limits the allowed IPs ipc_get_device decodes to those of peers, sorted by public key, until called with NULL. */
+void ipc_device_allowedips_peers(struct wgpeer *const *peers, size_t len);
+
+#define IPC_DAEMON_PATH RUNSTATEDIR "/wireguard/daemon.ctl"
+#define IPC_COMPLETE_PATH RUNSTATEDIR "/wireguard/complete/"
 
 #endif
@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "curve25519.h"
+#include "encoding.h"
+#include "random.h"
+#include "subcommands.h"
+
+struct node {
+	char *name, *endpoint, *addresses;
+	uint16_t listen_port;
+	bool has_private_key;
+	uint8_t private_key[WG_KEY_LEN], public_key[WG_KEY_LEN];
+};
+
+struct mesh {
+	struct node *nodes;
+	size_t len;
+	const char *out;
+	/* Every node's [Peer] section, back to back, so that a node's file is everything but its own. */
+	char *peers;
+	size_t *offsets;
+};
+
+struct worker {
+	struct mesh *mesh;
+	size_t first, last;
+	bool (*job)(struct mesh *mesh, size_t i);
+	size_t failed;
+	int error;
+	pthread_t thread;
+	bool started;
+};
+
+static bool valid_name(const char *name)
+{
+	if (!*name || strlen(name) > NAME_MAX - 5)
+		return false;
+	for (; *name; ++name) {
+		if (!((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') || (*name >= '0' && *name <= '9') || *name == '-' || *name == '_' || *name == '.'))
+			return false;
+	}
+	return true;
+}
+
+/* Addresses are checked here, so that a typo fails once rather than in every generated file. A node's address may
+ * carry the prefix of the network it is on, but what other nodes route to it is the address alone, since a prefix
+ * shared by several nodes would otherwise be claimed by each in turn, and end up with whichever came last. */
+static char *host_addresses(const char *addresses)
+{
+	char *copy = strdup(addresses), *hosts = NULL, *saveptr = NULL, *address, *slash;
+	uint8_t buf[sizeof(struct in6_addr)];
+	size_t len = 0, count = 1;
+	bool ok = copy != NULL;
+
+	for (const char *c = addresses; *c; ++c)
+		count += *c == ',';
+	if (ok) {
+		hosts = malloc(strlen(addresses) + count * strlen("/128") + 1);
+		ok = hosts != NULL;
+	}
+	for (address = ok ? strtok_r(copy, ",", &saveptr) : NULL; ok && address; address = strtok_r(NULL, ",", &saveptr)) {
+		unsigned long cidr;
+		char *end;
+		int family;
+
+		slash = strchr(address, '/');
+		if (slash)
+			*slash++ = '\0';
+		family = strchr(address, ':') ? AF_INET6 : AF_INET;
+		ok = inet_pton(family, address, buf) == 1;
+		if (ok && slash) {
+			cidr = strtoul(slash, &end, 10);
+			ok = *slash && !*end && cidr <= (family == AF_INET6 ? 128 : 32);
+		}
+		if (!ok)
+			errno = EINVAL;
+		else
+			len += sprintf(hosts + len, "%s%s/%u", len ? "," : "", address, family == AF_INET6 ? 128 : 32);
+	}
+	if (ok && !len) {
+		errno = EINVAL;
+		ok = false;
+	}
+	free(copy);
+	if (!ok) {
+		free(hosts);
+		return NULL;
+	}
+	return hosts;
+}
+
+static bool parse_node(struct node *node, char *line, const char *path, size_t line_number)
+{
+	char *fields[4], *saveptr = NULL, *port;
+	unsigned long listen_port;
+	size_t count;
+
+	line[strcspn(line, "#\r\n")] = '\0';
+	for (count = 0; count < 4; ++count) {
+		fields[count] = strtok_r(count ? NULL : line, " \t", &saveptr);
+		if (!fields[count])
+			break;
+	}
+	if (count == 0)
+		return true;
+	if (count != 4 || strtok_r(NULL, " \t", &saveptr)) {
+		fprintf(stderr, "%s:%zu: Expected `<name> <private key | -> <endpoint | -> <addresses>'\n", path, line_number);
+		return false;
+	}
+	if (!valid_name(fields[0])) {
+		fprintf(stderr, "%s:%zu: Node name may only contain letters, digits, `-', `_' and `.': `%s'\n", path, line_number, fields[0]);
+		return false;
+	}
+	if (strcmp(fields[1], "-")) {
+		if (!key_from_base64(node->private_key, fields[1])) {
+			fprintf(stderr, "%s:%zu: Private key is invalid\n", path, line_number);
+			return false;
+		}
+		node->has_private_key = true;
+	}
+	if (strcmp(fields[2], "-")) {
+		port = strrchr(fields[2], ':');
+		listen_port = port ? strtoul(port + 1, &port, 10) : 0;
+		if (!port || *port || !listen_port || listen_port > 65535) {
+			fprintf(stderr, "%s:%zu: Endpoint is not of the form `<host>:<port>': `%s'\n", path, line_number, fields[2]);
+			return false;
+		}
+		node->listen_port = listen_port;
+		node->endpoint = strdup(fields[2]);
+	}
+	node->addresses = host_addresses(fields[3]);
+	if (!node->addresses && errno == EINVAL) {
+		fprintf(stderr, "%s:%zu: Addresses are not a comma separated list of IPs with optional CIDRs: `%s'\n", path, line_number, fields[3]);
+		return false;
+	}
+	node->name = strdup(fields[0]);
+	if (!node->name || !node->addresses || (strcmp(fields[2], "-") && !node->endpoint)) {
+		perror("strdup");
+		return false;
+	}
+	return true;
+}
+
+static bool read_inventory(struct mesh *mesh, const char *path)
+{
+	char *line = NULL;
+	size_t line_len = 0, cap = 0, line_number = 0;
+	bool ok = true;
+	FILE *f;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		perror("fopen");
+		return false;
+	}
+	while (ok && getline(&line, &line_len, f) >= 0) {
+		++line_number;
+		if (mesh->len == cap) {
+			size_t new_cap = cap ? cap * 2 : 256;
+			struct node *new_nodes = realloc(mesh->nodes, new_cap * sizeof(*new_nodes));
+
+			if (!new_nodes) {
+				perror("realloc");
+				ok = false;
+				break;
+			}
+			mesh->nodes = new_nodes;
+			cap = new_cap;
+		}
+		memset(&mesh->nodes[mesh->len], 0, sizeof(mesh->nodes[mesh->len]));
+		ok = parse_node(&mesh->nodes[mesh->len], line, path, line_number);
+		if (ok && mesh->nodes[mesh->len].name)
+			++mesh->len;
+		else if (!ok) {
+			free(mesh->nodes[mesh->len].name);
+			free(mesh->nodes[mesh->len].endpoint);
+			free(mesh->nodes[mesh->len].addresses);
+		}
+	}
+	if (f != stdin)
+		fclose(f);
+	free(line);
+	return ok;
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t i = 0; i < len; i += ret) {
+		ret = write(fd, buf + i, len - i);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret <= 0)
+			return false;
+	}
+	return true;
+}
+
+static bool write_file(const char *dir, const char *name, const char *suffix, const char *parts[], const size_t lens[], size_t count)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, saved_errno;
+
+	if ((size_t)snprintf(path, sizeof(path), "%s/%s%s", dir, name, suffix) >= sizeof(path) ||
+	    (size_t)snprintf(tmp, sizeof(tmp), "%s/.%s%s.tmp", dir, name, suffix) >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	/* Each file holds a private key. */
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
+	for (size_t i = 0; i < count; ++i) {
+		if (!write_all(fd, parts[i], lens[i]))
+			goto err;
+	}
+	if (close(fd) < 0) {
+		fd = -1;
+		goto err;
+	}
+	if (rename(tmp, path) < 0) {
+		fd = -1;
+		goto err;
+	}
+	return true;
+err:
+	saved_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	errno = saved_errno;
+	return false;
+}
+
+/* Nodes given without a private key get one the first time, which later runs read back, so that regenerating keeps every node's identity. */
+static bool load_or_generate_keys(struct mesh *mesh)
+{
+	char path[PATH_MAX], base64[WG_KEY_LEN_BASE64 + 1];
+	uint8_t *entropy = NULL;
+	size_t missing = 0, used = 0;
+	bool ok = false;
+
+	for (size_t i = 0; i < mesh->len; ++i) {
+		struct node *node = &mesh->nodes[i];
+		FILE *f;
+
+		if (node->has_private_key)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s.key", mesh->out, node->name);
+		f = fopen(path, "r");
+		if (!f) {
+			if (errno != ENOENT) {
+				fprintf(stderr, "Unable to read `%s': %s\n", path, strerror(errno));
+				return false;
+			}
+			++missing;
+			continue;
+		}
+		node->has_private_key = fread(base64, 1, WG_KEY_LEN_BASE64, f) >= WG_KEY_LEN_BASE64 - 1;
+		fclose(f);
+		base64[WG_KEY_LEN_BASE64 - 1] = '\0';
+		if (!node->has_private_key || !key_from_base64(node->private_key, base64)) {
+			fprintf(stderr, "Private key in `%s' is invalid\n", path);
+			return false;
+		}
+	}
+	if (!missing)
+		return true;
+
+	entropy = malloc(missing * WG_KEY_LEN);
+	if (!entropy) {
+		perror("malloc");
+		return false;
+	}
+	if (!get_random_bytes(entropy, missing * WG_KEY_LEN)) {
+		perror("getrandom");
+		goto out;
+	}
+	for (size_t i = 0; i < mesh->len; ++i) {
+		struct node *node = &mesh->nodes[i];
+		const char *parts[] = { base64 };
+		size_t lens[] = { WG_KEY_LEN_BASE64 };
+
+		if (node->has_private_key)
+			continue;
+		memcpy(node->private_key, entropy + WG_KEY_LEN * used++, WG_KEY_LEN);
+		curve25519_clamp_secret(node->private_key);
+		node->has_private_key = true;
+		key_to_base64(base64, node->private_key);
+		base64[WG_KEY_LEN_BASE64 - 1] = '\n';
+		if (!write_file(mesh->out, node->name, ".key", parts, lens, 1)) {
+			fprintf(stderr, "Unable to write private key of `%s': %s\n", node->name, strerror(errno));
+			goto out;
+		}
+	}
+	ok = true;
+out:
+	free(entropy);
+	return ok;
+}
+
+static bool derive_public_key(struct mesh *mesh, size_t i)
+{
+	curve25519_generate_public(mesh->nodes[i].public_key, mesh->nodes[i].private_key);
+	return true;
+}
+
+static bool serialize_peers(struct mesh *mesh)
+{
+	char base64[WG_KEY_LEN_BASE64];
+	size_t cap = 0, len = 0;
+
+	mesh->offsets = calloc(mesh->len + 1, sizeof(*mesh->offsets));
+	if (!mesh->offsets)
+		return false;
+	for (size_t i = 0; i < mesh->len; ++i) {
+		struct node *node = &mesh->nodes[i];
+		size_t need = 128 + WG_KEY_LEN_BASE64 + strlen(node->addresses) + (node->endpoint ? strlen(node->endpoint) : 0);
+		int ret;
+
+		if (len + need > cap) {
+			size_t new_cap = cap ? cap * 2 : 65536;
+			char *new_peers;
+
+			while (new_cap < len + need)
+				new_cap *= 2;
+			new_peers = realloc(mesh->peers, new_cap);
+			if (!new_peers)
+				return false;
+			mesh->peers = new_peers;
+			cap = new_cap;
+		}
+		key_to_base64(base64, node->public_key);
+		ret = snprintf(mesh->peers + len, cap - len, "\n[Peer]\n# %s\nPublicKey = %s\nAllowedIPs = %s\n", node->name, base64, node->addresses);
+		len += ret;
+		if (node->endpoint)
+			len += snprintf(mesh->peers + len, cap - len, "Endpoint = %s\n", node->endpoint);
+		mesh->offsets[i + 1] = len;
+	}
+	return true;
+}
+
+static bool write_config(struct mesh *mesh, size_t i)
+{
+	const struct node *node = &mesh->nodes[i];
+	char header[128 + WG_KEY_LEN_BASE64], base64[WG_KEY_LEN_BASE64];
+	const char *parts[3];
+	size_t lens[3];
+	int len;
+
+	key_to_base64(base64, node->private_key);
+	len = snprintf(header, sizeof(header), "[Interface]\nPrivateKey = %s\n", base64);
+	if (node->listen_port)
+		len += snprintf(header + len, sizeof(header) - len, "ListenPort = %u\n", node->listen_port);
+	parts[0] = header;
+	lens[0] = len;
+	parts[1] = mesh->peers;
+	lens[1] = mesh->offsets[i];
+	parts[2] = mesh->peers + mesh->offsets[i + 1];
+	lens[2] = mesh->offsets[mesh->len] - mesh->offsets[i + 1];
+	return write_file(mesh->out, node->name, ".conf", parts, lens, 3);
+}
+
+static void *run_worker(void *ctx)
+{
+	struct worker *worker = ctx;
+
+	for (size_t i = worker->first; i < worker->last; ++i) {
+		if (!worker->job(worker->mesh, i)) {
+			worker->error = errno;
+			worker->failed = i;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Splits the nodes into contiguous ranges, one per thread, and returns the first failed node, or SIZE_MAX. */
+static size_t run_parallel(struct mesh *mesh, bool (*job)(struct mesh *mesh, size_t i), size_t threads, int *error)
+{
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	size_t failed = SIZE_MAX;
+
+	if (!workers) {
+		struct worker worker = { .mesh = mesh, .job = job, .failed = SIZE_MAX, .last = mesh->len };
+
+		run_worker(&worker);
+		*error = worker.error;
+		return worker.failed;
+	}
+	for (size_t t = 0; t < threads; ++t) {
+		workers[t] = (struct worker){
+			.mesh = mesh, .job = job, .failed = SIZE_MAX,
+			.first = mesh->len * t / threads, .last = mesh->len * (t + 1) / threads
+		};
+	}
+	/* The first range is run by this thread, and any range whose thread cannot be started is too. */
+	for (size_t t = 1; t < threads; ++t) {
+		workers[t].started = !pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+		if (!workers[t].started)
+			run_worker(&workers[t]);
+	}
+	run_worker(&workers[0]);
+	for (size_t t = 0; t < threads; ++t) {
+		if (workers[t].started)
+			pthread_join(workers[t].thread, NULL);
+		if (workers[t].failed < failed) {
+			failed = workers[t].failed;
+			*error = workers[t].error;
+		}
+	}
+	free(workers);
+	return failed;
+}
+
+int mesh_main(int argc, char *argv[])
+{
+	struct mesh mesh = { 0 };
+	const char *inventory = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t failed;
+	int i, error = 0, ret = 1;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--out") && i + 1 < argc)
+			mesh.out = argv[++i];
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			char *end;
+
+			threads = strtol(argv[++i], &end, 10);
+			if (*end || threads < 1 || threads > 1024) {
+				fprintf(stderr, "Thread count is not a number from 1 to 1024: `%s'\n", argv[i]);
+				return 1;
+			}
+		} else if (!inventory && (argv[i][0] != '-' || !strcmp(argv[i], "-")))
+			inventory = argv[i];
+		else
+			goto usage;
+	}
+	if (!inventory || !mesh.out)
+		goto usage;
+	if (threads < 1)
+		threads = 1;
+
+	if (!read_inventory(&mesh, inventory))
+		goto cleanup;
+	for (size_t a = 0; a < mesh.len; ++a) {
+		for (size_t b = a + 1; b < mesh.len; ++b) {
+			if (!strcmp(mesh.nodes[a].name, mesh.nodes[b].name)) {
+				fprintf(stderr, "Node name appears more than once: `%s'\n", mesh.nodes[a].name);
+				goto cleanup;
+			}
+		}
+	}
+	if ((size_t)threads > mesh.len)
+		threads = mesh.len ?: 1;
+
+	if (!load_or_generate_keys(&mesh))
+		goto cleanup;
+	run_parallel(&mesh, derive_public_key, threads, &error);
+	if (!serialize_peers(&mesh)) {
+		perror("Peer serialization");
+		goto cleanup;
+	}
+	failed = run_parallel(&mesh, write_config, threads, &error);
+	if (failed != SIZE_MAX) {
+		fprintf(stderr, "Unable to write configuration of `%s': %s\n", failed < mesh.len ? mesh.nodes[failed].name : "?", strerror(error));
+		goto cleanup;
+	}
+	ret = 0;
+
+cleanup:
+	for (size_t n = 0; n < mesh.len; ++n) {
+		free(mesh.nodes[n].name);
+		free(mesh.nodes[n].endpoint);
+		free(mesh.nodes[n].addresses);
+	}
+	free(mesh.nodes);
+	free(mesh.peers);
+	free(mesh.offsets);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: %s %s <inventory file> --out <directory> [--threads <count>]\n", PROG_NAME, argv[0]);
+	return 1;
+}
@@ -69,7 +69,8 @@ typedef int (*mnl_cb_t)(const struct nlmsghdr *nlh, void *data);
 
 static size_t mnl_ideal_socket_buffer_size(void)
 {
-	static size_t size = 0;
+	/* Per thread, as threads may each use their own socket. */
+	static __thread size_t size = 0;
 
 	if (size)
 		return size;
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "containers.h"
+#include "ipc.h"
+#include "netns.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct candidate {
+	char *name, *path;
+	dev_t dev;
+	ino_t ino;
+};
+
+struct collector {
+	struct netns *list;
+	size_t len, next;
+	const char *only_interface;
+	bool list_only;
+};
+
+static int candidate_add(struct candidate **candidates, size_t *len, size_t *cap, const char *name, const char *path)
+{
+	struct stat sbuf;
+
+	/* Processes come and go, and some are not ours to look into. */
+	if (stat(path, &sbuf) < 0)
+		return 0;
+	if (*len == *cap) {
+		size_t new_cap = *cap ? *cap * 2 : 64;
+		struct candidate *new_candidates = realloc(*candidates, new_cap * sizeof(*new_candidates));
+
+		if (!new_candidates)
+			return -errno;
+		*candidates = new_candidates;
+		*cap = new_cap;
+	}
+	(*candidates)[*len] = (struct candidate){ .dev = sbuf.st_dev, .ino = sbuf.st_ino };
+	if (name)
+		(*candidates)[*len].name = strdup(name);
+	else if (asprintf(&(*candidates)[*len].name, "net:[%llu]", (unsigned long long)sbuf.st_ino) < 0)
+		(*candidates)[*len].name = NULL;
+	(*candidates)[*len].path = strdup(path);
+	if (!(*candidates)[*len].name || !(*candidates)[*len].path) {
+		free((*candidates)[*len].name);
+		free((*candidates)[*len].path);
+		return -ENOMEM;
+	}
+	++*len;
+	return 0;
+}
+
+static bool is_named(const struct candidate *candidate)
+{
+	return strncmp(candidate->path, "/proc/", 6);
+}
+
+/* Groups each namespace's candidates with the named ones first, so that only the first of a run is kept. */
+static int candidate_identity_cmp(const void *first, const void *second)
+{
+	const struct candidate *a = first, *b = second;
+
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	if (is_named(a) != is_named(b))
+		return is_named(a) ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+static int netns_cmp(const void *first, const void *second)
+{
+	const struct netns *a = first, *b = second;
+	bool a_named = strncmp(a->path, "/proc/", 6), b_named = strncmp(b->path, "/proc/", 6);
+
+	if (a_named != b_named)
+		return a_named ? -1 : 1;
+	if (!a_named && strlen(a->name) != strlen(b->name))
+		return strlen(a->name) < strlen(b->name) ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+struct netns *netns_list(size_t *len)
+{
+	struct candidate *candidates = NULL;
+	struct netns *list = NULL;
+	size_t candidates_len = 0, cap = 0;
+	struct stat own;
+	struct dirent *ent;
+	char path[64 + sizeof(ent->d_name)];
+	DIR *dir;
+	int ret = 0;
+
+	if (stat("/proc/self/ns/net", &own) < 0)
+		return NULL;
+
+	/* Namespaces named by ip-netns(8) are bind mounts under /run/netns, and all others are held by some process. */
+	dir = opendir("/run/netns");
+	while (dir && (ent = readdir(dir)) && !ret) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/run/netns/%s", ent->d_name);
+		ret = candidate_add(&candidates, &candidates_len, &cap, ent->d_name, path);
+	}
+	if (dir)
+		closedir(dir);
+	dir = opendir("/proc");
+	while (dir && (ent = readdir(dir)) && !ret) {
+		if (ent->d_name[0] < '1' || ent->d_name[0] > '9' || strspn(ent->d_name, "0123456789") != strlen(ent->d_name))
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/ns/net", ent->d_name);
+		ret = candidate_add(&candidates, &candidates_len, &cap, NULL, path);
+	}
+	if (dir)
+		closedir(dir);
+	else
+		ret = -errno;
+	if (ret)
+		goto out;
+
+	list = calloc(candidates_len ?: 1, sizeof(*list));
+	if (!list) {
+		ret = -errno;
+		goto out;
+	}
+	qsort(candidates, candidates_len, sizeof(*candidates), candidate_identity_cmp);
+	*len = 0;
+	for (size_t i = 0; i < candidates_len; ++i) {
+		if (i && candidates[i].dev == candidates[i - 1].dev && candidates[i].ino == candidates[i - 1].ino)
+			continue;
+		list[*len].name = candidates[i].name;
+		list[*len].path = candidates[i].path;
+		list[*len].own = candidates[i].dev == own.st_dev && candidates[i].ino == own.st_ino;
+		candidates[i].name = candidates[i].path = NULL;
+		++*len;
+	}
+	qsort(list, *len, sizeof(*list), netns_cmp);
+
+out:
+	for (size_t i = 0; i < candidates_len; ++i) {
+		free(candidates[i].name);
+		free(candidates[i].path);
+	}
+	free(candidates);
+	errno = -ret;
+	return ret ? NULL : list;
+}
+
+int netns_enter(const char *path, bool *own)
+{
+	struct stat sbuf, own_sbuf;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (own) {
+		*own = !fstat(fd, &sbuf) && !stat("/proc/thread-self/ns/net", &own_sbuf) &&
+		       sbuf.st_dev == own_sbuf.st_dev && sbuf.st_ino == own_sbuf.st_ino;
+	}
+	if (setns(fd, CLONE_NEWNET) < 0)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static int collect_one(struct netns *netns, const char *only_interface, bool list_only)
+{
+	char *interfaces, *interface;
+	size_t count = 0, i = 0;
+	int ret = 0;
+
+	ipc_session_begin();
+	interfaces = ipc_list_devices();
+	if (!interfaces) {
+		ret = -errno;
+		goto out;
+	}
+	for (interface = interfaces; *interface; interface += strlen(interface) + 1) {
+		if (!only_interface || !strcmp(interface, only_interface))
+			++count;
+	}
+	netns->device_names = calloc(count ?: 1, sizeof(*netns->device_names));
+	netns->devices = calloc(count ?: 1, sizeof(*netns->devices));
+	netns->device_errors = calloc(count ?: 1, sizeof(*netns->device_errors));
+	if (!netns->device_names || !netns->devices || !netns->device_errors) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (interface = interfaces; *interface; interface += strlen(interface) + 1) {
+		if (only_interface && strcmp(interface, only_interface))
+			continue;
+		netns->device_names[i] = strdup(interface);
+		if (!netns->device_names[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (!list_only && ipc_get_device(&netns->devices[i], interface) < 0) {
+			netns->devices[i] = NULL;
+			netns->device_errors[i] = errno;
+		}
+		netns->devices_len = ++i;
+	}
+out:
+	ipc_session_end();
+	free(interfaces);
+	return ret;
+}
+
+static void *collect_worker(void *ctx)
+{
+	struct collector *collector = ctx;
+
+	/* Each thread enters one namespace after another, and since no one else ever runs on it, it is never moved back. */
+	ipc_userspace_interfaces(false);
+	for (;;) {
+		size_t i = __atomic_fetch_add(&collector->next, 1, __ATOMIC_RELAXED);
+		struct netns *netns;
+
+		if (i >= collector->len)
+			break;
+		netns = &collector->list[i];
+		if (netns->own)
+			continue;
+		netns->error = -netns_enter(netns->path, NULL);
+		if (!netns->error)
+			netns->error = -collect_one(netns, collector->only_interface, collector->list_only);
+	}
+	return NULL;
+}
+
+void netns_collect(struct netns *list, size_t len, const char *only_interface, bool list_only)
+{
+	struct collector collector = { .list = list, .len = len, .only_interface = only_interface, .list_only = list_only };
+	size_t threads = sysconf(_SC_NPROCESSORS_ONLN) * 2, started = 0;
+	pthread_t *ids;
+	bool forwarding;
+
+	/* The daemon only knows about its own namespace. */
+	forwarding = ipc_daemon_forwarding(false);
+	if (threads > 32)
+		threads = 32;
+	if (threads > len)
+		threads = len;
+	ids = calloc(threads ?: 1, sizeof(*ids));
+	for (size_t t = 0; ids && t < threads; ++t) {
+		if (pthread_create(&ids[started], NULL, collect_worker, &collector))
+			break;
+		++started;
+	}
+	/* Our own namespace needs no worker, and is the only one whose userspace interfaces are shown. */
+	for (size_t i = 0; i < len; ++i) {
+		if (list[i].own)
+			list[i].error = -collect_one(&list[i], only_interface, list_only);
+	}
+	/* Without any thread, a namespace cannot be entered without leaving our own for good. */
+	if (!started) {
+		for (size_t i = 0; i < len; ++i) {
+			if (!list[i].own)
+				list[i].error = EAGAIN;
+		}
+	}
+	for (size_t t = 0; t < started; ++t)
+		pthread_join(ids[t], NULL);
+	free(ids);
+	ipc_daemon_forwarding(forwarding);
+}
+#else
+struct netns *netns_list(size_t *len)
+{
+	(void)len;
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+int netns_enter(const char *path, bool *own)
+{
+	(void)path;
+	(void)own;
+	return -EOPNOTSUPP;
+}
+
+void netns_collect(struct netns *list, size_t len, const char *only_interface, bool list_only)
+{
+	(void)list;
+	(void)len;
+	(void)only_interface;
+	(void)list_only;
+}
+#endif
+
+void netns_free(struct netns *list, size_t len)
+{
+	if (!list)
+		return;
+	for (size_t i = 0; i < len; ++i) {
+		for (size_t j = 0; j < list[i].devices_len; ++j) {
+			free_wgdevice(list[i].devices[j]);
+			free(list[i].device_names[j]);
+		}
+		free(list[i].devices);
+		free(list[i].device_errors);
+		free(list[i].device_names);
+		free(list[i].name);
+		free(list[i].path);
+	}
+	free(list);
+}
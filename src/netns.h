@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef NETNS_H
+#define NETNS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct wgdevice;
+
+struct netns {
+	/* The name under /run/netns, or net:[<inode>] for one only found through a process. */
+	char *name;
+	char *path;
+	bool own;
+	/* Filled in by netns_collect: an error entering the namespace or listing its
+	 * interfaces, or else the devices, with an error for each one not gotten. */
+	int error;
+	struct wgdevice **devices;
+	int *device_errors;
+	char **device_names;
+	size_t devices_len;
+};
+
+struct netns *netns_list(size_t *len);
+void netns_collect(struct netns *list, size_t len, const char *only_interface, bool list_only);
+void netns_free(struct netns *list, size_t len);
+int netns_enter(const char *path, bool *own);
+
+#endif
@@ -0,0 +1,689 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "containers.h"
+#include "encoding.h"
+#include "format.h"
+#include "ipc.h"
+#include "resolve.h"
+#include "subcommands.h"
+
+/* With WG_ENDPOINT_RESOLUTION=background, the parser leaves the endpoints that
+ * are names unset, and sets go out at once, with the address a name last
+ * resolved to where one is known. A resolver process is left behind to set
+ * each endpoint once its name resolves, retrying with the same backoff as the
+ * parser would have. What is left to do, and how each name went, is kept in a
+ * state file per interface, which also names the resolver in charge: a set
+ * that changes the work starts a new resolver, and the old one exits when it
+ * sees it is no longer named. The files of each network namespace are kept
+ * apart, and, as with the cache of `wg complete', stamped with the namespace
+ * and the interface's index, so that work is never taken over by an interface
+ * of the same name elsewhere or created later. Sets and resolvers hold a lock while changing
+ * both the interface and the file, so that a late answer never overwrites an
+ * endpoint given explicitly in the meantime. */
+
+#define RESOLVE_PATH RUNSTATEDIR "/wireguard/resolve/"
+#define RESOLVE_BATCH 32
+#define RESOLVE_MAX_TIMEOUT_MS 20000
+
+enum entry_state {
+	ENTRY_PENDING,
+	ENTRY_RESOLVED,
+	ENTRY_FAILED
+};
+
+static const char *const entry_states[] = { "pending", "resolved", "failed" };
+
+struct entry {
+	uint8_t public_key[WG_KEY_LEN];
+	enum entry_state state;
+	unsigned int attempts;
+	int64_t next_attempt_ms;
+	char *endpoint, *address, *error;
+};
+
+struct state {
+	pid_t pid;
+	struct entry *entries;
+	size_t len, cap;
+};
+
+struct lookup {
+	uint8_t public_key[WG_KEY_LEN];
+	char *endpoint;
+	union {
+		struct sockaddr addr;
+		struct sockaddr_in addr4;
+		struct sockaddr_in6 addr6;
+	} address;
+	int ret, error;
+	pthread_t thread;
+	bool threaded;
+};
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The same sequence of delays as the parser's retries. */
+static int64_t backoff_ms(unsigned int attempts)
+{
+	int64_t timeout = 1000;
+
+	while (attempts-- > 1 && timeout < RESOLVE_MAX_TIMEOUT_MS)
+		timeout = timeout * 6 / 5 < RESOLVE_MAX_TIMEOUT_MS ? timeout * 6 / 5 : RESOLVE_MAX_TIMEOUT_MS;
+	return timeout;
+}
+
+struct stamp {
+	uint64_t netns;
+	unsigned int ifindex;
+};
+
+static uint64_t current_netns(void)
+{
+#ifdef __linux__
+	struct stat sbuf;
+
+	if (!stat("/proc/self/ns/net", &sbuf))
+		return sbuf.st_ino;
+#endif
+	return 0;
+}
+
+static struct stamp current_stamp(const char *interface)
+{
+	return (struct stamp){ .netns = current_netns(), .ifindex = if_nametoindex(interface) };
+}
+
+static bool state_dir(char path[static 4096])
+{
+	return (size_t)snprintf(path, 4096, RESOLVE_PATH "%" PRIu64 "/", current_netns()) < 4096;
+}
+
+static bool state_path(char path[static 4096], const char *interface, const char *suffix)
+{
+	if (strchr(interface, '/') || (size_t)snprintf(path, 4096, RESOLVE_PATH "%" PRIu64 "/%s%s", current_netns(), interface, suffix) >= 4096)
+		return false;
+	return true;
+}
+
+static int lock_state(const char *interface)
+{
+	char path[4096], dir[4096];
+	int fd;
+
+	if (!state_dir(dir) || !state_path(path, interface, ".lock")) {
+		errno = EINVAL;
+		return -1;
+	}
+	mkdir(RUNSTATEDIR "/wireguard", 0755);
+	/* What is in here gets applied to the interface, so only our own user may write it. */
+	mkdir(RESOLVE_PATH, 0700);
+	mkdir(dir, 0700);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	while (flock(fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static void free_state(struct state *state)
+{
+	for (size_t i = 0; i < state->len; ++i) {
+		free(state->entries[i].endpoint);
+		free(state->entries[i].address);
+		free(state->entries[i].error);
+	}
+	free(state->entries);
+	memset(state, 0, sizeof(*state));
+}
+
+static struct entry *add_entry(struct state *state)
+{
+	if (state->len == state->cap) {
+		size_t new_cap = state->cap ? state->cap * 2 : 16;
+		struct entry *new_entries = realloc(state->entries, new_cap * sizeof(*new_entries));
+
+		if (!new_entries)
+			return NULL;
+		state->entries = new_entries;
+		state->cap = new_cap;
+	}
+	memset(&state->entries[state->len], 0, sizeof(state->entries[state->len]));
+	return &state->entries[state->len++];
+}
+
+static void drop_entry(struct state *state, size_t i)
+{
+	free(state->entries[i].endpoint);
+	free(state->entries[i].address);
+	free(state->entries[i].error);
+	memmove(&state->entries[i], &state->entries[i + 1], (state->len - i - 1) * sizeof(*state->entries));
+	--state->len;
+}
+
+static struct entry *find_entry(struct state *state, const uint8_t public_key[static WG_KEY_LEN])
+{
+	for (size_t i = 0; i < state->len; ++i) {
+		if (!memcmp(state->entries[i].public_key, public_key, WG_KEY_LEN))
+			return &state->entries[i];
+	}
+	return NULL;
+}
+
+static void set_string(char **field, const char *value)
+{
+	free(*field);
+	*field = value ? strdup(value) : NULL;
+}
+
+/* A header of the resolver's pid and the stamp, then a line per peer, of its key, state, attempts,
+ * next attempt, address or -, endpoint, and then any error. Work stamped for another interface is none. */
+static bool load_state(const char *interface, struct state *state)
+{
+	struct stamp stamp = current_stamp(interface);
+	char path[4096], *line = NULL;
+	size_t line_len = 0;
+	bool ret = false;
+	unsigned long long netns;
+	unsigned int ifindex;
+	long long pid;
+	FILE *f;
+
+	memset(state, 0, sizeof(*state));
+	if (!state_path(path, interface, ".state"))
+		return false;
+	f = fopen(path, "r");
+	if (!f)
+		return errno == ENOENT;
+	if (getline(&line, &line_len, f) <= 0 || sscanf(line, "pid %lld %llu %u", &pid, &netns, &ifindex) != 3)
+		goto out;
+	if (netns != stamp.netns || ifindex != stamp.ifindex) {
+		ret = true;
+		goto out;
+	}
+	state->pid = pid;
+	while (getline(&line, &line_len, f) > 0) {
+		char *save = NULL, *key = strtok_r(line, " \n", &save), *status = strtok_r(NULL, " \n", &save);
+		char *attempts = strtok_r(NULL, " \n", &save), *next = strtok_r(NULL, " \n", &save);
+		char *address = strtok_r(NULL, " \n", &save), *endpoint = strtok_r(NULL, " \n", &save);
+		char *error = strtok_r(NULL, "\n", &save);
+		struct entry *entry;
+		unsigned int i;
+
+		if (!endpoint)
+			goto out;
+		entry = add_entry(state);
+		if (!entry || !key_from_base64(entry->public_key, key))
+			goto out;
+		for (i = 0; i < sizeof(entry_states) / sizeof(entry_states[0]) && strcmp(status, entry_states[i]); ++i);
+		if (i == sizeof(entry_states) / sizeof(entry_states[0]))
+			goto out;
+		entry->state = i;
+		entry->attempts = strtoul(attempts, NULL, 10);
+		entry->next_attempt_ms = strtoll(next, NULL, 10);
+		set_string(&entry->endpoint, endpoint);
+		if (strcmp(address, "-"))
+			set_string(&entry->address, address);
+		if (error)
+			set_string(&entry->error, error);
+	}
+	ret = true;
+out:
+	if (!ret)
+		free_state(state);
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static bool save_state(const char *interface, const struct state *state)
+{
+	char path[4096], tmp[4096 + 8], base64[WG_KEY_LEN_BASE64];
+	struct stamp stamp;
+	FILE *f;
+	int fd;
+
+	if (!state_path(path, interface, ".state"))
+		return false;
+	if (!state->len)
+		return !unlink(path) || errno == ENOENT;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return false;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		return false;
+	}
+	stamp = current_stamp(interface);
+	fprintf(f, "pid %lld %" PRIu64 " %u\n", (long long)state->pid, stamp.netns, stamp.ifindex);
+	for (size_t i = 0; i < state->len; ++i) {
+		const struct entry *entry = &state->entries[i];
+
+		key_to_base64(base64, entry->public_key);
+		fprintf(f, "%s %s %u %" PRId64 " %s %s%s%s\n", base64, entry_states[entry->state], entry->attempts, entry->next_attempt_ms,
+			entry->address ?: "-", entry->endpoint, entry->error ? " " : "", entry->error ?: "");
+	}
+	if (fclose(f) || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+static bool resolver_alive(pid_t pid)
+{
+	return pid > 0 && (!kill(pid, 0) || errno == EPERM);
+}
+
+static void *lookup_thread(void *ctx)
+{
+	struct lookup *lookup = ctx;
+
+	lookup->ret = config_lookup_endpoint(&lookup->address.addr, lookup->endpoint, false);
+	lookup->error = errno;
+	return NULL;
+}
+
+static const char *lookup_error(const struct lookup *lookup)
+{
+	if (lookup->ret == EAI_SYSTEM)
+		return strerror(lookup->error);
+	if (lookup->ret == EAI_FAMILY)
+		return "Neither IPv4 nor IPv6 address found";
+	return gai_strerror(lookup->ret);
+}
+
+/* Records the answers that are still wanted, and sets the endpoints of the ones that resolved. */
+static bool apply_lookups(const char *interface, struct state *state, struct lookup *lookups, size_t count, int retries)
+{
+	struct wgdevice *current = NULL, *update = calloc(1, sizeof(*update));
+	struct entry *applied[RESOLVE_BATCH];
+	size_t applied_len = 0;
+	struct wgpeer *peer;
+	int64_t now = now_ms();
+
+	if (!update)
+		return false;
+	if (ipc_get_device(&current, interface) < 0) {
+		/* The interface is gone, and what it had left to resolve with it. */
+		free(update);
+		return false;
+	}
+	strncpy(update->name, interface, IFNAMSIZ - 1);
+	for (size_t i = 0; i < count; ++i) {
+		struct lookup *lookup = &lookups[i];
+		struct entry *entry = find_entry(state, lookup->public_key);
+		char address[FORMAT_ENDPOINT_LEN];
+
+		if (!entry || entry->state != ENTRY_PENDING || strcmp(entry->endpoint, lookup->endpoint))
+			continue;
+		++entry->attempts;
+		set_string(&entry->error, NULL);
+		if (!lookup->ret) {
+			for_each_wgpeer(current, peer) {
+				if (!memcmp(peer->public_key, lookup->public_key, WG_KEY_LEN))
+					break;
+			}
+			/* A peer already gone is reported as such. One removed after the dump is left alone by WGPEER_UPDATE_ONLY. */
+			if (!peer) {
+				entry->state = ENTRY_FAILED;
+				set_string(&entry->error, "Peer no longer exists");
+				continue;
+			}
+			peer = calloc(1, sizeof(*peer));
+			if (!peer) {
+				entry->next_attempt_ms = now + backoff_ms(entry->attempts);
+				set_string(&entry->error, strerror(ENOMEM));
+				continue;
+			}
+			peer->flags = WGPEER_HAS_PUBLIC_KEY | WGPEER_UPDATE_ONLY;
+			memcpy(peer->public_key, lookup->public_key, WG_KEY_LEN);
+			memcpy(&peer->endpoint, &lookup->address, sizeof(peer->endpoint));
+			if (update->last_peer)
+				update->last_peer->next_peer = peer;
+			else
+				update->first_peer = peer;
+			update->last_peer = peer;
+			if (format_endpoint(address, &lookup->address.addr))
+				set_string(&entry->address, address);
+			entry->state = ENTRY_RESOLVED;
+			applied[applied_len++] = entry;
+		} else if (config_dns_error_is_permanent(lookup->ret) || (retries >= 0 && entry->attempts > (unsigned int)retries)) {
+			entry->state = ENTRY_FAILED;
+			set_string(&entry->error, lookup_error(lookup));
+		} else {
+			entry->next_attempt_ms = now + backoff_ms(entry->attempts);
+			set_string(&entry->error, lookup_error(lookup));
+		}
+	}
+	if (update->first_peer && ipc_set_device(update) < 0) {
+		for (size_t i = 0; i < applied_len; ++i) {
+			applied[i]->state = ENTRY_PENDING;
+			applied[i]->next_attempt_ms = now + backoff_ms(applied[i]->attempts);
+			set_string(&applied[i]->error, strerror(errno));
+		}
+	}
+	free_wgdevice(update);
+	free_wgdevice(current);
+	return true;
+}
+
+static void *resolve_loop(void *ctx)
+{
+	const char *interface = ctx;
+	int retries = config_dns_retries();
+
+	/* Existence is all that is checked of peers, and it must be current. */
+	ipc_daemon_forwarding(false);
+	ipc_device_fields(0);
+	for (;;) {
+		struct lookup lookups[RESOLVE_BATCH] = { 0 };
+		struct state state;
+		int64_t now = now_ms(), wake = now + RESOLVE_MAX_TIMEOUT_MS;
+		size_t count = 0;
+		bool pending = false, ok;
+		int lock = lock_state(interface);
+
+		if (lock < 0)
+			break;
+		if (!load_state(interface, &state) || state.pid != getpid()) {
+			free_state(&state);
+			close(lock);
+			break;
+		}
+		for (size_t i = 0; i < state.len; ++i) {
+			struct entry *entry = &state.entries[i];
+
+			if (entry->state != ENTRY_PENDING)
+				continue;
+			pending = true;
+			if (entry->next_attempt_ms <= now && count < RESOLVE_BATCH) {
+				memcpy(lookups[count].public_key, entry->public_key, WG_KEY_LEN);
+				lookups[count].endpoint = strdup(entry->endpoint);
+				if (lookups[count].endpoint)
+					++count;
+			} else if (entry->next_attempt_ms < wake)
+				wake = entry->next_attempt_ms;
+		}
+		if (!pending) {
+			state.pid = 0;
+			save_state(interface, &state);
+		}
+		free_state(&state);
+		close(lock);
+		if (!pending)
+			break;
+
+		/* Names are looked up all at once, so that a dead one holds up none of the others. */
+		for (size_t i = 0; i < count; ++i)
+			lookups[i].threaded = !pthread_create(&lookups[i].thread, NULL, lookup_thread, &lookups[i]);
+		for (size_t i = 0; i < count; ++i) {
+			if (lookups[i].threaded)
+				pthread_join(lookups[i].thread, NULL);
+			else
+				lookup_thread(&lookups[i]);
+		}
+
+		ok = true;
+		if (count) {
+			lock = lock_state(interface);
+			if (lock < 0)
+				ok = false;
+			else if (!load_state(interface, &state) || state.pid != getpid())
+				ok = false;
+			else {
+				if (!apply_lookups(interface, &state, lookups, count, retries))
+					state.pid = 0;
+				save_state(interface, &state);
+				ok = state.pid == getpid();
+			}
+			free_state(&state);
+			if (lock >= 0)
+				close(lock);
+		}
+		for (size_t i = 0; i < count; ++i)
+			free(lookups[i].endpoint);
+		if (!ok)
+			break;
+		now = now_ms();
+		if (!count && wake > now)
+			usleep((wake - now) * 1000);
+	}
+	return NULL;
+}
+
+static pid_t start_resolver(const char *interface)
+{
+	pid_t pid, resolver = -1;
+	int fds[2], status;
+
+	if (pipe(fds) < 0)
+		return -1;
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (!pid) {
+		pthread_t thread;
+		int null;
+
+		/* The resolver is orphaned right away, so that nobody has to reap it. */
+		pid = fork();
+		if (pid)
+			_exit(pid > 0 && write(fds[1], &pid, sizeof(pid)) == sizeof(pid) ? 0 : 1);
+		setsid();
+		/* Nothing of the caller's is held on to, least of all a pipe someone waits to see closed, or the lock. */
+		null = open("/dev/null", O_RDWR);
+		if (null >= 0) {
+			dup2(null, 0);
+			dup2(null, 1);
+			dup2(null, 2);
+		}
+		for (long fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max && fd < 65536; ++fd)
+			close(fd);
+		/* On a thread of its own, the resolver starts without any netlink session the caller had open. */
+		if (!pthread_create(&thread, NULL, resolve_loop, (void *)interface))
+			pthread_join(thread, NULL);
+		_exit(0);
+	}
+	close(fds[1]);
+	if (read(fds[0], &resolver, sizeof(resolver)) != sizeof(resolver))
+		resolver = -1;
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return resolver;
+}
+
+/* Brings the work up to date with a set that has just gone out, returning whether it changed. */
+static bool merge_state(struct state *state, const struct wgdevice *device)
+{
+	struct wgpeer *peer;
+	bool changed = false;
+
+	for_each_wgpeer(device, peer) {
+		struct entry *entry = find_entry(state, peer->public_key);
+
+		if (peer->deferred_endpoint && !(peer->flags & WGPEER_REMOVE_ME)) {
+			if (!entry) {
+				entry = add_entry(state);
+				if (!entry)
+					continue;
+				memcpy(entry->public_key, peer->public_key, WG_KEY_LEN);
+			} else if (strcmp(entry->endpoint, peer->deferred_endpoint))
+				set_string(&entry->address, NULL);
+			set_string(&entry->endpoint, peer->deferred_endpoint);
+			set_string(&entry->error, NULL);
+			entry->state = ENTRY_PENDING;
+			entry->attempts = 0;
+			entry->next_attempt_ms = 0;
+			changed = true;
+		} else if (entry && (peer->flags & WGPEER_REMOVE_ME || peer->endpoint.addr.sa_family != AF_UNSPEC)) {
+			drop_entry(state, entry - state->entries);
+			changed = true;
+		}
+	}
+	if (!(device->flags & WGDEVICE_REPLACE_PEERS))
+		return changed;
+	for (size_t i = state->len; i-- > 0;) {
+		for_each_wgpeer(device, peer) {
+			if (peer->deferred_endpoint && !(peer->flags & WGPEER_REMOVE_ME) &&
+			    !memcmp(peer->public_key, state->entries[i].public_key, WG_KEY_LEN))
+				break;
+		}
+		if (!peer) {
+			drop_entry(state, i);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+int resolve_set_device(struct wgdevice *device)
+{
+	struct state state;
+	struct wgpeer *peer;
+	char path[4096];
+	bool deferred = false;
+	int lock, ret, saved_errno;
+
+	for_each_wgpeer(device, peer)
+		deferred |= peer->deferred_endpoint != NULL;
+	/* Most sets have no names to resolve, nor any resolver to tell about them. */
+	if (!deferred && (!state_path(path, device->name, ".state") || access(path, F_OK)))
+		return ipc_set_device(device);
+
+	lock = lock_state(device->name);
+	if (lock < 0)
+		return -errno;
+	/* A file that cannot be read is simply started over. */
+	load_state(device->name, &state);
+
+	for_each_wgpeer(device, peer) {
+		struct entry *entry = find_entry(&state, peer->public_key);
+
+		if (!peer->deferred_endpoint || !entry || !entry->address || strcmp(entry->endpoint, peer->deferred_endpoint))
+			continue;
+		if (config_lookup_endpoint(&peer->endpoint.addr, entry->address, true))
+			memset(&peer->endpoint, 0, sizeof(peer->endpoint));
+	}
+
+	ret = ipc_set_device(device);
+	saved_errno = errno;
+	if (!ret && (merge_state(&state, device) || !resolver_alive(state.pid))) {
+		bool pending = false;
+
+		for (size_t i = 0; i < state.len; ++i)
+			pending |= state.entries[i].state == ENTRY_PENDING;
+		state.pid = pending ? start_resolver(device->name) : 0;
+		if (pending && state.pid < 0) {
+			fprintf(stderr, "Unable to start resolving endpoints in the background: %s\n", strerror(errno));
+			state.pid = 0;
+		}
+		save_state(device->name, &state);
+	}
+	free_state(&state);
+	close(lock);
+	errno = saved_errno;
+	return ret;
+}
+
+static bool print_state(const char *interface, bool with_interface)
+{
+	char base64[WG_KEY_LEN_BASE64];
+	struct state state;
+	int64_t now = now_ms();
+	bool alive;
+
+	if (!load_state(interface, &state)) {
+		fprintf(stderr, "Unable to read endpoint resolution state of `%s'\n", interface);
+		return false;
+	}
+	alive = resolver_alive(state.pid);
+	for (size_t i = 0; i < state.len; ++i) {
+		const struct entry *entry = &state.entries[i];
+		bool pending = entry->state == ENTRY_PENDING;
+
+		if (with_interface)
+			printf("%s\t", interface);
+		key_to_base64(base64, entry->public_key);
+		printf("%s\t%s\t%s\t%s\t%u\t%" PRId64 "\t%s\n", base64, entry->endpoint,
+		       pending && !alive ? "abandoned" : entry_states[entry->state],
+		       entry->address ?: "(none)", entry->attempts,
+		       pending && entry->next_attempt_ms > now ? (entry->next_attempt_ms - now + 999) / 1000 : 0,
+		       entry->error ?: "(none)");
+	}
+	free_state(&state);
+	return true;
+}
+
+int resolve_status_main(int argc, char *argv[])
+{
+	char path[4096];
+	struct dirent *ent;
+	bool ok = true;
+	DIR *dir;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s %s { <interface> | all }\n", PROG_NAME, argv[0]);
+		return 1;
+	}
+	if (strcmp(argv[1], "all"))
+		return print_state(argv[1], false) ? 0 : 1;
+
+	/* Only this namespace's interfaces are listed, as by `wg show all'. */
+	dir = state_dir(path) ? opendir(path) : NULL;
+	if (!dir) {
+		if (errno == ENOENT)
+			return 0;
+		perror("Unable to list endpoint resolution state");
+		return 1;
+	}
+	while ((ent = readdir(dir))) {
+		size_t len = strlen(ent->d_name);
+
+		if (len <= 6 || len - 6 >= IFNAMSIZ || strcmp(ent->d_name + len - 6, ".state"))
+			continue;
+		ent->d_name[len - 6] = '\0';
+		ok &= print_state(ent->d_name, true);
+	}
+	closedir(dir);
+	return ok ? 0 : 1;
+}
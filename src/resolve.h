@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+struct wgdevice;
+
+int resolve_set_device(struct wgdevice *device);
+
+#endif
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "containers.h"
+#include "encoding.h"
+#include "ipc.h"
+#include "random.h"
+#include "subcommands.h"
+
+struct wanted_key {
+	uint8_t key[WG_KEY_LEN];
+	bool found;
+};
+
+static int wanted_key_cmp(const void *first, const void *second)
+{
+	return memcmp(first, second, WG_KEY_LEN);
+}
+
+/* One public key per line, as the first word, so that a previous output file may be given back. */
+static struct wanted_key *read_peers(const char *path, size_t *len)
+{
+	struct wanted_key *keys = NULL;
+	char *line = NULL, *word;
+	size_t line_len = 0, cap = 0, count = 0, line_number = 0, i;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror("fopen");
+		return NULL;
+	}
+	while (getline(&line, &line_len, f) >= 0) {
+		++line_number;
+		word = line + strspn(line, " \t");
+		word[strcspn(word, " \t\r\n#")] = '\0';
+		if (!*word)
+			continue;
+		if (count == cap) {
+			size_t new_cap = cap ? cap * 2 : 1024;
+			struct wanted_key *new_keys = realloc(keys, new_cap * sizeof(*new_keys));
+
+			if (!new_keys) {
+				perror("realloc");
+				goto err;
+			}
+			keys = new_keys;
+			cap = new_cap;
+		}
+		if (!key_from_base64(keys[count].key, word)) {
+			fprintf(stderr, "%s:%zu: Public key is invalid: `%s'\n", path, line_number, word);
+			goto err;
+		}
+		keys[count++].found = false;
+	}
+	if (ferror(f)) {
+		perror("getline");
+		goto err;
+	}
+	qsort(keys, count, sizeof(*keys), wanted_key_cmp);
+	for (i = 0, *len = 0; i < count; ++i) {
+		if (!*len || memcmp(keys[*len - 1].key, keys[i].key, WG_KEY_LEN))
+			keys[(*len)++] = keys[i];
+	}
+	fclose(f);
+	free(line);
+	return keys ?: calloc(1, sizeof(*keys));
+err:
+	fclose(f);
+	free(line);
+	free(keys);
+	return NULL;
+}
+
+static void sync_directory(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+static bool write_key_file(const char *path, const char *content, size_t len)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	ssize_t ret;
+
+	if (fd < 0)
+		return false;
+	for (size_t i = 0; i < len; i += ret) {
+		ret = write(fd, content + i, len - i);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret <= 0) {
+			close(fd);
+			return false;
+		}
+	}
+	return !close(fd);
+}
+
+/* A single file of `<public key> <preshared key>' lines, replaced as a whole once it is on disk. */
+static bool write_list(const char *path, const struct wgdevice *device)
+{
+	char public[WG_KEY_LEN_BASE64], preshared[WG_KEY_LEN_BASE64], *tmp, *dir, *slash;
+	const struct wgpeer *peer;
+	FILE *f;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		perror("asprintf");
+		return false;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto err;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		goto err_unlink;
+	}
+	for_each_wgpeer(device, peer) {
+		key_to_base64(public, peer->public_key);
+		key_to_base64(preshared, peer->preshared_key);
+		fprintf(f, "%s %s\n", public, preshared);
+	}
+	if (ferror(f) | fflush(f) | fsync(fd) | fclose(f))
+		goto err_unlink;
+	if (rename(tmp, path) < 0)
+		goto err_unlink;
+	free(tmp);
+
+	dir = strdup(path);
+	if (dir) {
+		slash = strrchr(dir, '/');
+		if (!slash)
+			sync_directory(".");
+		else if (slash == dir)
+			sync_directory("/");
+		else {
+			*slash = '\0';
+			sync_directory(dir);
+		}
+		free(dir);
+	}
+	return true;
+
+err_unlink:
+	unlink(tmp);
+err:
+	fprintf(stderr, "Unable to write preshared keys to `%s': %s\n", path, strerror(errno));
+	free(tmp);
+	return false;
+}
+
+static void file_name(char base64[static WG_KEY_LEN_BASE64], const struct wgpeer *peer)
+{
+	key_to_base64(base64, peer->public_key);
+	for (char *c = base64; *c; ++c) {
+		if (*c == '/')
+			*c = '_';
+		else if (*c == '+')
+			*c = '-';
+	}
+}
+
+/* One file per peer, named for its public key in the URL-safe alphabet, holding what `wg set' takes as a preshared key. */
+static bool write_directory(const char *dir, const struct wgdevice *device)
+{
+	char public[WG_KEY_LEN_BASE64], preshared[WG_KEY_LEN_BASE64 + 1], path[PATH_MAX], tmp[PATH_MAX];
+	const struct wgpeer *peer;
+
+	/* Every file is written before any is renamed, so that the whole directory is flushed at once rather than file by file. */
+	for_each_wgpeer(device, peer) {
+		file_name(public, peer);
+		key_to_base64(preshared, peer->preshared_key);
+		strcat(preshared, "\n");
+		if ((size_t)snprintf(tmp, sizeof(tmp), "%s/.%s.psk.tmp", dir, public) >= sizeof(tmp)) {
+			errno = ENAMETOOLONG;
+			goto err;
+		}
+		if (!write_key_file(tmp, preshared, strlen(preshared)))
+			goto err;
+	}
+#ifdef __linux__
+	{
+		int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		if (fd < 0 || syncfs(fd) < 0) {
+			if (fd >= 0)
+				close(fd);
+			goto err;
+		}
+		close(fd);
+	}
+#else
+	sync();
+#endif
+	for_each_wgpeer(device, peer) {
+		file_name(public, peer);
+		snprintf(tmp, sizeof(tmp), "%s/.%s.psk.tmp", dir, public);
+		snprintf(path, sizeof(path), "%s/%s.psk", dir, public);
+		if (rename(tmp, path) < 0)
+			goto err;
+	}
+	sync_directory(dir);
+	return true;
+
+err:
+	fprintf(stderr, "Unable to write preshared keys to `%s': %s\n", dir, strerror(errno));
+	for_each_wgpeer(device, peer) {
+		file_name(public, peer);
+		snprintf(tmp, sizeof(tmp), "%s/.%s.psk.tmp", dir, public);
+		unlink(tmp);
+	}
+	return false;
+}
+
+int rotate_psk_main(int argc, char *argv[])
+{
+	struct wgdevice *device = NULL;
+	struct wgpeer *peer, *next, **tail;
+	struct wanted_key *wanted = NULL;
+	const char *peers_path = NULL, *out_path = NULL;
+	uint8_t *entropy = NULL;
+	size_t wanted_len = 0, count = 0, i;
+	struct stat sbuf;
+	bool missing = false, forwarding;
+	int ret = 1, got;
+
+	if (argc < 2)
+		goto usage;
+	for (i = 2; i < (size_t)argc; ++i) {
+		if (!strcmp(argv[i], "--peers") && i + 1 < (size_t)argc)
+			peers_path = argv[++i];
+		else if (!strcmp(argv[i], "--out") && i + 1 < (size_t)argc)
+			out_path = argv[++i];
+		else
+			goto usage;
+	}
+	if (!out_path)
+		goto usage;
+	if (peers_path) {
+		wanted = read_peers(peers_path, &wanted_len);
+		if (!wanted)
+			return 1;
+	}
+
+	ipc_session_begin();
+	/* Which peers are on the interface is read from the interface itself, never from a cached copy. */
+	forwarding = ipc_daemon_forwarding(false);
+	got = ipc_get_device(&device, argv[1]);
+	ipc_daemon_forwarding(forwarding);
+	if (got < 0) {
+		perror("Unable to access interface");
+		goto cleanup;
+	}
+
+	/* Peers not being rotated are dropped from the dump, and the rest are cut down to what is needed to set a key. */
+	tail = &device->first_peer;
+	for (peer = device->first_peer; peer; peer = next) {
+		struct wgallowedip *allowedip, *next_allowedip;
+		struct wanted_key *match;
+
+		next = peer->next_peer;
+		for (allowedip = peer->first_allowedip; allowedip; allowedip = next_allowedip) {
+			next_allowedip = allowedip->next_allowedip;
+			free(allowedip);
+		}
+		peer->first_allowedip = peer->last_allowedip = NULL;
+		if (wanted) {
+			match = bsearch(peer->public_key, wanted, wanted_len, sizeof(*wanted), wanted_key_cmp);
+			if (!match) {
+				free(peer);
+				continue;
+			}
+			match->found = true;
+		}
+		memset(&peer->endpoint, 0, sizeof(peer->endpoint));
+		/* A peer removed since the dump is left removed, rather than brought back with only a key. */
+		peer->flags = WGPEER_HAS_PRESHARED_KEY | WGPEER_UPDATE_ONLY;
+		*tail = peer;
+		tail = &peer->next_peer;
+		++count;
+	}
+	*tail = NULL;
+	for (i = 0; i < wanted_len; ++i) {
+		if (!wanted[i].found) {
+			char base64[WG_KEY_LEN_BASE64];
+
+			key_to_base64(base64, wanted[i].key);
+			fprintf(stderr, "Peer is not on interface `%s': %s\n", argv[1], base64);
+			missing = true;
+		}
+	}
+	if (missing)
+		goto cleanup;
+
+	entropy = malloc(count * WG_KEY_LEN ?: 1);
+	if (!entropy) {
+		perror("malloc");
+		goto cleanup;
+	}
+	if (!get_random_bytes(entropy, count * WG_KEY_LEN)) {
+		perror("getrandom");
+		goto cleanup;
+	}
+	i = 0;
+	for_each_wgpeer(device, peer)
+		memcpy(peer->preshared_key, entropy + WG_KEY_LEN * i++, WG_KEY_LEN);
+
+	/* The keys are on disk before they are applied, so that no peer is ever left with a key nobody has a copy of. */
+	if (!stat(out_path, &sbuf) && S_ISDIR(sbuf.st_mode)) {
+		if (!write_directory(out_path, device))
+			goto cleanup;
+	} else if (!write_list(out_path, device))
+		goto cleanup;
+
+	/* Only the peers' keys are to change, so the private key, listen port and fwmark read back are not sent again, which
+	 * would rebind the sockets, reset every peer's source address, and undo any change made since they were read. */
+	device->flags = 0;
+	if (ipc_set_device(device) != 0) {
+		perror("Unable to modify interface");
+		fprintf(stderr, "The preshared keys written to `%s' may not all have been applied\n", out_path);
+		goto cleanup;
+	}
+	printf("Rotated %zu preshared keys\n", count);
+	ret = 0;
+
+cleanup:
+	ipc_session_end();
+	if (entropy) {
+		memset(entropy, 0, count * WG_KEY_LEN);
+		/* Keeps the compiler from eliding the memset of a buffer about to be freed. */
+		asm volatile("" : : "r"(entropy) : "memory");
+	}
+	free(entropy);
+	free(wanted);
+	free_wgdevice(device);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: %s %s <interface> [--peers <file>] --out <directory | file>\n", PROG_NAME, argv[0]);
+	return 1;
+}
@@ -3,14 +3,19 @@
  * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
  */
 
+#include <net/if.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "containers.h"
 #include "config.h"
+#include "encoding.h"
+#include "format.h"
 #include "ipc.h"
+#include "resolve.h"
 #include "subcommands.h"
 
 struct pubkey_origin {
@@ -98,17 +103,166 @@ static bool sync_conf(struct wgdevice *file)
 	return true;
 }
 
+static bool apply_conf(struct wgdevice *device, bool sync)
+{
+	if (sync) {
+		/* Removals are computed from the current peers, so never from a cached copy. */
+		bool forwarding = ipc_daemon_forwarding(false), synced = sync_conf(device);
+
+		ipc_daemon_forwarding(forwarding);
+		if (!synced)
+			return false;
+	}
+
+	if (resolve_set_device(device) != 0) {
+		perror("Unable to modify interface");
+		return false;
+	}
+	return true;
+}
+
+/* Jump consistent hashing, over FNV-1a of the public key: when the shard count
+ * changes from n to n + 1, only the 1/(n + 1) of peers that land on the new shard
+ * move. Both functions are part of the interface, since other hosts may compute
+ * the same assignment, and must never change. */
+static uint32_t shard_of(const uint8_t public_key[static WG_KEY_LEN], uint32_t shards)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int64_t shard = -1, next = 0;
+
+	for (size_t i = 0; i < WG_KEY_LEN; ++i)
+		hash = (hash ^ public_key[i]) * 0x100000001b3ULL;
+	while (next < shards) {
+		shard = next;
+		hash = hash * 2862933555777941757ULL + 1;
+		next = (shard + 1) * ((double)(1LL << 31) / (double)((hash >> 33) + 1));
+	}
+	return shard;
+}
+
+static void print_plan(struct wgdevice **shards, uint32_t count)
+{
+	char base64[WG_KEY_LEN_BASE64], ip[INET6_ADDRSTRLEN];
+	struct wgallowedip *allowedip;
+	struct wgpeer *peer;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		size_t peers = 0;
+
+		for_each_wgpeer(shards[i], peer)
+			++peers;
+		if (shards[i]->flags & WGDEVICE_HAS_LISTEN_PORT && shards[i]->listen_port)
+			printf("interface %s %u %zu\n", shards[i]->name, shards[i]->listen_port, peers);
+		else
+			printf("interface %s random %zu\n", shards[i]->name, peers);
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		for_each_wgpeer(shards[i], peer) {
+			if (peer->flags & WGPEER_REMOVE_ME)
+				continue;
+			key_to_base64(base64, peer->public_key);
+			printf("peer %s %s\n", base64, shards[i]->name);
+		}
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		for_each_wgpeer(shards[i], peer) {
+			for_each_wgallowedip(peer, allowedip) {
+				if (*format_ip(ip, allowedip))
+					printf("route %s/%u %s\n", ip, allowedip->cidr, shards[i]->name);
+			}
+		}
+	}
+}
+
+/* Splits the peers of one configuration over <prefix>0 to <prefix><count - 1>,
+ * which share the private key and take consecutive listen ports. */
+static int setconf_shards(const char *count_arg, const char *prefix, struct wgdevice *device, bool sync)
+{
+	struct wgdevice **shards;
+	struct wgpeer *peer, *next, **tails;
+	unsigned long count;
+	char *end;
+	int ret = 1;
+
+	count = strtoul(count_arg, &end, 10);
+	if (*end || !*count_arg || !count || count > 65536) {
+		fprintf(stderr, "Shard count is not a number from 1 to 65536: `%s'\n", count_arg);
+		return 1;
+	}
+	if ((size_t)snprintf(NULL, 0, "%s%lu", prefix, count - 1) >= IFNAMSIZ) {
+		fprintf(stderr, "Interface prefix is too long for %lu shards: `%s'\n", count, prefix);
+		return 1;
+	}
+	if (device->flags & WGDEVICE_HAS_LISTEN_PORT && device->listen_port && device->listen_port + count - 1 > 65535) {
+		fprintf(stderr, "Listen port %u leaves too few ports for %lu shards\n", device->listen_port, count);
+		return 1;
+	}
+
+	shards = calloc(count, sizeof(*shards));
+	tails = calloc(count, sizeof(*tails));
+	if (!shards || !tails) {
+		perror("Shard allocation");
+		goto cleanup;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		shards[i] = malloc(sizeof(*shards[i]));
+		if (!shards[i]) {
+			perror("Shard allocation");
+			goto cleanup;
+		}
+		*shards[i] = *device;
+		shards[i]->first_peer = shards[i]->last_peer = NULL;
+		snprintf(shards[i]->name, IFNAMSIZ, "%s%u", prefix, i);
+		if (device->flags & WGDEVICE_HAS_LISTEN_PORT && device->listen_port)
+			shards[i]->listen_port = device->listen_port + i;
+		tails[i] = NULL;
+	}
+	for (peer = device->first_peer; peer; peer = next) {
+		uint32_t i = shard_of(peer->public_key, count);
+
+		next = peer->next_peer;
+		peer->next_peer = NULL;
+		if (tails[i])
+			tails[i]->next_peer = peer;
+		else
+			shards[i]->first_peer = peer;
+		tails[i] = shards[i]->last_peer = peer;
+	}
+	device->first_peer = device->last_peer = NULL;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!apply_conf(shards[i], sync)) {
+			fprintf(stderr, "Unable to configure shard `%s'; shards before it were configured\n", shards[i]->name);
+			goto cleanup;
+		}
+	}
+	print_plan(shards, count);
+	ret = 0;
+
+cleanup:
+	if (shards) {
+		for (uint32_t i = 0; i < count; ++i)
+			free_wgdevice(shards[i]);
+	}
+	free(shards);
+	free(tails);
+	return ret;
+}
+
 int setconf_main(int argc, char *argv[])
 {
 	struct wgdevice *device = NULL;
-	struct config_ctx ctx;
 	FILE *config_input = NULL;
-	char *config_buffer = NULL;
-	size_t config_buffer_len = 0;
+	const char *shard_count = NULL;
 	int ret = 1;
 
+	if (argc == 5 && !strcmp(argv[1], "--shard")) {
+		shard_count = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc != 3) {
-		fprintf(stderr, "Usage: %s %s <interface> <configuration filename>\n", PROG_NAME, argv[0]);
+		fprintf(stderr, "Usage: %s %s [--shard <count>] <interface> <configuration filename>\n", PROG_NAME, argv[0]);
 		return 1;
 	}
 
@@ -117,40 +271,26 @@ int setconf_main(int argc, char *argv[])
 		perror("fopen");
 		return 1;
 	}
-	if (!config_read_init(&ctx, !strcmp(argv[0], "addconf"))) {
-		fclose(config_input);
-		return 1;
-	}
-	while (getline(&config_buffer, &config_buffer_len, config_input) >= 0) {
-		if (!config_read_line(&ctx, config_buffer)) {
-			fprintf(stderr, "Configuration parsing error\n");
-			goto cleanup;
-		}
-	}
-	device = config_read_finish(&ctx);
-	if (!device) {
-		fprintf(stderr, "Invalid configuration\n");
+	ipc_session_begin();
+	device = config_read_file(config_input, !strcmp(argv[0], "addconf"));
+	if (!device)
+		goto cleanup;
+	if (shard_count) {
+		ret = setconf_shards(shard_count, argv[1], device, !strcmp(argv[0], "syncconf"));
 		goto cleanup;
 	}
 	strncpy(device->name, argv[1], IFNAMSIZ - 1);
 	device->name[IFNAMSIZ - 1] = '\0';
 
-	if (!strcmp(argv[0], "syncconf")) {
-		if (!sync_conf(device))
-			goto cleanup;
-	}
-
-	if (ipc_set_device(device) != 0) {
-		perror("Unable to modify interface");
+	if (!apply_conf(device, !strcmp(argv[0], "syncconf")))
 		goto cleanup;
-	}
 
 	ret = 0;
 
 cleanup:
+	ipc_session_end();
 	if (config_input)
 		fclose(config_input);
-	free(config_buffer);
 	free_wgdevice(device);
 	return ret;
 }
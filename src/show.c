@@ -18,11 +18,16 @@
 #include <time.h>
 #include <netdb.h>
 
+#include "aggregate.h"
+#include "arrow.h"
 #include "containers.h"
 #include "ipc.h"
 #include "terminal.h"
 #include "encoding.h"
+#include "format.h"
+#include "netns.h"
 #include "subcommands.h"
+#include "summary.h"
 
 static int peer_cmp(const void *first, const void *second)
 {
@@ -202,7 +207,48 @@ static char *bytes(uint64_t b)
 static const char *COMMAND_NAME;
 static void show_usage(void)
 {
-	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | listen-port | fwmark | peers | preshared-keys | endpoints | allowed-ips | latest-handshakes | transfer | persistent-keepalive | dump]\n", PROG_NAME, COMMAND_NAME);
+	fprintf(stderr, "Usage: %s %s [--all-netns | --netns <path>] { <interface> | all | interfaces } [public-key | private-key | listen-port | fwmark | peers | preshared-keys | endpoints | allowed-ips | latest-handshakes | transfer | persistent-keepalive | dump | arrow | link-stats [--peers] | summary [--json] | aggregate --by <grouping>]\n", PROG_NAME, COMMAND_NAME);
+}
+
+static struct aggregator *aggregator;
+
+/* Whether link-stats is to count peers too, which takes a dump of the interface after all. */
+static bool link_stats_peers;
+
+static bool summary_json;
+
+/* Outside --all-netns, where whole devices are gathered from every namespace
+ * first, each peer is folded into the summary as soon as it is decoded and
+ * freed, so that the figures for a large interface take no memory per peer. */
+static struct summary_stream {
+	struct summary summary;
+	time_t now;
+	bool active;
+} summary_stream;
+
+static void summary_stream_peer(const struct wgpeer *peer, void *ctx)
+{
+	struct summary_stream *stream = ctx;
+
+	if (!peer) {
+		summary_init(&stream->summary);
+		stream->now = time(NULL);
+	} else
+		summary_add(&stream->summary, peer, stream->now);
+}
+
+/* Started up front, so that every interface shown goes into the one stream under the one schema. */
+static struct arrow_writer *arrow;
+
+/* With --all-netns, the name of the namespace an interface is in leads every line about it. */
+static const char *netns_column;
+
+static void print_interface(const struct wgdevice *device, bool with_interface)
+{
+	if (netns_column)
+		printf("%s\t", netns_column);
+	if (with_interface)
+		printf("%s\t", device->name);
 }
 
 static void pretty_print(struct wgdevice *device)
@@ -212,6 +258,8 @@ static void pretty_print(struct wgdevice *device)
 
 	terminal_printf(TERMINAL_RESET);
 	terminal_printf(TERMINAL_FG_GREEN TERMINAL_BOLD "interface" TERMINAL_RESET ": " TERMINAL_FG_GREEN "%s" TERMINAL_RESET "\n", device->name);
+	if (netns_column)
+		terminal_printf("  " TERMINAL_BOLD "network namespace" TERMINAL_RESET ": %s\n", netns_column);
 	if (device->flags & WGDEVICE_HAS_PUBLIC_KEY)
 		terminal_printf("  " TERMINAL_BOLD "public key" TERMINAL_RESET ": %s\n", key(device->public_key));
 	if (device->flags & WGDEVICE_HAS_PRIVATE_KEY)
@@ -250,71 +298,29 @@ static void pretty_print(struct wgdevice *device)
 	}
 }
 
-static void dump_print(struct wgdevice *device, bool with_interface)
-{
-	struct wgpeer *peer;
-	struct wgallowedip *allowedip;
-
-	if (with_interface)
-		printf("%s\t", device->name);
-	printf("%s\t", maybe_key(device->private_key, device->flags & WGDEVICE_HAS_PRIVATE_KEY));
-	printf("%s\t", maybe_key(device->public_key, device->flags & WGDEVICE_HAS_PUBLIC_KEY));
-	printf("%u\t", device->listen_port);
-	if (device->fwmark)
-		printf("0x%x\n", device->fwmark);
-	else
-		printf("off\n");
-	for_each_wgpeer(device, peer) {
-		if (with_interface)
-			printf("%s\t", device->name);
-		printf("%s\t", key(peer->public_key));
-		printf("%s\t", maybe_key(peer->preshared_key, peer->flags & WGPEER_HAS_PRESHARED_KEY));
-		if (peer->endpoint.addr.sa_family == AF_INET || peer->endpoint.addr.sa_family == AF_INET6)
-			printf("%s\t", endpoint(&peer->endpoint.addr));
-		else
-			printf("(none)\t");
-		if (peer->first_allowedip) {
-			for_each_wgallowedip(peer, allowedip)
-				printf("%s/%u%c", ip(allowedip), allowedip->cidr, allowedip->next_allowedip ? ',' : '\t');
-		} else
-			printf("(none)\t");
-		printf("%llu\t", (unsigned long long)peer->last_handshake_time.tv_sec);
-		printf("%" PRIu64 "\t%" PRIu64 "\t", (uint64_t)peer->rx_bytes, (uint64_t)peer->tx_bytes);
-		if (peer->persistent_keepalive_interval)
-			printf("%u\n", peer->persistent_keepalive_interval);
-		else
-			printf("off\n");
-	}
-}
-
 static bool ugly_print(struct wgdevice *device, const char *param, bool with_interface)
 {
 	struct wgpeer *peer;
 	struct wgallowedip *allowedip;
 
 	if (!strcmp(param, "public-key")) {
-		if (with_interface)
-			printf("%s\t", device->name);
+		print_interface(device, with_interface);
 		printf("%s\n", maybe_key(device->public_key, device->flags & WGDEVICE_HAS_PUBLIC_KEY));
 	} else if (!strcmp(param, "private-key")) {
-		if (with_interface)
-			printf("%s\t", device->name);
+		print_interface(device, with_interface);
 		printf("%s\n", maybe_key(device->private_key, device->flags & WGDEVICE_HAS_PRIVATE_KEY));
 	} else if (!strcmp(param, "listen-port")) {
-		if (with_interface)
-			printf("%s\t", device->name);
+		print_interface(device, with_interface);
 		printf("%u\n", device->listen_port);
 	} else if (!strcmp(param, "fwmark")) {
-		if (with_interface)
-			printf("%s\t", device->name);
+		print_interface(device, with_interface);
 		if (device->fwmark)
 			printf("0x%x\n", device->fwmark);
 		else
 			printf("off\n");
 	} else if (!strcmp(param, "endpoints")) {
-		if (with_interface)
-			printf("%s\t", device->name);
 		for_each_wgpeer(device, peer) {
+			print_interface(device, with_interface);
 			printf("%s\t", key(peer->public_key));
 			if (peer->endpoint.addr.sa_family == AF_INET || peer->endpoint.addr.sa_family == AF_INET6)
 				printf("%s\n", endpoint(&peer->endpoint.addr));
@@ -323,8 +329,7 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 		}
 	} else if (!strcmp(param, "allowed-ips")) {
 		for_each_wgpeer(device, peer) {
-			if (with_interface)
-				printf("%s\t", device->name);
+			print_interface(device, with_interface);
 			printf("%s\t", key(peer->public_key));
 			if (peer->first_allowedip) {
 				for_each_wgallowedip(peer, allowedip)
@@ -334,20 +339,17 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 		}
 	} else if (!strcmp(param, "latest-handshakes")) {
 		for_each_wgpeer(device, peer) {
-			if (with_interface)
-				printf("%s\t", device->name);
+			print_interface(device, with_interface);
 			printf("%s\t%llu\n", key(peer->public_key), (unsigned long long)peer->last_handshake_time.tv_sec);
 		}
 	} else if (!strcmp(param, "transfer")) {
 		for_each_wgpeer(device, peer) {
-			if (with_interface)
-				printf("%s\t", device->name);
+			print_interface(device, with_interface);
 			printf("%s\t%" PRIu64 "\t%" PRIu64 "\n", key(peer->public_key), (uint64_t)peer->rx_bytes, (uint64_t)peer->tx_bytes);
 		}
 	} else if (!strcmp(param, "persistent-keepalive")) {
 		for_each_wgpeer(device, peer) {
-			if (with_interface)
-				printf("%s\t", device->name);
+			print_interface(device, with_interface);
 			if (peer->persistent_keepalive_interval)
 				printf("%s\t%u\n", key(peer->public_key), peer->persistent_keepalive_interval);
 			else
@@ -355,20 +357,67 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 		}
 	} else if (!strcmp(param, "preshared-keys")) {
 		for_each_wgpeer(device, peer) {
-			if (with_interface)
-				printf("%s\t", device->name);
+			print_interface(device, with_interface);
 			printf("%s\t", key(peer->public_key));
 			printf("%s\n", maybe_key(peer->preshared_key, peer->flags & WGPEER_HAS_PRESHARED_KEY));
 		}
 	} else if (!strcmp(param, "peers")) {
 		for_each_wgpeer(device, peer) {
-			if (with_interface)
-				printf("%s\t", device->name);
+			print_interface(device, with_interface);
 			printf("%s\n", key(peer->public_key));
 		}
-	} else if (!strcmp(param, "dump"))
-		dump_print(device, with_interface);
-	else {
+	} else if (!strcmp(param, "dump")) {
+		char *buffer = NULL, *line, *end;
+		size_t len = 0;
+		FILE *f;
+
+		if (!netns_column) {
+			format_dump(stdout, device, with_interface);
+			return true;
+		}
+		f = open_memstream(&buffer, &len);
+		if (!f) {
+			perror("open_memstream");
+			return false;
+		}
+		format_dump(f, device, with_interface);
+		fclose(f);
+		for (line = buffer; line < buffer + len; line = end + 1) {
+			end = memchr(line, '\n', buffer + len - line) ?: buffer + len;
+			printf("%s\t%.*s\n", netns_column, (int)(end - line), line);
+		}
+		free(buffer);
+	} else if (!strcmp(param, "summary")) {
+		struct summary summary;
+		time_t now = time(NULL);
+
+		if (summary_stream.active)
+			summary = summary_stream.summary;
+		else {
+			summary_init(&summary);
+			for_each_wgpeer(device, peer)
+				summary_add(&summary, peer, now);
+		}
+		summary_print(&summary, netns_column, summary_json || with_interface ? device->name : NULL, summary_json);
+	} else if (!strcmp(param, "arrow") && arrow) {
+		if (!arrow_write_device(arrow, netns_column, device)) {
+			perror("Unable to write Arrow stream");
+			return false;
+		}
+	} else if (!strcmp(param, "aggregate") && aggregator) {
+		const struct aggregate_group *groups;
+		size_t len;
+
+		groups = aggregator_run(aggregator, device, &len);
+		if (!groups) {
+			perror("Unable to aggregate peers");
+			return false;
+		}
+		for (size_t i = 0; i < len; ++i) {
+			print_interface(device, with_interface);
+			printf("%s\t%zu\t%" PRIu64 "\t%" PRIu64 "\n", groups[i].name, groups[i].peers, groups[i].rx_bytes, groups[i].tx_bytes);
+		}
+	} else {
 		fprintf(stderr, "Invalid parameter: `%s'\n", param);
 		show_usage();
 		return false;
@@ -376,11 +425,137 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 	return true;
 }
 
-int show_main(int argc, char *argv[])
+/* The link counters are read on their own, rather than from a device already dumped, so as to stay constant in the number of peers. */
+static bool print_link_stats(const char *interface, bool with_interface)
+{
+	struct wgdevice *device = NULL;
+	struct wglinkstats stats;
+	struct wgpeer *peer;
+	size_t peers = 0;
+
+	if (ipc_get_link_stats(&stats, interface) < 0) {
+		fprintf(stderr, "Unable to read link statistics of interface %s: %s\n", interface, strerror(errno));
+		return false;
+	}
+	if (link_stats_peers) {
+		if (ipc_get_device(&device, interface) < 0) {
+			fprintf(stderr, "Unable to access interface %s: %s\n", interface, strerror(errno));
+			return false;
+		}
+		for_each_wgpeer(device, peer)
+			++peers;
+		free_wgdevice(device);
+	}
+	if (with_interface)
+		printf("%s\t", interface);
+	printf("%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64,
+	       stats.rx_packets, stats.rx_bytes, stats.rx_errors, stats.rx_dropped,
+	       stats.tx_packets, stats.tx_bytes, stats.tx_errors, stats.tx_dropped);
+	if (link_stats_peers)
+		printf("\t%zu", peers);
+	printf("\n");
+	return true;
+}
+
+/* Only what a parameter prints is decoded, so that polling transfer, say, skips every allowed IP. */
+static unsigned int param_fields(const char *param)
+{
+	if (!strcmp(param, "public-key") || !strcmp(param, "private-key") || !strcmp(param, "preshared-keys"))
+		return IPC_FIELD_KEYS;
+	if (!strcmp(param, "listen-port") || !strcmp(param, "fwmark") || !strcmp(param, "peers") || !strcmp(param, "link-stats"))
+		return 0;
+	if (!strcmp(param, "endpoints"))
+		return IPC_FIELD_ENDPOINTS;
+	if (!strcmp(param, "allowed-ips"))
+		return IPC_FIELD_ALLOWEDIPS;
+	if (!strcmp(param, "latest-handshakes"))
+		return IPC_FIELD_HANDSHAKES;
+	if (!strcmp(param, "transfer"))
+		return IPC_FIELD_TRANSFER;
+	if (!strcmp(param, "summary"))
+		return IPC_FIELD_HANDSHAKES | IPC_FIELD_TRANSFER;
+	if (!strcmp(param, "arrow"))
+		return IPC_FIELD_ENDPOINTS | IPC_FIELD_ALLOWEDIPS | IPC_FIELD_HANDSHAKES | IPC_FIELD_TRANSFER;
+	if (!strcmp(param, "persistent-keepalive"))
+		return IPC_FIELD_KEEPALIVES;
+	if (!strcmp(param, "aggregate") && aggregator)
+		return IPC_FIELD_TRANSFER | (aggregator_by_endpoint(aggregator) ? IPC_FIELD_ENDPOINTS : IPC_FIELD_ALLOWEDIPS);
+	return IPC_FIELD_ALL;
+}
+
+static int show_all_netns(int argc, char *argv[])
 {
+	const char *target = argc > 1 ? argv[1] : "all";
+	bool interfaces_only = !strcmp(target, "interfaces"), found = false, first = true;
+	const char *only_interface = strcmp(target, "all") && !interfaces_only ? target : NULL;
+	struct netns *list;
+	size_t len = 0;
 	int ret = 0;
 
-	COMMAND_NAME = argv[0];
+	if (argc > 3 || (interfaces_only && argc > 2)) {
+		show_usage();
+		return 1;
+	}
+	if (argc == 3 && !strcmp(argv[2], "link-stats")) {
+		fprintf(stderr, "Link statistics can only be shown for one network namespace at a time\n");
+		return 1;
+	}
+	list = netns_list(&len);
+	if (!list) {
+		perror("Unable to list network namespaces");
+		return 1;
+	}
+	netns_collect(list, len, only_interface, interfaces_only);
+
+	for (size_t i = 0; i < len; ++i) {
+		struct netns *netns = &list[i];
+
+		if (netns->error) {
+			fprintf(stderr, "Unable to access network namespace %s: %s\n", netns->name, strerror(netns->error));
+			ret = 1;
+			continue;
+		}
+		if (interfaces_only) {
+			if (netns->devices_len)
+				printf("%s\t", netns->name);
+			for (size_t j = 0; j < netns->devices_len; ++j)
+				printf("%s%c", netns->device_names[j], j + 1 < netns->devices_len ? ' ' : '\n');
+			continue;
+		}
+		netns_column = netns->name;
+		for (size_t j = 0; j < netns->devices_len; ++j) {
+			if (!netns->devices[j]) {
+				fprintf(stderr, "Unable to access interface %s in network namespace %s: %s\n", netns->device_names[j], netns->name, strerror(netns->device_errors[j]));
+				ret = 1;
+				continue;
+			}
+			found = true;
+			if (argc == 3) {
+				if (!ugly_print(netns->devices[j], argv[2], !only_interface)) {
+					ret = 1;
+					goto out;
+				}
+			} else {
+				if (!first)
+					printf("\n");
+				pretty_print(netns->devices[j]);
+				first = false;
+			}
+		}
+	}
+	if (only_interface && !found) {
+		fprintf(stderr, "Unable to access interface %s: %s\n", only_interface, strerror(ENODEV));
+		ret = 1;
+	}
+out:
+	netns_column = NULL;
+	netns_free(list, len);
+	return ret;
+}
+
+static int show_devices(int argc, char *argv[])
+{
+	int ret = 0;
 
 	if (argc > 3) {
 		show_usage();
@@ -396,9 +571,15 @@ int show_main(int argc, char *argv[])
 		}
 		ret = !!*interfaces;
 		interface = interfaces;
+		ipc_session_begin();
 		for (size_t len = 0; (len = strlen(interface)); interface += len + 1) {
 			struct wgdevice *device = NULL;
 
+			if (argc == 3 && !strcmp(argv[2], "link-stats")) {
+				if (print_link_stats(interface, true))
+					ret = 0;
+				continue;
+			}
 			if (ipc_get_device(&device, interface) < 0) {
 				fprintf(stderr, "Unable to access interface %s: %s\n", interface, strerror(errno));
 				continue;
@@ -417,6 +598,7 @@ int show_main(int argc, char *argv[])
 			free_wgdevice(device);
 			ret = 0;
 		}
+		ipc_session_end();
 		free(interfaces);
 	} else if (!strcmp(argv[1], "interfaces")) {
 		char *interfaces, *interface;
@@ -436,6 +618,8 @@ int show_main(int argc, char *argv[])
 		free(interfaces);
 	} else if (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help") || !strcmp(argv[1], "help")))
 		show_usage();
+	else if (argc == 3 && !strcmp(argv[2], "link-stats"))
+		ret = !print_link_stats(argv[1], false);
 	else {
 		struct wgdevice *device = NULL;
 
@@ -452,3 +636,75 @@ int show_main(int argc, char *argv[])
 	}
 	return ret;
 }
+
+int show_main(int argc, char *argv[])
+{
+	bool all_netns = false;
+	int ret;
+
+	COMMAND_NAME = argv[0];
+
+	if (argc > 1 && !strcmp(argv[1], "--all-netns")) {
+		argv[1] = argv[0];
+		++argv;
+		--argc;
+		all_netns = true;
+	} else if (argc > 2 && !strcmp(argv[1], "--netns")) {
+		bool own = false;
+
+		ret = netns_enter(argv[2], &own);
+		if (ret < 0) {
+			fprintf(stderr, "Unable to enter network namespace %s: %s\n", argv[2], strerror(-ret));
+			return 1;
+		}
+		/* Neither the daemon nor userspace implementations can be told apart by namespace, so only our own shows them. */
+		if (!own) {
+			ipc_userspace_interfaces(false);
+			ipc_daemon_forwarding(false);
+		}
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+
+	/* The grouping is parsed once up front, since a file of endpoint prefixes may be large, and is reused for every interface. */
+	if (argc > 2 && !strcmp(argv[2], "aggregate")) {
+		aggregator = aggregator_new(argc - 3, argv + 3);
+		if (!aggregator)
+			return 1;
+		argc = 3;
+	} else if (argc == 4 && !strcmp(argv[2], "link-stats") && !strcmp(argv[3], "--peers")) {
+		link_stats_peers = true;
+		argc = 3;
+	} else if (argc == 4 && !strcmp(argv[2], "summary") && !strcmp(argv[3], "--json")) {
+		summary_json = true;
+		argc = 3;
+	} else if (argc == 3 && !strcmp(argv[2], "arrow")) {
+		arrow = arrow_writer_new(stdout, all_netns);
+		if (!arrow) {
+			perror("Unable to write Arrow stream");
+			return 1;
+		}
+	}
+
+	if (argc == 3)
+		ipc_device_fields(param_fields(argv[2]));
+	if (argc == 3 && !all_netns && !strcmp(argv[2], "summary")) {
+		summary_stream.active = true;
+		ipc_device_peer_sink(summary_stream_peer, &summary_stream);
+	}
+	ret = all_netns ? show_all_netns(argc, argv) : show_devices(argc, argv);
+	ipc_device_peer_sink(NULL, NULL);
+	summary_stream.active = false;
+	ipc_device_fields(IPC_FIELD_ALL);
+	if (arrow && !arrow_writer_finish(arrow) && !ret) {
+		perror("Unable to write Arrow stream");
+		ret = 1;
+	}
+	arrow = NULL;
+	aggregator_free(aggregator);
+	aggregator = NULL;
+	link_stats_peers = false;
+	summary_json = false;
+	return ret;
+}
@@ -13,5 +13,16 @@ int set_main(int argc, char *argv[]);
 int setconf_main(int argc, char *argv[]);
 int genkey_main(int argc, char *argv[]);
 int pubkey_main(int argc, char *argv[]);
+int daemon_main(int argc, char *argv[]);
+int batch_main(int argc, char *argv[]);
+int diff_main(int argc, char *argv[]);
+int gc_main(int argc, char *argv[]);
+int rotate_psk_main(int argc, char *argv[]);
+int mesh_main(int argc, char *argv[]);
+int resolve_status_main(int argc, char *argv[]);
+int checkpoint_main(int argc, char *argv[]);
+int restore_endpoints_main(int argc, char *argv[]);
+int complete_main(int argc, char *argv[]);
+int remove_firewall_main(int argc, char *argv[]);
 
 #endif
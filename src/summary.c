@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "containers.h"
+#include "format.h"
+#include "summary.h"
+
+/* A session is only good for three minutes after its handshake, so a peer that has had one since is in use. */
+#define RECENT_HANDSHAKE 180
+
+static const struct {
+	const char *name;
+	uint64_t up_to;
+} age_buckets[SUMMARY_AGE_BUCKETS] = {
+	{ "0-2m", 2 * 60 },
+	{ "2m-3m", 3 * 60 },
+	{ "3m-5m", 5 * 60 },
+	{ "5m-15m", 15 * 60 },
+	{ "15m-1h", 60 * 60 },
+	{ "1h-1d", 24 * 60 * 60 },
+	{ "1d-1w", 7 * 24 * 60 * 60 },
+	{ "1w+", UINT64_MAX }
+};
+
+static const unsigned int percentiles[] = { 50, 90, 99 };
+
+static size_t byte_bucket(uint64_t value)
+{
+	unsigned int exponent;
+
+	if (value < (1U << SUMMARY_SUB_BITS))
+		return value;
+	exponent = 63 - __builtin_clzll(value);
+	return ((size_t)(exponent - SUMMARY_SUB_BITS + 1) << SUMMARY_SUB_BITS) |
+	       ((value >> (exponent - SUMMARY_SUB_BITS)) & ((1U << SUMMARY_SUB_BITS) - 1));
+}
+
+/* The largest value that falls in a bucket, so that a percentile is never underestimated. */
+static uint64_t byte_bucket_limit(size_t bucket)
+{
+	unsigned int exponent, shift;
+	uint64_t low;
+
+	if (bucket < (1U << SUMMARY_SUB_BITS))
+		return bucket;
+	exponent = (bucket >> SUMMARY_SUB_BITS) + SUMMARY_SUB_BITS - 1;
+	shift = exponent - SUMMARY_SUB_BITS;
+	low = (uint64_t)((1U << SUMMARY_SUB_BITS) | (bucket & ((1U << SUMMARY_SUB_BITS) - 1))) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void bytes_add(struct summary_bytes *bytes, uint64_t value)
+{
+	bytes->total += value;
+	if (value > bytes->max)
+		bytes->max = value;
+	++bytes->counts[byte_bucket(value)];
+}
+
+/* By nearest rank, capped at the maximum, which is known exactly. */
+static uint64_t bytes_percentile(const struct summary_bytes *bytes, size_t peers, unsigned int percentile)
+{
+	size_t rank = (peers * percentile + 99) / 100, seen = 0;
+
+	if (!rank)
+		return 0;
+	for (size_t i = 0; i < SUMMARY_BYTE_BUCKETS; ++i) {
+		seen += bytes->counts[i];
+		if (seen >= rank) {
+			uint64_t limit = byte_bucket_limit(i);
+
+			return limit < bytes->max ? limit : bytes->max;
+		}
+	}
+	return bytes->max;
+}
+
+void summary_init(struct summary *summary)
+{
+	memset(summary, 0, sizeof(*summary));
+}
+
+void summary_add(struct summary *summary, const struct wgpeer *peer, time_t now)
+{
+	uint64_t age;
+	size_t i;
+
+	++summary->peers;
+	bytes_add(&summary->rx, peer->rx_bytes);
+	bytes_add(&summary->tx, peer->tx_bytes);
+	if (!peer->last_handshake_time.tv_sec && !peer->last_handshake_time.tv_nsec) {
+		++summary->never_handshaked;
+		return;
+	}
+	/* A clock set back since makes for a handshake in the future, which is as recent as it gets. */
+	age = now > peer->last_handshake_time.tv_sec ? (uint64_t)(now - peer->last_handshake_time.tv_sec) : 0;
+	if (age <= RECENT_HANDSHAKE)
+		++summary->recent_handshake;
+	for (i = 0; age > age_buckets[i].up_to; ++i);
+	++summary->ages[i];
+}
+
+static void print_columns(const char *netns, const char *interface)
+{
+	if (netns)
+		printf("%s\t", netns);
+	if (interface)
+		printf("%s\t", interface);
+}
+
+static void print_bytes_text(const struct summary *summary, const struct summary_bytes *bytes, const char *name,
+			     const char *netns, const char *interface)
+{
+	print_columns(netns, interface);
+	printf("%s\ttotal\t%" PRIu64 "\n", name, bytes->total);
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+		print_columns(netns, interface);
+		printf("%s\tp%u\t%" PRIu64 "\n", name, percentiles[i], bytes_percentile(bytes, summary->peers, percentiles[i]));
+	}
+	print_columns(netns, interface);
+	printf("%s\tmax\t%" PRIu64 "\n", name, bytes->max);
+}
+
+static void print_bytes_json(const struct summary *summary, const struct summary_bytes *bytes, const char *name)
+{
+	printf(", \"%s\": {\"total\": %" PRIu64, name, bytes->total);
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i)
+		printf(", \"p%u\": %" PRIu64, percentiles[i], bytes_percentile(bytes, summary->peers, percentiles[i]));
+	printf(", \"max\": %" PRIu64 "}", bytes->max);
+}
+
+void summary_print(const struct summary *summary, const char *netns, const char *interface, bool json)
+{
+	if (json) {
+		printf("{");
+		if (netns) {
+			printf("\"netns\": ");
+			format_json_string(stdout, netns);
+			printf(", ");
+		}
+		if (interface) {
+			printf("\"interface\": ");
+			format_json_string(stdout, interface);
+			printf(", ");
+		}
+		printf("\"peers\": %zu, \"recent_handshake\": %zu, \"never_handshaked\": %zu, \"handshake_age\": {",
+		       summary->peers, summary->recent_handshake, summary->never_handshaked);
+		for (size_t i = 0; i < SUMMARY_AGE_BUCKETS; ++i)
+			printf("%s\"%s\": %zu", i ? ", " : "", age_buckets[i].name, summary->ages[i]);
+		printf("}");
+		print_bytes_json(summary, &summary->rx, "rx_bytes");
+		print_bytes_json(summary, &summary->tx, "tx_bytes");
+		printf("}\n");
+		return;
+	}
+	print_columns(netns, interface);
+	printf("peers\t%zu\n", summary->peers);
+	print_columns(netns, interface);
+	printf("recent-handshake\t%zu\n", summary->recent_handshake);
+	print_columns(netns, interface);
+	printf("never-handshaked\t%zu\n", summary->never_handshaked);
+	for (size_t i = 0; i < SUMMARY_AGE_BUCKETS; ++i) {
+		print_columns(netns, interface);
+		printf("handshake-age\t%s\t%zu\n", age_buckets[i].name, summary->ages[i]);
+	}
+	print_bytes_text(summary, &summary->rx, "rx-bytes", netns, interface);
+	print_bytes_text(summary, &summary->tx, "tx-bytes", netns, interface);
+}
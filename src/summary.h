@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct wgpeer;
+
+#define SUMMARY_AGE_BUCKETS 8
+#define SUMMARY_SUB_BITS 4
+#define SUMMARY_BYTE_BUCKETS ((64 - SUMMARY_SUB_BITS + 1) << SUMMARY_SUB_BITS)
+
+/* Byte counts are kept in buckets that split each power of two into sixteen,
+ * so that a percentile is known to within a sixteenth of its value while the
+ * histogram stays the same size however many peers go into it. */
+struct summary_bytes {
+	uint64_t total, max;
+	size_t counts[SUMMARY_BYTE_BUCKETS];
+};
+
+struct summary {
+	size_t peers, recent_handshake, never_handshaked;
+	size_t ages[SUMMARY_AGE_BUCKETS];
+	struct summary_bytes rx, tx;
+};
+
+void summary_init(struct summary *summary);
+void summary_add(struct summary *summary, const struct wgpeer *peer, time_t now);
+/* Prints a line per figure, each led by the given columns, or a single JSON object with them as its first members. */
+void summary_print(const struct summary *summary, const char *netns, const char *interface, bool json);
+
+#endif
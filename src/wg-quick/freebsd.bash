@@ -23,6 +23,7 @@ POST_UP=( )
 PRE_DOWN=( )
 POST_DOWN=( )
 SAVE_CONFIG=0
+CHECKPOINT=""
 CONFIG_FILE=""
 PROGRAM="${0##*/}"
 ARGS=( "$@" )
@@ -94,6 +95,7 @@ parse_options() {
 			PostUp) POST_UP+=( "$value" ); continue ;;
 			PostDown) POST_DOWN+=( "$value" ); continue ;;
 			SaveConfig) read_bool SAVE_CONFIG "$value"; continue ;;
+			Checkpoint) CHECKPOINT="$value"; continue ;;
 			esac
 		fi
 		WG_CONFIG+="$line"$'\n'
@@ -338,6 +340,16 @@ set_config() {
 	cmd wg setconf "$INTERFACE" <(echo "$WG_CONFIG")
 }
 
+checkpoint() {
+	[[ -n $CHECKPOINT ]] || return 0
+	cmd wg checkpoint "$INTERFACE" "$CHECKPOINT" || true
+}
+
+restore_endpoints() {
+	[[ -n $CHECKPOINT && -e $CHECKPOINT ]] || return 0
+	cmd wg restore-endpoints "$INTERFACE" "$CHECKPOINT" || true
+}
+
 save_config() {
 	local old_umask new_config current_config address cmd
 	new_config=$'[Interface]\n'
@@ -353,6 +365,7 @@ save_config() {
 	[[ -n $MTU ]] && new_config+="MTU = $MTU"$'\n'
 	[[ -n $TABLE ]] && new_config+="Table = $TABLE"$'\n'
 	[[ $SAVE_CONFIG -eq 0 ]] || new_config+=$'SaveConfig = true\n'
+	[[ -z $CHECKPOINT ]] || new_config+="Checkpoint = $CHECKPOINT"$'\n'
 	for cmd in "${PRE_UP[@]}"; do
 		new_config+="PreUp = $cmd"$'\n'
 	done
@@ -409,6 +422,9 @@ cmd_usage() {
 	    to configure DNS. The string \`%i' is expanded to INTERFACE.
 	  - SaveConfig: if set to \`true', the configuration is saved from the current
 	    state of the interface upon shutdown.
+	  - Checkpoint: an optional file to which the endpoint each peer was last
+	    heard from is saved upon shutdown, and from which recent ones are given
+	    back to peers without an endpoint upon startup.
 
 	See wg-quick(8) for more info and examples.
 	_EOF
@@ -421,6 +437,7 @@ cmd_up() {
 	execute_hooks "${PRE_UP[@]}"
 	add_if
 	set_config
+	restore_endpoints
 	for i in "${ADDRESSES[@]}"; do
 		add_addr "$i"
 	done
@@ -439,6 +456,7 @@ cmd_up() {
 cmd_down() {
 	[[ " $(wg show interfaces) " == *" $INTERFACE "* ]] || die "\`$INTERFACE' is not a WireGuard interface"
 	execute_hooks "${PRE_DOWN[@]}"
+	checkpoint
 	[[ $SAVE_CONFIG -eq 0 ]] || save_config
 	del_if
 	unset_dns
@@ -23,6 +23,7 @@ POST_UP=( )
 PRE_DOWN=( )
 POST_DOWN=( )
 SAVE_CONFIG=0
+CHECKPOINT=""
 CONFIG_FILE=""
 PROGRAM="${0##*/}"
 ARGS=( "$@" )
@@ -66,6 +67,7 @@ parse_options() {
 			PostUp) POST_UP+=( "$value" ); continue ;;
 			PostDown) POST_DOWN+=( "$value" ); continue ;;
 			SaveConfig) read_bool SAVE_CONFIG "$value"; continue ;;
+			Checkpoint) CHECKPOINT="$value"; continue ;;
 			esac
 		fi
 		WG_CONFIG+="$line"$'\n'
@@ -187,7 +189,7 @@ get_fwmark() {
 }
 
 remove_firewall() {
-	if type -p nft >/dev/null; then
+	if ! cmd wg remove-firewall "$INTERFACE" && type -p nft >/dev/null; then
 		local table nftcmd
 		while read -r table; do
 			[[ $table == *" wg-quick-$INTERFACE" ]] && printf -v nftcmd '%sdelete %s\n' "$nftcmd" "$table"
@@ -195,14 +197,21 @@ remove_firewall() {
 		[[ -z $nftcmd ]] || cmd nft -f <(echo -n "$nftcmd")
 	fi
 	if type -p iptables >/dev/null; then
-		local line iptables found restore
+		local line iptables found restore table chain
 		for iptables in iptables ip6tables; do
 			restore="" found=0
-			while read -r line; do
-				[[ $line == "*"* || $line == COMMIT || $line == "-A "*"-m comment --comment \"wg-quick(8) rule for $INTERFACE\""* ]] || continue
-				[[ $line == "-A"* ]] && found=1
-				printf -v restore '%s%s\n' "$restore" "${line/#-A/-D}"
-			done < <($iptables-save 2>/dev/null)
+			for table in raw mangle; do
+				printf -v restore '%s*%s\n' "$restore" "$table"
+				for chain in PREROUTING POSTROUTING; do
+					[[ $table == raw && $chain == POSTROUTING ]] && continue
+					while read -r line; do
+						[[ $line == "-A "*"-m comment --comment \"wg-quick(8) rule for $INTERFACE\""* ]] || continue
+						found=1
+						printf -v restore '%s%s\n' "$restore" "${line/#-A/-D}"
+					done < <($iptables -t $table -S $chain 2>/dev/null)
+				done
+				printf -v restore '%sCOMMIT\n' "$restore"
+			done
 			[[ $found -ne 1 ]] || echo -n "$restore" | cmd $iptables-restore -n
 		done
 	fi
@@ -251,6 +260,16 @@ set_config() {
 	cmd wg setconf "$INTERFACE" <(echo "$WG_CONFIG")
 }
 
+checkpoint() {
+	[[ -n $CHECKPOINT ]] || return 0
+	cmd wg checkpoint "$INTERFACE" "$CHECKPOINT" || true
+}
+
+restore_endpoints() {
+	[[ -n $CHECKPOINT && -e $CHECKPOINT ]] || return 0
+	cmd wg restore-endpoints "$INTERFACE" "$CHECKPOINT" || true
+}
+
 save_config() {
 	local old_umask new_config current_config address cmd
 	[[ $(ip -all -brief address show dev "$INTERFACE") =~ ^$INTERFACE\ +\ [A-Z]+\ +(.+)$ ]] || true
@@ -264,6 +283,7 @@ save_config() {
 	[[ -n $MTU && $(ip link show dev "$INTERFACE") =~ mtu\ ([0-9]+) ]] && new_config+="MTU = ${BASH_REMATCH[1]}"$'\n'
 	[[ -n $TABLE ]] && new_config+="Table = $TABLE"$'\n'
 	[[ $SAVE_CONFIG -eq 0 ]] || new_config+=$'SaveConfig = true\n'
+	[[ -z $CHECKPOINT ]] || new_config+="Checkpoint = $CHECKPOINT"$'\n'
 	for cmd in "${PRE_UP[@]}"; do
 		new_config+="PreUp = $cmd"$'\n'
 	done
@@ -318,6 +338,9 @@ cmd_usage() {
 	    to configure DNS. The string \`%i' is expanded to INTERFACE.
 	  - SaveConfig: if set to \`true', the configuration is saved from the current
 	    state of the interface upon shutdown.
+	  - Checkpoint: an optional file to which the endpoint each peer was last
+	    heard from is saved upon shutdown, and from which recent ones are given
+	    back to peers without an endpoint upon startup.
 
 	See wg-quick(8) for more info and examples.
 	_EOF
@@ -330,6 +353,7 @@ cmd_up() {
 	execute_hooks "${PRE_UP[@]}"
 	add_if
 	set_config
+	restore_endpoints
 	for i in "${ADDRESSES[@]}"; do
 		add_addr "$i"
 	done
@@ -345,6 +369,7 @@ cmd_up() {
 cmd_down() {
 	[[ " $(wg show interfaces) " == *" $INTERFACE "* ]] || die "\`$INTERFACE' is not a WireGuard interface"
 	execute_hooks "${PRE_DOWN[@]}"
+	checkpoint
 	[[ $SAVE_CONFIG -eq 0 ]] || save_config
 	del_if
 	unset_dns || true
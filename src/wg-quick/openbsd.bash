@@ -24,6 +24,7 @@ POST_UP=( )
 PRE_DOWN=( )
 POST_DOWN=( )
 SAVE_CONFIG=0
+CHECKPOINT=""
 CONFIG_FILE=""
 PROGRAM="${0##*/}"
 ARGS=( "$@" )
@@ -67,6 +68,7 @@ parse_options() {
 			PostUp) POST_UP+=( "$value" ); continue ;;
 			PostDown) POST_DOWN+=( "$value" ); continue ;;
 			SaveConfig) read_bool SAVE_CONFIG "$value"; continue ;;
+			Checkpoint) CHECKPOINT="$value"; continue ;;
 			esac
 		fi
 		WG_CONFIG+="$line"$'\n'
@@ -342,6 +344,16 @@ set_config() {
 	cmd wg setconf "$REAL_INTERFACE" <(echo "$WG_CONFIG")
 }
 
+checkpoint() {
+	[[ -n $CHECKPOINT ]] || return 0
+	cmd wg checkpoint "$REAL_INTERFACE" "$CHECKPOINT" || true
+}
+
+restore_endpoints() {
+	[[ -n $CHECKPOINT && -e $CHECKPOINT ]] || return 0
+	cmd wg restore-endpoints "$REAL_INTERFACE" "$CHECKPOINT" || true
+}
+
 save_config() {
 	local old_umask new_config current_config address network cmd
 	new_config=$'[Interface]\n'
@@ -355,6 +367,7 @@ save_config() {
 	[[ -n $MTU ]] && new_config+="MTU = $MTU"$'\n'
 	[[ -n $TABLE ]] && new_config+="Table = $TABLE"$'\n'
 	[[ $SAVE_CONFIG -eq 0 ]] || new_config+=$'SaveConfig = true\n'
+	[[ -z $CHECKPOINT ]] || new_config+="Checkpoint = $CHECKPOINT"$'\n'
 	for cmd in "${PRE_UP[@]}"; do
 		new_config+="PreUp = $cmd"$'\n'
 	done
@@ -410,6 +423,9 @@ cmd_usage() {
 	    to configure DNS. The string \`%i' is expanded to INTERFACE.
 	  - SaveConfig: if set to \`true', the configuration is saved from the current
 	    state of the interface upon shutdown.
+	  - Checkpoint: an optional file to which the endpoint each peer was last
+	    heard from is saved upon shutdown, and from which recent ones are given
+	    back to peers without an endpoint upon startup.
 
 	See wg-quick(8) for more info and examples.
 	_EOF
@@ -422,6 +438,7 @@ cmd_up() {
 	execute_hooks "${PRE_UP[@]}"
 	add_if
 	set_config
+	restore_endpoints
 	for i in "${ADDRESSES[@]}"; do
 		add_addr "$i"
 	done
@@ -442,6 +459,7 @@ cmd_down() {
 		die "\`$INTERFACE' is not a WireGuard interface"
 	fi
 	execute_hooks "${PRE_DOWN[@]}"
+	checkpoint
 	[[ $SAVE_CONFIG -eq 0 ]] || save_config
 	del_if
 	unset_dns
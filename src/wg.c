@@ -25,15 +25,28 @@ static const struct {
 	{ "syncconf", setconf_main, "Synchronizes a configuration file to a WireGuard interface" },
 	{ "genkey", genkey_main, "Generates a new private key and writes it to stdout" },
 	{ "genpsk", genkey_main, "Generates a new preshared key and writes it to stdout" },
-	{ "pubkey", pubkey_main, "Reads a private key from stdin and writes a public key to stdout" }
+	{ "pubkey", pubkey_main, "Reads a private key from stdin and writes a public key to stdout" },
+	{ "batch", batch_main, "Runs set, setconf, addconf, syncconf, show and showconf commands read from a file or stdin" },
+	{ "daemon", daemon_main, "Caches device state and answers queries from other invocations over a control socket" },
+	{ "diff", diff_main, "Shows what syncconf would change on an interface for a configuration file" },
+	{ "gc", gc_main, "Removes peers that have not completed a handshake in a given time" },
+	{ "rotate-psk", rotate_psk_main, "Replaces preshared keys with new random ones, saving them to a file or directory" },
+	{ "mesh", mesh_main, "Writes the configuration of every node of a full mesh from an inventory" },
+	{ "resolve-status", resolve_status_main, "Shows the endpoints being resolved in the background, and how each last went" },
+	{ "checkpoint", checkpoint_main, "Saves the endpoint each peer was last heard from to a file, for restore-endpoints" },
+	{ "restore-endpoints", restore_endpoints_main, "Gives peers without an endpoint the recent one saved by checkpoint" },
+	{ "complete", complete_main, NULL },
+	{ "remove-firewall", remove_firewall_main, NULL }
 };
 
 static void show_usage(FILE *file)
 {
 	fprintf(file, "Usage: %s <cmd> [<args>]\n\n", PROG_NAME);
 	fprintf(file, "Available subcommands:\n");
-	for (size_t i = 0; i < sizeof(subcommands) / sizeof(subcommands[0]); ++i)
-		fprintf(file, "  %s: %s\n", subcommands[i].subcommand, subcommands[i].description);
+	for (size_t i = 0; i < sizeof(subcommands) / sizeof(subcommands[0]); ++i) {
+		if (subcommands[i].description)
+			fprintf(file, "  %s: %s\n", subcommands[i].subcommand, subcommands[i].description);
+	}
 	fprintf(file, "You may pass `--help' to any of these subcommands to view usage.\n");
 }
 
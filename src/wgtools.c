@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "curve25519.h"
+#include "encoding.h"
+#include "format.h"
+#include "ipc.h"
+#include "wgtools.h"
+
+_Static_assert(WG_KEY_LEN == 32 && WG_KEY_LEN_BASE64 == 45 && CURVE25519_KEY_SIZE == 32, "wgtools.h key sizes are out of date");
+
+int wgtools_api_version(void)
+{
+	return WGTOOLS_API_VERSION;
+}
+
+void wgtools_session_begin(void)
+{
+	ipc_session_begin();
+}
+
+void wgtools_session_end(void)
+{
+	ipc_session_end();
+}
+
+char *wgtools_list_devices(void)
+{
+	return ipc_list_devices();
+}
+
+int wgtools_get_device(struct wgdevice **dev, const char *interface)
+{
+	return ipc_get_device(dev, interface);
+}
+
+int wgtools_set_device(struct wgdevice *dev)
+{
+	return ipc_set_device(dev);
+}
+
+int wgtools_get_link_stats(struct wglinkstats *stats, const char *interface)
+{
+	return ipc_get_link_stats(stats, interface);
+}
+
+void wgtools_free_device(struct wgdevice *dev)
+{
+	free_wgdevice(dev);
+}
+
+struct wgdevice *wgtools_read_config(FILE *f, bool append)
+{
+	struct wgdevice *device = config_read_file(f, append);
+
+	if (!device)
+		errno = EINVAL;
+	return device;
+}
+
+struct wgdevice *wgtools_read_args(int argc, char *argv[])
+{
+	struct wgdevice *device = config_read_cmd(argv, argc);
+
+	if (!device)
+		errno = EINVAL;
+	return device;
+}
+
+int wgtools_write_config(FILE *f, const struct wgdevice *dev)
+{
+	format_conf(f, dev);
+	return fflush(f) || ferror(f) ? -(errno ?: EIO) : 0;
+}
+
+int wgtools_write_dump(FILE *f, const struct wgdevice *dev, bool with_interface)
+{
+	format_dump(f, dev, with_interface);
+	return fflush(f) || ferror(f) ? -(errno ?: EIO) : 0;
+}
+
+void wgtools_key_to_base64(char *base64, const uint8_t *key)
+{
+	key_to_base64(base64, key);
+}
+
+bool wgtools_key_from_base64(uint8_t *key, const char *base64)
+{
+	return key_from_base64(key, base64);
+}
+
+void wgtools_generate_public_key(uint8_t *public_key, const uint8_t *private_key)
+{
+	curve25519_generate_public(public_key, private_key);
+}
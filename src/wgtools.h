@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2020 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * The stable interface of libwgtools, for programs that would otherwise fork
+ * wg(8) for every query or change. The structures are those of containers.h,
+ * installed alongside, and their layout is covered by the soname version.
+ * Functions returning int return 0 on success and a negative errno otherwise,
+ * with errno set accordingly. Diagnostics are printed to stderr, as by wg(8).
+ *
+ * The library honours the same environment variables as wg(8), described in
+ * its man page, so a program gets the behaviour its user configured for wg(8):
+ *
+ *   WG_DAEMON=never                 listings and gets never go through `wg daemon'
+ *   WG_ALLOWED_IPS_ORDER=sorted     wgtools_set_device() sends allowed IPs sorted
+ *   WG_APPLY_CHUNK_SIZE, WG_APPLY_PACING, WG_APPLY_ORDER, WG_APPLY_TIMING
+ *                                   wgtools_set_device() splits and paces large sets
+ *   WG_ENDPOINT_RESOLUTION, WG_ENDPOINT_RESOLUTION_RETRIES
+ *                                   how wgtools_read_config() and wgtools_read_args()
+ *                                   resolve endpoint names
+ *
+ * A program wanting the defaults whatever its environment holds should unset
+ * these before its first call.
+ */
+
+#ifndef WGTOOLS_H
+#define WGTOOLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "containers.h"
+
+#define WGTOOLS_API_VERSION 3
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define WGTOOLS_API __attribute__((visibility("default")))
+#else
+#define WGTOOLS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+WGTOOLS_API int wgtools_api_version(void);
+
+/* Between these, kernel sockets and their buffers are reused from one call to
+ * the next, rather than being opened anew each time. They may be nested, and
+ * the calls in between must come from a single thread. */
+WGTOOLS_API void wgtools_session_begin(void);
+WGTOOLS_API void wgtools_session_end(void);
+
+/* While `wg daemon' is running in the caller's network namespace, listings and
+ * gets are answered from its cache, unless WG_DAEMON=never is set in the
+ * environment or it takes longer than two seconds to answer.
+ * Returns first\0second\0third\0forth\0last\0\0, to be released with free(). */
+WGTOOLS_API char *wgtools_list_devices(void);
+WGTOOLS_API int wgtools_get_device(struct wgdevice **dev, const char *interface);
+WGTOOLS_API int wgtools_set_device(struct wgdevice *dev);
+WGTOOLS_API void wgtools_free_device(struct wgdevice *dev);
+
+/* Reads the counters of the interface itself in a single request, whatever its
+ * number of peers. Only supported on Linux. */
+WGTOOLS_API int wgtools_get_link_stats(struct wglinkstats *stats, const char *interface);
+
+/* Parses the setconf(8) file format, or the arguments of `wg set' without the
+ * interface name, returning NULL on error. The device name is left empty. With
+ * WG_ENDPOINT_RESOLUTION=background in the environment, endpoints given as names
+ * are left unset, with the names in deferred_endpoint for the caller to resolve. */
+WGTOOLS_API struct wgdevice *wgtools_read_config(FILE *f, bool append);
+WGTOOLS_API struct wgdevice *wgtools_read_args(int argc, char *argv[]);
+
+/* Formats like `wg showconf' and `wg show dump' respectively. */
+WGTOOLS_API int wgtools_write_config(FILE *f, const struct wgdevice *dev);
+WGTOOLS_API int wgtools_write_dump(FILE *f, const struct wgdevice *dev, bool with_interface);
+
+/* Keys are 32 bytes, and their base64 encoding 44 characters and a terminating NUL. Plain
+ * pointers rather than C99 array parameters are used so that C++ can include this header. */
+WGTOOLS_API void wgtools_key_to_base64(char *base64, const uint8_t *key);
+WGTOOLS_API bool wgtools_key_from_base64(uint8_t *key, const char *base64);
+WGTOOLS_API void wgtools_generate_public_key(uint8_t *public_key, const uint8_t *private_key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif